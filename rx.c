@@ -0,0 +1,1416 @@
+/*
+ * A regular expression engine guaranteeing matching time linear in the size
+ * of the input.
+ *
+ * Patterns are parsed into a syntax tree which is compiled into a Thompson
+ * NFA operating on UTF-8 encoded bytes, once for reading forward and once,
+ * with all concatenations reversed, for reading backward.
+ *
+ * A search runs a DFA, whose states are constructed lazily from the forward
+ * NFA and cached, over the input. Its states are sets of NFA instructions
+ * partitioned into groups by the position at which the corresponding match
+ * attempt started; earlier attempts take precedence over later ones. Once
+ * an attempt reaches a match, all later ones are abandoned and no new ones
+ * are started. The DFA keeps running until no attempt is left, the last
+ * match reached thus ends the leftmost-longest match. Its start is found by
+ * running the DFA of the reverse NFA backward from there. Subexpression
+ * matches, if requested, are determined by a Pike VM constrained to the
+ * match.
+ *
+ * Zero width assertions depend on the bytes on both sides of a position.
+ * DFA states remember the context of the last byte read, the assertions are
+ * evaluated when the next one is known.
+ *
+ * Every byte of input causes at most one new DFA state to be constructed in
+ * time proportional to the size of the NFA. The cache is flushed whenever
+ * it exceeds DFA_CACHE bytes.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <wchar.h>
+#include <wctype.h>
+
+#include "rx.h"
+#include "util.h"
+
+#ifndef RE_DUP_MAX
+#define RE_DUP_MAX 255
+#endif
+
+/* maximal number of NFA instructions, limits the expansion of intervals */
+#define PROG_MAX (1 << 20)
+/* maximal size in bytes of the DFA states cached for one direction */
+#define DFA_CACHE (1 << 22)
+
+#define RUNE_MAX 0x10FFFF
+
+typedef unsigned long Rune;
+
+typedef struct {
+	Rune lo, hi;
+} Range;
+
+typedef struct {
+	Range *ranges;       /* sorted and disjoint after set_normalize */
+	size_t len, size;
+} Set;
+
+enum {
+	NODE_EMPTY,
+	NODE_SET,            /* a character of set */
+	NODE_CAT,            /* left followed by right */
+	NODE_ALT,            /* left or right */
+	NODE_REPEAT,         /* left repeated [min, max] times, max < 0 means unbounded */
+	NODE_GROUP,          /* left as subexpression number min */
+	NODE_ASSERT,         /* zero width assertion of kind min */
+};
+
+typedef struct Node Node;
+struct Node {
+	int type;
+	Node *left, *right;
+	int min, max;
+	Set set;
+	Node *alloc;         /* next allocated node, to free them all */
+};
+
+enum {
+	ASSERT_BOL,          /* ^ */
+	ASSERT_EOL,          /* $ */
+	ASSERT_BEGIN,        /* \` */
+	ASSERT_END,          /* \' */
+	ASSERT_WORD_BEGIN,   /* \< */
+	ASSERT_WORD_END,     /* \> */
+	ASSERT_WORD,         /* \b */
+	ASSERT_NOT_WORD,     /* \B */
+};
+
+/* context of a position as seen by the assertions */
+enum {
+	CTX_OTHER,
+	CTX_WORD,
+	CTX_NEWLINE,
+	CTX_EDGE,            /* beginning or end of the input */
+	CTX_EDGE_NOT,        /* same, but with REG_NOTBOL or REG_NOTEOL in effect */
+	CTX_MAX,
+};
+
+enum {
+	OP_RANGE,            /* consume a byte within [lo, hi], continue at x */
+	OP_SPLIT,            /* continue at x and (with lower priority) at y */
+	OP_ASSERT,           /* continue at x if assertion lo holds */
+	OP_SAVE,             /* store position in capture slot y, continue at x */
+	OP_MATCH,
+};
+
+typedef struct {
+	unsigned char op, lo, hi;
+	int x, y;
+} Inst;
+
+typedef struct {
+	Inst *inst;
+	int len, size;
+	int start;
+	bool reverse;                 /* whether the input is read backward */
+	bool newline;                 /* REG_NEWLINE semantics of ^ and $ */
+	int nclasses;                 /* bytes are partitioned into classes */
+	unsigned char classes[256];   /* which no instruction distinguishes */
+	unsigned char rep[256];       /* a byte of each class */
+	unsigned char ctx[256];       /* context of each class */
+} Prog;
+
+#define STATE_CTX     0x07  /* context of the last byte read */
+#define STATE_MATCHED 0x08  /* an attempt matched, no new ones are started */
+#define STATE_HIT     0x10  /* a match ended in front of the last byte read */
+#define STATE_DEAD    0x20  /* no attempt left */
+#define STATE_START   0x40  /* the last group is an attempt starting here */
+
+typedef struct State State;
+struct State {
+	State *hash;         /* next state in the same bucket */
+	unsigned flags;
+	size_t len;
+	int *kernel;         /* instructions, every group terminated by -1 */
+	State *next[];       /* per byte class, then both kinds of input edges */
+};
+
+typedef struct {
+	const Prog *prog;
+	bool anchored;       /* whether only one attempt is made, at the start */
+	State **table;       /* hash table of all cached states */
+	size_t table_size, states, mem;
+	State *start[CTX_MAX];
+	unsigned flushes;    /* number of times the cache was flushed */
+	int *kernel;         /* of the state under construction */
+	int *stack;          /* closure work list */
+	int *ranges;         /* consuming instructions reached by a closure */
+	unsigned *visited;   /* per instruction, by the current closure */
+	unsigned *added;     /* per instruction, to the current kernel */
+	unsigned mark;
+} Dfa;
+
+struct Rx {
+	Prog forward, backward;
+	Dfa dfa, rdfa;
+	int cflags;
+	int nsub;
+};
+
+typedef struct {
+	const char *s;       /* current position within the pattern */
+	int cflags;
+	int err;
+	int nsub;
+	int depth;           /* of nested groups */
+	Node *nodes;
+} Parser;
+
+typedef struct {
+	unsigned char lo[4], hi[4];
+	int len;
+} Sequence;
+
+typedef struct {
+	Prog *prog;
+	bool captures;
+	int err;
+	Sequence *seqs;      /* UTF-8 encoding of the set being compiled */
+	size_t seqs_len, seqs_size;
+} Compiler;
+
+static Node *parse_alt(Parser*);
+
+static bool set_add(Set *set, Rune lo, Rune hi) {
+	if (set->len == set->size) {
+		size_t size = set->size ? 2 * set->size : 8;
+		Range *ranges = realloc(set->ranges, size * sizeof *ranges);
+		if (!ranges)
+			return false;
+		set->ranges = ranges;
+		set->size = size;
+	}
+	set->ranges[set->len++] = (Range){ .lo = lo, .hi = hi };
+	return true;
+}
+
+static bool set_append(Set *set, const Set *other) {
+	for (size_t i = 0; i < other->len; i++) {
+		if (!set_add(set, other->ranges[i].lo, other->ranges[i].hi))
+			return false;
+	}
+	return true;
+}
+
+static int range_cmp(const void *a, const void *b) {
+	const Range *r1 = a, *r2 = b;
+	return r1->lo < r2->lo ? -1 : r1->lo > r2->lo;
+}
+
+static void set_normalize(Set *set) {
+	if (set->len == 0)
+		return;
+	qsort(set->ranges, set->len, sizeof *set->ranges, range_cmp);
+	size_t len = 1;
+	for (size_t i = 1; i < set->len; i++) {
+		Range *last = &set->ranges[len-1], *r = &set->ranges[i];
+		if (r->lo <= last->hi + 1)
+			last->hi = MAX(last->hi, r->hi);
+		else
+			set->ranges[len++] = *r;
+	}
+	set->len = len;
+}
+
+static bool set_negate(Set *set) {
+	set_normalize(set);
+	Set neg = { 0 };
+	Rune lo = 0;
+	for (size_t i = 0; i < set->len; i++) {
+		if (set->ranges[i].lo > lo && !set_add(&neg, lo, set->ranges[i].lo - 1))
+			goto err;
+		lo = set->ranges[i].hi + 1;
+	}
+	if (lo <= RUNE_MAX && !set_add(&neg, lo, RUNE_MAX))
+		goto err;
+	free(set->ranges);
+	*set = neg;
+	return true;
+err:
+	free(neg.ranges);
+	return false;
+}
+
+static bool set_remove(Set *set, Rune c) {
+	for (size_t i = 0; i < set->len; i++) {
+		Range *r = &set->ranges[i];
+		if (c < r->lo || c > r->hi)
+			continue;
+		if (r->lo == r->hi) {
+			*r = set->ranges[--set->len];
+		} else if (c == r->lo) {
+			r->lo++;
+		} else if (c == r->hi) {
+			r->hi--;
+		} else {
+			Rune hi = r->hi;
+			r->hi = c - 1;
+			return set_add(set, c + 1, hi);
+		}
+		return true;
+	}
+	return true;
+}
+
+static Rune rune_lower(Rune c) {
+#ifdef __STDC_ISO_10646__
+	return towlower(c);
+#else
+	return c < 0x80 ? towlower(c) : c;
+#endif
+}
+
+static Rune rune_upper(Rune c) {
+#ifdef __STDC_ISO_10646__
+	return towupper(c);
+#else
+	return c < 0x80 ? towupper(c) : c;
+#endif
+}
+
+/* add the other case of all characters, for REG_ICASE */
+static bool set_fold(Set *set) {
+	size_t len = set->len;
+	for (size_t i = 0; i < len; i++) {
+		for (Rune c = set->ranges[i].lo; c <= set->ranges[i].hi; c++) {
+			Rune l = rune_lower(c), u = rune_upper(c);
+			if ((l != c && !set_add(set, l, l)) || (u != c && !set_add(set, u, u)))
+				return false;
+		}
+	}
+	return true;
+}
+
+static const char *class_names[] = {
+	"alnum", "alpha", "blank", "cntrl", "digit", "graph",
+	"lower", "print", "punct", "space", "upper", "xdigit",
+};
+
+/* characters of the named classes, determined on first use */
+static Set class_sets[LENGTH(class_names)];
+
+static bool set_add_class(Set *set, int class) {
+	Set *c = &class_sets[class];
+	if (c->len == 0) {
+		wctype_t type = wctype(class_names[class]);
+#ifdef __STDC_ISO_10646__
+		Rune max = RUNE_MAX;
+#else
+		Rune max = 0x7F;
+#endif
+		bool inside = false;
+		for (Rune r = 0, lo = 0; r <= max + 1; r++) {
+			bool in = r <= max && (r < 0xD800 || r > 0xDFFF) && iswctype(r, type);
+			if (in && !inside)
+				lo = r;
+			if (!in && inside && !set_add(c, lo, r - 1)) {
+				free(c->ranges);
+				*c = (Set){ 0 };
+				return false;
+			}
+			inside = in;
+		}
+	}
+	return set_append(set, c);
+}
+
+static int class_lookup(const char *name, size_t len) {
+	for (int i = 0; i < LENGTH(class_names); i++) {
+		if (strlen(class_names[i]) == len && !strncmp(class_names[i], name, len))
+			return i;
+	}
+	return -1;
+}
+
+/* decode the UTF-8 encoded character at s, returns its length or 0 */
+static size_t utf8_decode(const char *s, Rune *r) {
+	const unsigned char *u = (const unsigned char*)s;
+	size_t len;
+	if (u[0] < 0x80) {
+		*r = u[0];
+		return 1;
+	} else if (u[0] >= 0xC2 && u[0] <= 0xDF) {
+		*r = u[0] & 0x1F;
+		len = 2;
+	} else if (u[0] >= 0xE0 && u[0] <= 0xEF) {
+		*r = u[0] & 0x0F;
+		len = 3;
+	} else if (u[0] >= 0xF0 && u[0] <= 0xF4) {
+		*r = u[0] & 0x07;
+		len = 4;
+	} else {
+		return 0;
+	}
+	for (size_t i = 1; i < len; i++) {
+		if ((u[i] & 0xC0) != 0x80)
+			return 0;
+		*r = (*r << 6) | (u[i] & 0x3F);
+	}
+	static const Rune min[] = { 0, 0, 0x80, 0x800, 0x10000 };
+	if (*r < min[len] || *r > RUNE_MAX || (*r >= 0xD800 && *r <= 0xDFFF))
+		return 0;
+	return len;
+}
+
+static int utf8_encode(Rune r, unsigned char *s) {
+	if (r < 0x80) {
+		s[0] = r;
+		return 1;
+	} else if (r < 0x800) {
+		s[0] = 0xC0 | (r >> 6);
+		s[1] = 0x80 | (r & 0x3F);
+		return 2;
+	} else if (r < 0x10000) {
+		s[0] = 0xE0 | (r >> 12);
+		s[1] = 0x80 | ((r >> 6) & 0x3F);
+		s[2] = 0x80 | (r & 0x3F);
+		return 3;
+	}
+	s[0] = 0xF0 | (r >> 18);
+	s[1] = 0x80 | ((r >> 12) & 0x3F);
+	s[2] = 0x80 | ((r >> 6) & 0x3F);
+	s[3] = 0x80 | (r & 0x3F);
+	return 4;
+}
+
+static Node *node_new(Parser *p, int type, Node *left, Node *right) {
+	Node *n = calloc(1, sizeof *n);
+	if (!n) {
+		p->err = REG_ESPACE;
+		return NULL;
+	}
+	n->type = type;
+	n->left = left;
+	n->right = right;
+	n->alloc = p->nodes;
+	p->nodes = n;
+	return n;
+}
+
+static Node *node_set(Parser *p) {
+	return node_new(p, NODE_SET, NULL, NULL);
+}
+
+static Node *node_assert(Parser *p, int kind) {
+	Node *n = node_new(p, NODE_ASSERT, NULL, NULL);
+	if (n)
+		n->min = kind;
+	return n;
+}
+
+/* length of operator `op' at the current position, which in the basic
+ * syntax is escaped (except for `*'), or 0 if there is none */
+static size_t parse_op(Parser *p, char op) {
+	if (op == '*' || (p->cflags & REG_EXTENDED))
+		return p->s[0] == op;
+	return p->s[0] == '\\' && p->s[1] == op ? 2 : 0;
+}
+
+static Node *parse_error(Parser *p, int err) {
+	p->err = err;
+	return NULL;
+}
+
+/* finish a set node: apply REG_ICASE and negation, with REG_NEWLINE a
+ * negated bracket expression does not match a new line */
+static Node *parse_set_done(Parser *p, Node *n, bool negate, bool bracket) {
+	Set *set = &n->set;
+	if ((p->cflags & REG_ICASE) && !set_fold(set))
+		return parse_error(p, REG_ESPACE);
+	if (negate && !set_negate(set))
+		return parse_error(p, REG_ESPACE);
+	if (negate && bracket && (p->cflags & REG_NEWLINE) && !set_remove(set, '\n'))
+		return parse_error(p, REG_ESPACE);
+	set_normalize(set);
+	return n;
+}
+
+static Node *parse_char(Parser *p, Rune c) {
+	Node *n = node_set(p);
+	if (!n)
+		return NULL;
+	if (!set_add(&n->set, c, c))
+		return parse_error(p, REG_ESPACE);
+	return parse_set_done(p, n, false, false);
+}
+
+/* \w, \W, \s and \S */
+static Node *parse_class(Parser *p, const char *name, bool word, bool negate) {
+	Node *n = node_set(p);
+	if (!n)
+		return NULL;
+	if (!set_add_class(&n->set, class_lookup(name, strlen(name))) ||
+	    (word && !set_add(&n->set, '_', '_')))
+		return parse_error(p, REG_ESPACE);
+	return parse_set_done(p, n, negate, false);
+}
+
+/* collating element of a bracket expression at the current position */
+static bool parse_bracket_char(Parser *p, Rune *c) {
+	if (p->s[0] == '[' && (p->s[1] == '.' || p->s[1] == '=')) {
+		char delim = p->s[1];
+		size_t len = utf8_decode(p->s + 2, c);
+		if (len == 0 || p->s[2 + len] != delim || p->s[3 + len] != ']') {
+			p->err = REG_ECOLLATE;
+			return false;
+		}
+		p->s += len + 4;
+		return true;
+	}
+	size_t len = utf8_decode(p->s, c);
+	if (len == 0) {
+		p->err = *p->s ? REG_BADPAT : REG_EBRACK;
+		return false;
+	}
+	p->s += len;
+	return true;
+}
+
+/* bracket expression, the current position is after the opening `[' */
+static Node *parse_bracket(Parser *p) {
+	Node *n = node_set(p);
+	if (!n)
+		return NULL;
+	bool negate = *p->s == '^';
+	if (negate)
+		p->s++;
+	for (const char *begin = p->s; ; ) {
+		if (!*p->s)
+			return parse_error(p, REG_EBRACK);
+		if (*p->s == ']' && p->s != begin) {
+			p->s++;
+			break;
+		}
+		if (p->s[0] == '[' && p->s[1] == ':') {
+			const char *name = p->s + 2, *end = strstr(name, ":]");
+			if (!end)
+				return parse_error(p, REG_EBRACK);
+			int class = class_lookup(name, end - name);
+			if (class == -1)
+				return parse_error(p, REG_ECTYPE);
+			if (!set_add_class(&n->set, class))
+				return parse_error(p, REG_ESPACE);
+			p->s = end + 2;
+			continue;
+		}
+		Rune lo, hi;
+		if (!parse_bracket_char(p, &lo))
+			return NULL;
+		hi = lo;
+		if (p->s[0] == '-' && p->s[1] && p->s[1] != ']') {
+			p->s++;
+			if (!parse_bracket_char(p, &hi))
+				return NULL;
+			if (hi < lo)
+				return parse_error(p, REG_ERANGE);
+		}
+		if (!set_add(&n->set, lo, hi))
+			return parse_error(p, REG_ESPACE);
+	}
+	return parse_set_done(p, n, negate, true);
+}
+
+static Node *parse_escape(Parser *p) {
+	char c = p->s[1];
+	if (!c)
+		return parse_error(p, REG_EESCAPE);
+	if (c >= '1' && c <= '9')
+		return parse_error(p, REG_ESUBREG); /* back references are not regular */
+	p->s += 2;
+	switch (c) {
+	case 'w': return parse_class(p, "alnum", true, false);
+	case 'W': return parse_class(p, "alnum", true, true);
+	case 's': return parse_class(p, "space", false, false);
+	case 'S': return parse_class(p, "space", false, true);
+	case '<': return node_assert(p, ASSERT_WORD_BEGIN);
+	case '>': return node_assert(p, ASSERT_WORD_END);
+	case 'b': return node_assert(p, ASSERT_WORD);
+	case 'B': return node_assert(p, ASSERT_NOT_WORD);
+	case '`': return node_assert(p, ASSERT_BEGIN);
+	case '\'': return node_assert(p, ASSERT_END);
+	}
+	Rune r;
+	size_t len = utf8_decode(p->s - 1, &r);
+	if (len == 0)
+		return parse_error(p, REG_BADPAT);
+	p->s += len - 1;
+	return parse_char(p, r);
+}
+
+/* whether the current position ends a basic regular expression, which is
+ * where `$' acts as an anchor */
+static bool parse_bre_end(Parser *p) {
+	const char *s = p->s + 1;
+	return !*s || (s[0] == '\\' && (s[1] == ')' || s[1] == '|'));
+}
+
+static Node *parse_atom(Parser *p, bool first) {
+	bool ere = p->cflags & REG_EXTENDED;
+	size_t len;
+	if ((len = parse_op(p, '('))) {
+		p->s += len;
+		int sub = ++p->nsub;
+		p->depth++;
+		Node *n = parse_alt(p);
+		p->depth--;
+		if (!n)
+			return NULL;
+		if (!(len = parse_op(p, ')')))
+			return parse_error(p, REG_EPAREN);
+		p->s += len;
+		Node *group = node_new(p, NODE_GROUP, n, NULL);
+		if (group)
+			group->min = sub;
+		return group;
+	}
+	if (!ere && parse_op(p, ')'))
+		return parse_error(p, REG_EPAREN);
+	if ((ere || !first) && *p->s == '*')
+		return parse_error(p, REG_BADRPT);
+	if (ere && (*p->s == '+' || *p->s == '?' || *p->s == '{'))
+		return parse_error(p, REG_BADRPT);
+	if (!ere && p->s[0] == '\\' && (p->s[1] == '{' || (first && (p->s[1] == '+' || p->s[1] == '?'))))
+		return parse_error(p, REG_BADRPT);
+
+	switch (*p->s) {
+	case '[':
+		p->s++;
+		return parse_bracket(p);
+	case '.': {
+		p->s++;
+		Node *n = node_set(p);
+		if (!n)
+			return NULL;
+		/* like glibc's, `.' does not match NUL */
+		if (!set_add(&n->set, 1, RUNE_MAX) ||
+		    ((p->cflags & REG_NEWLINE) && !set_remove(&n->set, '\n')))
+			return parse_error(p, REG_ESPACE);
+		set_normalize(&n->set);
+		return n;
+	}
+	case '^':
+		if (ere || first) {
+			p->s++;
+			return node_assert(p, ASSERT_BOL);
+		}
+		break;
+	case '$':
+		if (ere || parse_bre_end(p)) {
+			p->s++;
+			return node_assert(p, ASSERT_EOL);
+		}
+		break;
+	case '\\':
+		return parse_escape(p);
+	}
+	Rune r;
+	if (!(len = utf8_decode(p->s, &r)))
+		return parse_error(p, REG_BADPAT);
+	p->s += len;
+	return parse_char(p, r);
+}
+
+/* interval, the current position is after the opening brace */
+static bool parse_interval(Parser *p, int *min, int *max) {
+	bool digits = false;
+	*min = 0;
+	for (; *p->s >= '0' && *p->s <= '9'; p->s++, digits = true) {
+		if ((*min = 10 * *min + *p->s - '0') > RE_DUP_MAX)
+			return parse_error(p, REG_BADBR), false;
+	}
+	*max = *min;
+	if (*p->s == ',') {
+		p->s++;
+		*max = -1;
+		if (*p->s >= '0' && *p->s <= '9') {
+			for (*max = 0; *p->s >= '0' && *p->s <= '9'; p->s++) {
+				if ((*max = 10 * *max + *p->s - '0') > RE_DUP_MAX)
+					return parse_error(p, REG_BADBR), false;
+			}
+		}
+		digits = true;
+	}
+	size_t len = parse_op(p, '}');
+	if (!len)
+		return parse_error(p, REG_EBRACE), false;
+	if (!digits || (*max >= 0 && *max < *min))
+		return parse_error(p, REG_BADBR), false;
+	p->s += len;
+	return true;
+}
+
+static Node *parse_repeat(Parser *p, bool first) {
+	Node *n = parse_atom(p, first);
+	while (n) {
+		int min, max;
+		size_t len;
+		if ((len = parse_op(p, '*'))) {
+			min = 0;
+			max = -1;
+		} else if ((len = parse_op(p, '+'))) {
+			min = 1;
+			max = -1;
+		} else if ((len = parse_op(p, '?'))) {
+			min = 0;
+			max = 1;
+		} else if ((len = parse_op(p, '{'))) {
+			p->s += len;
+			len = 0;
+			if (!parse_interval(p, &min, &max))
+				return NULL;
+		} else {
+			break;
+		}
+		if (n->type == NODE_ASSERT) {
+			if (p->cflags & REG_EXTENDED)
+				return parse_error(p, REG_BADRPT);
+			/* in basic syntax a `*' following `^' is literal */
+			p->s -= len;
+			break;
+		}
+		p->s += len;
+		Node *r = node_new(p, NODE_REPEAT, n, NULL);
+		if (r) {
+			r->min = min;
+			r->max = max;
+		}
+		n = r;
+	}
+	return n;
+}
+
+static Node *parse_cat(Parser *p) {
+	Node *n = node_new(p, NODE_EMPTY, NULL, NULL);
+	for (bool first = true; n && *p->s && !parse_op(p, '|') && !(p->depth > 0 && parse_op(p, ')')); ) {
+		Node *r = parse_repeat(p, first);
+		first = r && r->type == NODE_ASSERT && r->min == ASSERT_BOL && !(p->cflags & REG_EXTENDED);
+		n = r ? node_new(p, NODE_CAT, n, r) : NULL;
+	}
+	return n;
+}
+
+static Node *parse_alt(Parser *p) {
+	Node *n = parse_cat(p);
+	for (size_t len; n && (len = parse_op(p, '|')); ) {
+		p->s += len;
+		Node *r = parse_cat(p);
+		n = r ? node_new(p, NODE_ALT, n, r) : NULL;
+	}
+	return n;
+}
+
+static int emit(Compiler *c, int op, int lo, int hi, int x, int y) {
+	Prog *p = c->prog;
+	if (c->err)
+		return 0;
+	if (p->len == p->size) {
+		int size = p->size ? 2 * p->size : 64;
+		Inst *inst = size <= PROG_MAX ? realloc(p->inst, size * sizeof *inst) : NULL;
+		if (!inst) {
+			c->err = REG_ESPACE;
+			return 0;
+		}
+		p->inst = inst;
+		p->size = size;
+	}
+	p->inst[p->len] = (Inst){ .op = op, .lo = lo, .hi = hi, .x = x, .y = y };
+	return p->len++;
+}
+
+static bool compile_sequence(Compiler *c, const unsigned char *lo, const unsigned char *hi, int len) {
+	if (c->seqs_len == c->seqs_size) {
+		size_t size = c->seqs_size ? 2 * c->seqs_size : 16;
+		Sequence *seqs = realloc(c->seqs, size * sizeof *seqs);
+		if (!seqs)
+			return false;
+		c->seqs = seqs;
+		c->seqs_size = size;
+	}
+	Sequence *seq = &c->seqs[c->seqs_len++];
+	memcpy(seq->lo, lo, len);
+	memcpy(seq->hi, hi, len);
+	seq->len = len;
+	return true;
+}
+
+/* split [lo, hi] into ranges whose UTF-8 encodings only differ in a range
+ * of values at each byte position */
+static bool compile_utf8(Compiler *c, Rune lo, Rune hi) {
+	static const Rune max[] = { 0x7F, 0x7FF, 0xFFFF };
+	if (lo > hi)
+		return true;
+	if (lo <= 0xDFFF && hi >= 0xD800) {
+		return (lo >= 0xD800 || compile_utf8(c, lo, 0xD7FF)) &&
+		       (hi <= 0xDFFF || compile_utf8(c, 0xE000, hi));
+	}
+	for (int i = 0; i < LENGTH(max); i++) {
+		if (lo <= max[i] && hi > max[i])
+			return compile_utf8(c, lo, max[i]) && compile_utf8(c, max[i] + 1, hi);
+	}
+	for (int i = 1; i < 4; i++) {
+		Rune m = ((Rune)1 << (6 * i)) - 1;
+		if ((lo & ~m) != (hi & ~m)) {
+			if ((lo & m) != 0)
+				return compile_utf8(c, lo, lo | m) && compile_utf8(c, (lo | m) + 1, hi);
+			if ((hi & m) != m)
+				return compile_utf8(c, lo, (hi & ~m) - 1) && compile_utf8(c, hi & ~m, hi);
+		}
+	}
+	unsigned char l[4], h[4];
+	int len = utf8_encode(lo, l);
+	utf8_encode(hi, h);
+	return compile_sequence(c, l, h, len);
+}
+
+static int compile_set(Compiler *c, const Set *set, int next) {
+	c->seqs_len = 0;
+	for (size_t i = 0; i < set->len; i++) {
+		if (!compile_utf8(c, set->ranges[i].lo, set->ranges[i].hi)) {
+			c->err = REG_ESPACE;
+			return 0;
+		}
+	}
+	if (c->seqs_len == 0)
+		return emit(c, OP_RANGE, 1, 0, next, 0); /* never matches */
+	int entry = -1;
+	for (size_t i = c->seqs_len; i-- > 0; ) {
+		const Sequence *seq = &c->seqs[i];
+		int e = next;
+		for (int j = 0; j < seq->len; j++) {
+			int b = c->prog->reverse ? j : seq->len - 1 - j;
+			e = emit(c, OP_RANGE, seq->lo[b], seq->hi[b], e, 0);
+		}
+		entry = entry == -1 ? e : emit(c, OP_SPLIT, 0, 0, e, entry);
+	}
+	return entry;
+}
+
+/* emit instructions matching `n' and continuing at `next', return the entry */
+static int compile(Compiler *c, const Node *n, int next) {
+	switch (n->type) {
+	case NODE_EMPTY:
+		return next;
+	case NODE_SET:
+		return compile_set(c, &n->set, next);
+	case NODE_CAT:
+		if (c->prog->reverse)
+			return compile(c, n->right, compile(c, n->left, next));
+		return compile(c, n->left, compile(c, n->right, next));
+	case NODE_ALT: {
+		int left = compile(c, n->left, next);
+		int right = compile(c, n->right, next);
+		return emit(c, OP_SPLIT, 0, 0, left, right);
+	}
+	case NODE_REPEAT: {
+		int entry = next;
+		if (n->max < 0) {
+			int loop = emit(c, OP_SPLIT, 0, 0, 0, next);
+			int body = compile(c, n->left, loop);
+			if (c->err)
+				return 0;
+			c->prog->inst[loop].x = body;
+			entry = loop;
+		} else {
+			for (int i = n->min; i < n->max; i++)
+				entry = emit(c, OP_SPLIT, 0, 0, compile(c, n->left, entry), next);
+		}
+		for (int i = 0; i < n->min; i++)
+			entry = compile(c, n->left, entry);
+		return entry;
+	}
+	case NODE_GROUP:
+		if (!c->captures)
+			return compile(c, n->left, next);
+		next = emit(c, OP_SAVE, 0, 0, next, 2 * n->min + 1);
+		return emit(c, OP_SAVE, 0, 0, compile(c, n->left, next), 2 * n->min);
+	case NODE_ASSERT:
+		return emit(c, OP_ASSERT, n->min, 0, next, 0);
+	}
+	return next;
+}
+
+static int byte_context(unsigned char b) {
+	if (b == '\n')
+		return CTX_NEWLINE;
+	/* non-ASCII characters are considered part of words */
+	if (b >= 0x80 || b == '_' || (b >= '0' && b <= '9') ||
+	    (b >= 'a' && b <= 'z') || (b >= 'A' && b <= 'Z'))
+		return CTX_WORD;
+	return CTX_OTHER;
+}
+
+/* partition the bytes into classes no instruction distinguishes */
+static void compile_classes(Prog *p) {
+	bool edge[257] = { 0 };
+	static const unsigned char words[] = { '\n', '\n' + 1, '0', '9' + 1, 'A', 'Z' + 1, '_', '_' + 1, 'a', 'z' + 1, 0x80, 0xC0 };
+	for (int i = 0; i < LENGTH(words); i++)
+		edge[words[i]] = true;
+	for (int i = 0; i < p->len; i++) {
+		if (p->inst[i].op == OP_RANGE && p->inst[i].lo <= p->inst[i].hi) {
+			edge[p->inst[i].lo] = true;
+			edge[p->inst[i].hi + 1] = true;
+		}
+	}
+	int class = 0;
+	for (int b = 0; b < 256; b++) {
+		if (b > 0 && edge[b])
+			class++;
+		p->classes[b] = class;
+		p->rep[class] = b;
+		p->ctx[class] = byte_context(b);
+	}
+	p->nclasses = class + 1;
+}
+
+static bool prog_compile(Prog *p, const Node *root, int cflags, bool reverse) {
+	Compiler c = { .prog = p, .captures = !reverse && !(cflags & REG_NOSUB) };
+	p->reverse = reverse;
+	p->newline = cflags & REG_NEWLINE;
+	int next = emit(&c, OP_MATCH, 0, 0, 0, 0);
+	if (c.captures)
+		next = emit(&c, OP_SAVE, 0, 0, next, 1);
+	next = compile(&c, root, next);
+	if (c.captures)
+		next = emit(&c, OP_SAVE, 0, 0, next, 0);
+	p->start = next;
+	free(c.seqs);
+	if (c.err)
+		return false;
+	compile_classes(p);
+	return true;
+}
+
+static bool dfa_init(Dfa *d, const Prog *p, bool anchored) {
+	d->prog = p;
+	d->anchored = anchored;
+	d->table_size = 64;
+	d->table = calloc(d->table_size, sizeof *d->table);
+	d->kernel = malloc((2 * p->len + 2) * sizeof *d->kernel);
+	d->stack = malloc((2 * p->len + 2) * sizeof *d->stack);
+	d->ranges = malloc(p->len * sizeof *d->ranges);
+	d->visited = calloc(p->len, sizeof *d->visited);
+	d->added = calloc(p->len, sizeof *d->added);
+	return d->table && d->kernel && d->stack && d->ranges && d->visited && d->added;
+}
+
+static void dfa_flush(Dfa *d) {
+	for (size_t i = 0; i < d->table_size; i++) {
+		for (State *s = d->table[i], *next; s; s = next) {
+			next = s->hash;
+			free(s);
+		}
+		d->table[i] = NULL;
+	}
+	memset(d->start, 0, sizeof d->start);
+	d->states = d->mem = 0;
+	d->flushes++;
+}
+
+static void dfa_free(Dfa *d) {
+	if (d->table)
+		dfa_flush(d);
+	free(d->table);
+	free(d->kernel);
+	free(d->stack);
+	free(d->ranges);
+	free(d->visited);
+	free(d->added);
+}
+
+static size_t dfa_hash(unsigned flags, const int *kernel, size_t len) {
+	size_t hash = 2166136261u ^ flags;
+	for (size_t i = 0; i < len; i++)
+		hash = (hash ^ (unsigned)kernel[i]) * 16777619u;
+	return hash;
+}
+
+/* look up the state, add it to the cache if necessary */
+static State *dfa_state(Dfa *d, unsigned flags, const int *kernel, size_t len) {
+	size_t hash = dfa_hash(flags, kernel, len);
+	for (State *s = d->table[hash & (d->table_size - 1)]; s; s = s->hash) {
+		if (s->flags == flags && s->len == len && !memcmp(s->kernel, kernel, len * sizeof *kernel))
+			return s;
+	}
+	size_t transitions = d->prog->nclasses + 2;
+	size_t size = sizeof(State) + transitions * sizeof(State*) + len * sizeof *kernel;
+	if (d->mem + size > DFA_CACHE)
+		dfa_flush(d);
+	if (d->states >= d->table_size) {
+		size_t table_size = 2 * d->table_size;
+		State **table = calloc(table_size, sizeof *table);
+		if (!table)
+			return NULL;
+		for (size_t i = 0; i < d->table_size; i++) {
+			for (State *s = d->table[i], *next; s; s = next) {
+				next = s->hash;
+				size_t bucket = dfa_hash(s->flags, s->kernel, s->len) & (table_size - 1);
+				s->hash = table[bucket];
+				table[bucket] = s;
+			}
+		}
+		free(d->table);
+		d->table = table;
+		d->table_size = table_size;
+	}
+	State *s = calloc(1, size);
+	if (!s)
+		return NULL;
+	s->flags = flags;
+	s->len = len;
+	s->kernel = (int*)&s->next[transitions];
+	memcpy(s->kernel, kernel, len * sizeof *kernel);
+	size_t bucket = hash & (d->table_size - 1);
+	s->hash = d->table[bucket];
+	d->table[bucket] = s;
+	d->states++;
+	d->mem += size;
+	return s;
+}
+
+static State *dfa_start(Dfa *d, int ctx) {
+	if (!d->start[ctx]) {
+		int kernel[] = { d->prog->start, -1 };
+		d->start[ctx] = dfa_state(d, ctx, kernel, LENGTH(kernel));
+	}
+	return d->start[ctx];
+}
+
+static bool assertion(const Prog *p, int kind, int before, int after) {
+	bool word_before = before == CTX_WORD, word_after = after == CTX_WORD;
+	switch (kind) {
+	case ASSERT_BOL:
+		return before == CTX_EDGE || (p->newline && before == CTX_NEWLINE);
+	case ASSERT_EOL:
+		return after == CTX_EDGE || (p->newline && after == CTX_NEWLINE);
+	case ASSERT_BEGIN:
+		return before == CTX_EDGE || before == CTX_EDGE_NOT;
+	case ASSERT_END:
+		return after == CTX_EDGE || after == CTX_EDGE_NOT;
+	case ASSERT_WORD_BEGIN:
+		return !word_before && word_after;
+	case ASSERT_WORD_END:
+		return word_before && !word_after;
+	case ASSERT_WORD:
+		return word_before != word_after;
+	case ASSERT_NOT_WORD:
+		return word_before == word_after;
+	}
+	return false;
+}
+
+/* follow the instructions reachable from `pc' without consuming input,
+ * collect those consuming a byte and return whether a match is reached */
+static bool dfa_closure(Dfa *d, int pc, int before, int after, size_t *ranges) {
+	const Prog *p = d->prog;
+	bool match = false;
+	size_t top = 0;
+	d->stack[top++] = pc;
+	while (top > 0) {
+		pc = d->stack[--top];
+		if (d->visited[pc] == d->mark)
+			continue;
+		d->visited[pc] = d->mark;
+		const Inst *inst = &p->inst[pc];
+		switch (inst->op) {
+		case OP_RANGE:
+			d->ranges[(*ranges)++] = pc;
+			break;
+		case OP_MATCH:
+			match = true;
+			break;
+		case OP_SPLIT:
+			d->stack[top++] = inst->y;
+			d->stack[top++] = inst->x;
+			break;
+		case OP_ASSERT:
+			if (assertion(p, inst->lo, before, after))
+				d->stack[top++] = inst->x;
+			break;
+		case OP_SAVE:
+			d->stack[top++] = inst->x;
+			break;
+		}
+	}
+	return match;
+}
+
+/* compute the transition of `s' on byte class `k', or for k >= nclasses
+ * on reaching the edge of the input */
+static State *dfa_step(Dfa *d, State *s, int k) {
+	const Prog *p = d->prog;
+	bool edge = k >= p->nclasses;
+	int ctx = edge ? (k == p->nclasses ? CTX_EDGE : CTX_EDGE_NOT) : p->ctx[k];
+	int last = s->flags & STATE_CTX;
+	int before = p->reverse ? ctx : last, after = p->reverse ? last : ctx;
+	unsigned flags = (s->flags & STATE_MATCHED) | ctx;
+	size_t len = 0;
+
+	if (++d->mark == 0) {
+		memset(d->visited, 0, p->len * sizeof *d->visited);
+		memset(d->added, 0, p->len * sizeof *d->added);
+		d->mark = 1;
+	}
+
+	const int *kernel = s->kernel, *end = kernel + s->len;
+	if ((s->flags & STATE_START) && !edge && (p->rep[k] & 0xC0) == 0x80)
+		end -= 2; /* no match starts within a character */
+	for (; kernel < end; kernel++) {
+		size_t ranges = 0, group = len;
+		bool match = false;
+		for (; *kernel != -1; kernel++)
+			match |= dfa_closure(d, *kernel, before, after, &ranges);
+		for (size_t i = 0; !edge && i < ranges; i++) {
+			const Inst *inst = &p->inst[d->ranges[i]];
+			if (inst->lo <= p->rep[k] && p->rep[k] <= inst->hi && d->added[inst->x] != d->mark) {
+				d->added[inst->x] = d->mark;
+				d->kernel[len++] = inst->x;
+			}
+		}
+		if (len > group)
+			d->kernel[len++] = -1;
+		if (match) {
+			/* abandon all later attempts */
+			flags |= STATE_MATCHED|STATE_HIT;
+			break;
+		}
+	}
+
+	if (!edge && !d->anchored && !(flags & STATE_MATCHED) && d->added[p->start] != d->mark) {
+		d->kernel[len++] = p->start;
+		d->kernel[len++] = -1;
+		flags |= STATE_START;
+	}
+	if (len == 0)
+		flags |= STATE_DEAD;
+
+	unsigned flushes = d->flushes;
+	State *next = dfa_state(d, flags, d->kernel, len);
+	if (next && flushes == d->flushes)
+		s->next[k] = next;
+	return next;
+}
+
+static int edge_context(int eflags, int flag) {
+	return (eflags & flag) ? CTX_EDGE_NOT : CTX_EDGE;
+}
+
+/* context of the byte at `pos', or of the end of the range */
+static int context_at(const RxInput *in, size_t pos, size_t end, int eflags) {
+	const char *data;
+	if (pos >= end || !in->chunk(in->arg, pos, false, &data))
+		return edge_context(eflags, REG_NOTEOL);
+	return byte_context(*data);
+}
+
+/* context of the byte in front of `pos', or of the start of the range */
+static int context_before(const RxInput *in, size_t pos, size_t start, int eflags) {
+	const char *data;
+	size_t len;
+	if (pos <= start || !(len = in->chunk(in->arg, pos, true, &data)))
+		return edge_context(eflags, REG_NOTBOL);
+	return byte_context(data[len-1]);
+}
+
+/* find the end of the leftmost-longest match, or with `first' set of the
+ * match ending first */
+static int dfa_forward(Rx *re, const RxInput *in, size_t start, size_t end, int eflags, bool first, size_t *match) {
+	Dfa *d = &re->dfa;
+	const Prog *p = d->prog;
+	bool found = false;
+	State *s = dfa_start(d, edge_context(eflags, REG_NOTBOL));
+	if (!s)
+		return REG_ESPACE;
+	for (size_t pos = start; pos < end; ) {
+		const char *data;
+		size_t len = in->chunk(in->arg, pos, false, &data);
+		if (len == 0)
+			break;
+		len = MIN(len, end - pos);
+		for (size_t i = 0; i < len; i++) {
+			int k = p->classes[(unsigned char)data[i]];
+			State *next = s->next[k];
+			if (!next && !(next = dfa_step(d, s, k)))
+				return REG_ESPACE;
+			s = next;
+			if (s->flags & (STATE_HIT|STATE_DEAD)) {
+				if (s->flags & STATE_HIT) {
+					*match = pos + i;
+					found = true;
+					if (first)
+						return 0;
+				}
+				if (s->flags & STATE_DEAD)
+					return found ? 0 : REG_NOMATCH;
+			}
+		}
+		pos += len;
+	}
+	int k = p->nclasses + ((eflags & REG_NOTEOL) ? 1 : 0);
+	State *next = s->next[k] ? s->next[k] : dfa_step(d, s, k);
+	if (!next)
+		return REG_ESPACE;
+	if (next->flags & STATE_HIT) {
+		*match = end;
+		found = true;
+	}
+	return found ? 0 : REG_NOMATCH;
+}
+
+/* find the smallest position from which a match extends to `match_end' */
+static int dfa_backward(Rx *re, const RxInput *in, size_t start, size_t end, size_t match_end, int eflags, size_t *match) {
+	Dfa *d = &re->rdfa;
+	const Prog *p = d->prog;
+	State *s = dfa_start(d, context_at(in, match_end, end, eflags));
+	if (!s)
+		return REG_ESPACE;
+	for (size_t pos = match_end; pos > start; ) {
+		const char *data;
+		size_t len = in->chunk(in->arg, pos, true, &data);
+		if (len == 0)
+			break;
+		if (len > pos - start) {
+			data += len - (pos - start);
+			len = pos - start;
+		}
+		for (size_t i = len; i-- > 0; ) {
+			int k = p->classes[(unsigned char)data[i]];
+			State *next = s->next[k];
+			if (!next && !(next = dfa_step(d, s, k)))
+				return REG_ESPACE;
+			s = next;
+			if (s->flags & STATE_HIT)
+				*match = pos - len + i + 1;
+			if (s->flags & STATE_DEAD)
+				return 0;
+		}
+		pos -= len;
+	}
+	int k = p->nclasses + ((eflags & REG_NOTBOL) ? 1 : 0);
+	State *next = s->next[k] ? s->next[k] : dfa_step(d, s, k);
+	if (!next)
+		return REG_ESPACE;
+	if (next->flags & STATE_HIT)
+		*match = start;
+	return 0;
+}
+
+typedef struct {
+	int pc;
+	int slot;            /* capture slot to restore, or -1 */
+	size_t val;
+} PikeFrame;
+
+typedef struct {
+	int *pc;
+	size_t *caps;
+	size_t len;
+} PikeThreads;
+
+typedef struct {
+	const Prog *prog;
+	size_t ncaps;
+	PikeFrame *stack;
+	unsigned *visited;
+	unsigned mark;
+	PikeThreads run, next;
+} Pike;
+
+/* add the threads reachable from `pc' without consuming input */
+static void pike_add(Pike *vm, int pc, size_t *caps, size_t pos, int before, int after) {
+	const Prog *p = vm->prog;
+	PikeThreads *t = &vm->run;
+	size_t top = 0;
+	vm->stack[top++] = (PikeFrame){ .pc = pc, .slot = -1 };
+	while (top > 0) {
+		PikeFrame f = vm->stack[--top];
+		if (f.slot >= 0) {
+			caps[f.slot] = f.val;
+			continue;
+		}
+		if (vm->visited[f.pc] == vm->mark)
+			continue;
+		vm->visited[f.pc] = vm->mark;
+		const Inst *inst = &p->inst[f.pc];
+		switch (inst->op) {
+		case OP_SPLIT:
+			vm->stack[top++] = (PikeFrame){ .pc = inst->y, .slot = -1 };
+			vm->stack[top++] = (PikeFrame){ .pc = inst->x, .slot = -1 };
+			break;
+		case OP_ASSERT:
+			if (assertion(p, inst->lo, before, after))
+				vm->stack[top++] = (PikeFrame){ .pc = inst->x, .slot = -1 };
+			break;
+		case OP_SAVE:
+			vm->stack[top++] = (PikeFrame){ .slot = inst->y, .val = caps[inst->y] };
+			caps[inst->y] = pos;
+			vm->stack[top++] = (PikeFrame){ .pc = inst->x, .slot = -1 };
+			break;
+		case OP_RANGE:
+		case OP_MATCH:
+			t->pc[t->len] = f.pc;
+			memcpy(&t->caps[t->len * vm->ncaps], caps, vm->ncaps * sizeof *caps);
+			t->len++;
+			break;
+		}
+	}
+}
+
+/* expand the pending threads at `pos' in priority order */
+static void pike_closure(Pike *vm, size_t pos, int before, int after) {
+	if (++vm->mark == 0) {
+		memset(vm->visited, 0, vm->prog->len * sizeof *vm->visited);
+		vm->mark = 1;
+	}
+	vm->run.len = 0;
+	for (size_t i = 0; i < vm->next.len; i++)
+		pike_add(vm, vm->next.pc[i], &vm->next.caps[i * vm->ncaps], pos, before, after);
+}
+
+/* determine the subexpression matches within `m' */
+static int pike(Rx *re, const RxInput *in, size_t start, size_t end, const RxMatch *m, size_t nmatch, RxMatch pmatch[], int eflags) {
+	const Prog *p = &re->forward;
+	Pike vm = { .prog = p, .ncaps = 2 * (re->nsub + 1) };
+	size_t threads = p->len + 1;
+	vm.stack = malloc(3 * threads * sizeof *vm.stack);
+	vm.visited = calloc(p->len, sizeof *vm.visited);
+	vm.run.pc = malloc(threads * sizeof *vm.run.pc);
+	vm.next.pc = malloc(threads * sizeof *vm.next.pc);
+	vm.run.caps = malloc(threads * vm.ncaps * sizeof *vm.run.caps);
+	vm.next.caps = malloc(threads * vm.ncaps * sizeof *vm.next.caps);
+	int ret = REG_ESPACE;
+	if (!vm.stack || !vm.visited || !vm.run.pc || !vm.next.pc || !vm.run.caps || !vm.next.caps)
+		goto out;
+
+	vm.next.pc[0] = p->start;
+	for (size_t i = 0; i < vm.ncaps; i++)
+		vm.next.caps[i] = RX_NOPOS;
+	vm.next.len = 1;
+	int before = context_before(in, m->start, start, eflags);
+	for (size_t pos = m->start; pos < m->end; ) {
+		const char *data;
+		size_t len = in->chunk(in->arg, pos, false, &data);
+		if (len == 0)
+			break;
+		len = MIN(len, m->end - pos);
+		for (size_t i = 0; i < len; i++, pos++) {
+			unsigned char b = data[i];
+			int after = byte_context(b);
+			pike_closure(&vm, pos, before, after);
+			vm.next.len = 0;
+			for (size_t j = 0; j < vm.run.len; j++) {
+				const Inst *inst = &p->inst[vm.run.pc[j]];
+				if (inst->op == OP_RANGE && inst->lo <= b && b <= inst->hi) {
+					vm.next.pc[vm.next.len] = inst->x;
+					memcpy(&vm.next.caps[vm.next.len * vm.ncaps], &vm.run.caps[j * vm.ncaps], vm.ncaps * sizeof *vm.run.caps);
+					vm.next.len++;
+				}
+			}
+			before = after;
+		}
+	}
+	pike_closure(&vm, m->end, before, context_at(in, m->end, end, eflags));
+	ret = REG_NOMATCH;
+	for (size_t i = 0; i < vm.run.len; i++) {
+		if (p->inst[vm.run.pc[i]].op != OP_MATCH)
+			continue;
+		const size_t *caps = &vm.run.caps[i * vm.ncaps];
+		for (size_t j = 1; j < nmatch && j <= (size_t)re->nsub; j++) {
+			if (caps[2*j] != RX_NOPOS && caps[2*j+1] != RX_NOPOS)
+				pmatch[j] = (RxMatch){ .start = caps[2*j], .end = caps[2*j+1] };
+		}
+		ret = 0;
+		break;
+	}
+out:
+	free(vm.stack);
+	free(vm.visited);
+	free(vm.run.pc);
+	free(vm.next.pc);
+	free(vm.run.caps);
+	free(vm.next.caps);
+	return ret;
+}
+
+int rx_compile(Rx **rep, const char *pattern, int cflags) {
+	Parser p = { .s = pattern, .cflags = cflags };
+	Rx *re = calloc(1, sizeof *re);
+	if (!re)
+		return REG_ESPACE;
+	Node *root = parse_alt(&p);
+	if (root && !p.err) {
+		re->cflags = cflags;
+		re->nsub = p.nsub;
+		if (!prog_compile(&re->forward, root, cflags, false) ||
+		    !prog_compile(&re->backward, root, cflags, true) ||
+		    !dfa_init(&re->dfa, &re->forward, false) ||
+		    !dfa_init(&re->rdfa, &re->backward, true))
+			p.err = REG_ESPACE;
+	}
+	for (Node *n = p.nodes, *next; n; n = next) {
+		next = n->alloc;
+		free(n->set.ranges);
+		free(n);
+	}
+	if (p.err) {
+		rx_free(re);
+		return p.err;
+	}
+	*rep = re;
+	return 0;
+}
+
+void rx_free(Rx *re) {
+	if (!re)
+		return;
+	dfa_free(&re->dfa);
+	dfa_free(&re->rdfa);
+	free(re->forward.inst);
+	free(re->backward.inst);
+	free(re);
+}
+
+int rx_search(Rx *re, const RxInput *in, size_t start, size_t end, size_t nmatch, RxMatch pmatch[], int eflags) {
+	if (re->cflags & REG_NOSUB)
+		nmatch = 0;
+	RxMatch m;
+	int ret = dfa_forward(re, in, start, end, eflags, nmatch == 0, &m.end);
+	if (ret || nmatch == 0)
+		return ret;
+	m.start = m.end;
+	if ((ret = dfa_backward(re, in, start, end, m.end, eflags, &m.start)))
+		return ret;
+	pmatch[0] = m;
+	for (size_t i = 1; i < nmatch; i++)
+		pmatch[i] = (RxMatch){ .start = RX_NOPOS, .end = RX_NOPOS };
+	if (nmatch > 1 && re->nsub > 0 && (ret = pike(re, in, start, end, &m, nmatch, pmatch, eflags)) == REG_ESPACE)
+		return ret;
+	return 0;
+}
+
+typedef struct {
+	const char *data;
+	size_t len;
+} Memory;
+
+static size_t memory_chunk(void *arg, size_t pos, bool backward, const char **data) {
+	const Memory *mem = arg;
+	*data = backward ? mem->data : mem->data + pos;
+	return backward ? pos : mem->len - pos;
+}
+
+int rx_exec(Rx *re, const char *data, size_t len, size_t nmatch, RxMatch pmatch[], int eflags) {
+	Memory mem = { .data = data, .len = len };
+	RxInput in = { .chunk = memory_chunk, .arg = &mem };
+	return rx_search(re, &in, 0, len, nmatch, pmatch, eflags);
+}
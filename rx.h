@@ -0,0 +1,36 @@
+#ifndef RX_H
+#define RX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <regex.h>
+
+/* A regular expression engine with matching time linear in the size of the
+ * input. It accepts the POSIX extended and basic syntax of regcomp(3) except
+ * back references, uses the same flags and error codes and reports the
+ * leftmost-longest match. The input is read in chunks and thus does not need
+ * to be contiguous. */
+typedef struct Rx Rx;
+
+typedef struct {
+	size_t start, end;
+} RxMatch;
+
+#define RX_NOPOS ((size_t)-1)
+
+typedef struct {
+	/* point `data' to the bytes starting at `pos' (or ending at `pos' if
+	 * `backward' is set) and return their number, 0 if there are none */
+	size_t (*chunk)(void *arg, size_t pos, bool backward, const char **data);
+	void *arg;
+} RxInput;
+
+/* compile `pattern', returns 0 or a REG_* error code */
+int rx_compile(Rx**, const char *pattern, int cflags);
+void rx_free(Rx*);
+/* search the input range [start, end), returns 0 or REG_NOMATCH */
+int rx_search(Rx*, const RxInput*, size_t start, size_t end, size_t nmatch, RxMatch pmatch[], int eflags);
+/* like rx_search but for contiguous data[0, len) */
+int rx_exec(Rx*, const char *data, size_t len, size_t nmatch, RxMatch pmatch[], int eflags);
+
+#endif
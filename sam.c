@@ -106,6 +106,9 @@ static bool cmd_vnew(Vis*, Win*, Command*, const char *argv[], Cursor*, Filerang
 static bool cmd_wq(Vis*, Win*, Command*, const char *argv[], Cursor*, Filerange*);
 static bool cmd_earlier_later(Vis*, Win*, Command*, const char *argv[], Cursor*, Filerange*);
 static bool cmd_help(Vis*, Win*, Command*, const char *argv[], Cursor*, Filerange*);
+static bool cmd_history_compact(Vis*, Win*, Command*, const char *argv[], Cursor*, Filerange*);
+static bool cmd_diff_saved(Vis*, Win*, Command*, const char *argv[], Cursor*, Filerange*);
+static bool cmd_stats(Vis*, Win*, Command*, const char *argv[], Cursor*, Filerange*);
 static bool cmd_map(Vis*, Win*, Command*, const char *argv[], Cursor*, Filerange*);
 static bool cmd_unmap(Vis*, Win*, Command*, const char *argv[], Cursor*, Filerange*);
 static bool cmd_langmap(Vis*, Win*, Command*, const char *argv[], Cursor*, Filerange*);
@@ -142,7 +145,7 @@ static const CommandDef cmds[] = {
 	{ { "cd"           }, CMD_ARGV|CMD_ONCE,                   NULL, cmd_cd            },
 	/* vi(m) related commands */
 	{ { "bdelete"      }, CMD_FORCE|CMD_ONCE,                  NULL, cmd_bdelete       },
-	{ { "help"         }, CMD_ONCE,                            NULL, cmd_help          },
+	{ { "help", "h"    }, CMD_ONCE,                            NULL, cmd_help          },
 	{ { "map"          }, CMD_ARGV|CMD_FORCE|CMD_ONCE,         NULL, cmd_map           },
 	{ { "map-window"   }, CMD_ARGV|CMD_FORCE|CMD_ONCE,         NULL, cmd_map           },
 	{ { "unmap"        }, CMD_ARGV|CMD_ONCE,                   NULL, cmd_unmap         },
@@ -158,6 +161,9 @@ static const CommandDef cmds[] = {
 	{ { "wq"           }, CMD_ARGV|CMD_FORCE|CMD_ADDRESS_NONE|CMD_ONCE, NULL, cmd_wq   },
 	{ { "earlier"      }, CMD_ARGV|CMD_ONCE,                   NULL, cmd_earlier_later },
 	{ { "later"        }, CMD_ARGV|CMD_ONCE,                   NULL, cmd_earlier_later },
+	{ { "history-compact" }, CMD_ARGV|CMD_ONCE,                NULL, cmd_history_compact },
+	{ { "diff-saved"   }, CMD_ONCE,                            NULL, cmd_diff_saved    },
+	{ { "stats"        }, CMD_ONCE,                            NULL, cmd_stats         },
 	{ { NULL           }, 0,                                   NULL, NULL              },
 };
 
@@ -1044,6 +1050,12 @@ static bool cmd_write(Vis *vis, Win *win, Command *cmd, const char *argv[], Curs
 			return false;
 		}
 
+		/* the output would be truncated while the input is still being read */
+		if (!file_stream_finish(vis)) {
+			vis_info_show(vis, "Can not read all of stdin");
+			return false;
+		}
+
 		for (Cursor *c = view_cursors(win->view); c; c = view_cursors_next(c)) {
 			Filerange range = view_cursors_selection_get(c);
 			bool all = !text_range_valid(&range);
@@ -1104,8 +1116,10 @@ static bool cmd_write(Vis *vis, Win *win, Command *cmd, const char *argv[], Curs
 			return false;
 		}
 
-		if (!file->name)
+		if (!file->name) {
 			file_name_set(file, *name);
+			file_watch(vis, file);
+		}
 		if (strcmp(file->name, *name) == 0)
 			file->stat = text_stat(text);
 		if (vis->event && vis->event->file_save)
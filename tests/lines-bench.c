@@ -0,0 +1,128 @@
+/* New line scanning throughput on a large log file. The kernels selected by
+ * text.c are compared with the memchr(3) loops they replaced, run over the
+ * same data by means of text_chunks. Each text is loaded anew such that no
+ * new line counts are cached. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "text.h"
+
+#define SIZE (256 << 20)
+#define RUNS 5
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool memchr_count(const char *data, size_t len, void *arg) {
+	size_t *lines = arg;
+	for (const char *end = data + len; data < end; data++) {
+		if (!(data = memchr(data, '\n', end - data)))
+			break;
+		(*lines)++;
+	}
+	return true;
+}
+
+typedef struct {
+	size_t lines, pos;
+} Find;
+
+static bool memchr_find(const char *data, size_t len, void *arg) {
+	Find *f = arg;
+	for (const char *start = data, *end = data + len; data < end; data++) {
+		if (!(data = memchr(data, '\n', end - data)))
+			break;
+		if (--f->lines == 0) {
+			f->pos += data - start;
+			return false;
+		}
+	}
+	f->pos += len;
+	return true;
+}
+
+static bool touch(const char *data, size_t len, void *arg) {
+	volatile const char *page = data;
+	for (size_t off = 0; off < len; off += 4096)
+		(void)page[off];
+	return true;
+}
+
+/* load the file and fault in its pages, only the scanning is timed */
+static Text *load(const char *name) {
+	Text *txt = text_load(name);
+	Filerange all = { .start = 0, .end = SIZE };
+	if (txt)
+		text_chunks(txt, &all, touch, NULL);
+	return txt;
+}
+
+static void report(const char *name, double secs, size_t result) {
+	printf("%-22s %8.2f GB/s  (%zu)\n", name, (double)SIZE * RUNS / secs / 1e9, result);
+}
+
+int main(void) {
+	char name[] = "/tmp/vis-lines-bench-XXXXXX";
+	int fd = mkstemp(name);
+	FILE *file = fd == -1 ? NULL : fdopen(fd, "w");
+	if (!file)
+		return 1;
+	unsigned int seed = 1;
+	for (size_t size = 0; size < SIZE; ) {
+		char line[256];
+		int len = snprintf(line, sizeof line, "2024-01-01T00:00:%02u host vis[%u]: request %u took %u ms%*s\n",
+		                   rand_r(&seed) % 60, rand_r(&seed) % 65536, rand_r(&seed), rand_r(&seed) % 1000,
+		                   rand_r(&seed) % 80, "");
+		if (size + len > SIZE)
+			len = SIZE - size;
+		fwrite(line, 1, len, file);
+		size += len;
+	}
+	fclose(file);
+
+	Filerange all = { .start = 0, .end = SIZE };
+	size_t lines = 0, count = 0, pos = 0;
+	double memchr_secs = 0, kernel_secs = 0, memchr_find_secs = 0, kernel_find_secs = 0;
+	for (int run = 0; run < RUNS; run++) {
+		Text *txt = load(name);
+		if (!txt)
+			return 1;
+		double start = now();
+		lines = 0;
+		text_chunks(txt, &all, memchr_count, &lines);
+		memchr_secs += now() - start;
+		/* start of the last line, following the one but last new line */
+		Find find = { .lines = lines - 1 };
+		start = now();
+		text_chunks(txt, &all, memchr_find, &find);
+		memchr_find_secs += now() - start;
+		text_free(txt);
+
+		if (!(txt = load(name)))
+			return 1;
+		start = now();
+		count = text_lineno_by_pos(txt, SIZE) - 1;
+		kernel_secs += now() - start;
+		text_free(txt);
+
+		if (!(txt = load(name)))
+			return 1;
+		start = now();
+		pos = text_pos_by_lineno(txt, lines);
+		kernel_find_secs += now() - start;
+		text_free(txt);
+		if (count != lines || pos != find.pos + 1)
+			return 1;
+	}
+	unlink(name);
+	report("memchr count", memchr_secs, lines);
+	report("text_lineno_by_pos", kernel_secs, count);
+	report("memchr find", memchr_find_secs, lines);
+	report("text_pos_by_lineno", kernel_find_secs, pos);
+	return 0;
+}
@@ -0,0 +1,63 @@
+/* Edit latency against the number of pieces. Random single byte insertions
+ * split pieces, after each stage the mean time of further insertions,
+ * deletions and iterator lookups at random positions is reported. With the
+ * balanced piece index it should grow logarithmically, not linearly. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "text.h"
+
+#define SAMPLES 2000
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t pieces(Text *txt) {
+	size_t count = 0;
+	for (Iterator it = text_iterator_get(txt, 0); text_iterator_valid(&it); text_iterator_next(&it))
+		count++;
+	return count;
+}
+
+int main(void) {
+	Text *txt = text_load(NULL);
+	if (!txt)
+		return 1;
+	for (int i = 0; i < 100000; i++)
+		text_insert(txt, text_size(txt), "some line of text\n", 18);
+	text_snapshot(txt);
+	unsigned int seed = 1;
+	printf("%10s %12s %12s %12s\n", "pieces", "insert ns", "delete ns", "lookup ns");
+	for (size_t stage = 1000; stage <= 1000000; stage *= 10) {
+		size_t count;
+		while ((count = pieces(txt)) < stage) {
+			/* splitting a piece in the middle adds two */
+			for (size_t i = 0; i < (stage - count) / 2 + 1; i++)
+				text_insert(txt, rand_r(&seed) % (text_size(txt) + 1), "x", 1);
+			text_snapshot(txt);
+		}
+		double start = now();
+		for (int i = 0; i < SAMPLES; i++)
+			text_insert(txt, rand_r(&seed) % (text_size(txt) + 1), "y", 1);
+		double insert = now() - start;
+		start = now();
+		for (int i = 0; i < SAMPLES; i++)
+			text_delete(txt, rand_r(&seed) % text_size(txt), 1);
+		double delete = now() - start;
+		start = now();
+		size_t sum = 0;
+		for (int i = 0; i < SAMPLES; i++) {
+			Iterator it = text_iterator_get(txt, rand_r(&seed) % text_size(txt));
+			sum += it.pos;
+		}
+		double lookup = now() - start;
+		printf("%10zu %12.0f %12.0f %12.0f\n", count, insert / SAMPLES * 1e9,
+		       delete / SAMPLES * 1e9, lookup / SAMPLES * 1e9 + (sum == 0));
+		text_snapshot(txt);
+	}
+	text_free(txt);
+	return 0;
+}
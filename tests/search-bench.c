@@ -0,0 +1,76 @@
+/* Forward search throughput on a large log file with a single match near
+ * its end. Patterns containing a literal are compared with equivalent ones
+ * for which none can be extracted, due to their top level alternation,
+ * which therefore take the regex only path. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "text.h"
+#include "text-regex.h"
+
+#define SIZE (256 << 20)
+#define RUNS 3
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool search(Text *txt, const char *pattern, size_t *pos) {
+	Regex *regex = text_regex_new();
+	if (!regex || text_regex_compile(regex, pattern, REG_EXTENDED|REG_NEWLINE)) {
+		text_regex_free(regex);
+		return false;
+	}
+	double secs = 0;
+	RegexMatch match[1];
+	bool found = true;
+	for (int run = 0; run < RUNS && found; run++) {
+		double start = now();
+		found = !text_search_range_forward(txt, 0, text_size(txt), regex, 1, match, 0);
+		secs += now() - start;
+	}
+	text_regex_free(regex);
+	printf("%-52s %8.2f GB/s\n", pattern, (double)SIZE * RUNS / secs / 1e9);
+	*pos = found ? match[0].start : EPOS;
+	return found;
+}
+
+int main(void) {
+	char name[] = "/tmp/vis-search-bench-XXXXXX";
+	int fd = mkstemp(name);
+	FILE *file = fd == -1 ? NULL : fdopen(fd, "w");
+	if (!file)
+		return 1;
+	unsigned int seed = 1;
+	for (size_t size = 0; size < SIZE; ) {
+		char line[256];
+		int len = snprintf(line, sizeof line, "2024-01-01T00:00:%02u host vis[%u]: request %u took %u ms%s\n",
+		                   rand_r(&seed) % 60, rand_r(&seed) % 65536, rand_r(&seed), rand_r(&seed) % 1000,
+		                   size + 2 * sizeof line > SIZE && size + sizeof line <= SIZE ? " needle_identifier_42" : "");
+		if (size + len > SIZE)
+			len = SIZE - size;
+		fwrite(line, 1, len, file);
+		size += len;
+	}
+	fclose(file);
+
+	const char *patterns[][2] = {
+		{ "needle_identifier", "needle_identifier|needle_identifier" },
+		{ "needle_[a-z]+_[0-9]+", "needle_[a-z]+_[0-9]+|needle_[a-z]+_[0-9]+" },
+	};
+	Text *txt = text_load(name);
+	if (!txt)
+		return 1;
+	int ret = 0;
+	for (size_t i = 0; i < sizeof patterns / sizeof patterns[0]; i++) {
+		size_t literal, regex;
+		if (!search(txt, patterns[i][0], &literal) || !search(txt, patterns[i][1], &regex) || literal != regex)
+			ret = 1;
+	}
+	text_free(txt);
+	unlink(name);
+	return ret;
+}
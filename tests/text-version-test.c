@@ -0,0 +1,88 @@
+/* Readers on other threads check that TextVersion snapshots are unaffected
+ * by concurrent modifications, undo history pruning and defragmentation.
+ * Meant to be built with -fsanitize=thread, see the test-version target. */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "text.h"
+
+#define READERS 4
+#define ROUNDS 20
+
+typedef struct {
+	TextVersion *version;
+	const char *expect;
+	size_t errors;
+} Reader;
+
+static bool chunk_cmp(const char *data, size_t len, void *arg) {
+	const char **expect = arg;
+	bool equal = memcmp(*expect, data, len) == 0;
+	*expect += len;
+	return equal;
+}
+
+static void *reader(void *arg) {
+	Reader *r = arg;
+	size_t size = text_version_size(r->version);
+	char *buf = malloc(size);
+	if (!buf) {
+		r->errors++;
+		return NULL;
+	}
+	for (int i = 0; i < 20; i++) {
+		if (text_version_bytes_get(r->version, 0, size, buf) != size || memcmp(buf, r->expect, size))
+			r->errors++;
+		const char *expect = r->expect;
+		Filerange all = { .start = 0, .end = size };
+		if (!text_version_chunks(r->version, &all, chunk_cmp, &expect))
+			r->errors++;
+	}
+	free(buf);
+	return NULL;
+}
+
+int main(void) {
+	Text *txt = text_load(NULL);
+	if (!txt)
+		return 1;
+	for (int i = 0; i < 20000; i++)
+		text_insert(txt, text_size(txt), "some line of text\n", 18);
+	size_t errors = 0;
+	unsigned int seed = 1;
+	for (int round = 0; round < ROUNDS; round++) {
+		size_t size = text_size(txt);
+		char *expect = malloc(size);
+		if (!expect || text_bytes_get(txt, 0, size, expect) != size)
+			return 1;
+		Reader readers[READERS];
+		pthread_t threads[READERS];
+		for (int i = 0; i < READERS; i++) {
+			readers[i] = (Reader){ .version = text_version_get(txt), .expect = expect };
+			if (!readers[i].version || (i > 0 && readers[i].version != readers[0].version))
+				errors++;
+			pthread_create(&threads[i], NULL, reader, &readers[i]);
+		}
+		for (int k = 0; k < 2000; k++) {
+			size_t len = text_size(txt), pos = rand_r(&seed) % (len + 1);
+			if (rand_r(&seed) % 2)
+				text_insert(txt, pos, "xyz", 3);
+			else if (pos < len)
+				text_delete(txt, pos, 1);
+			if (k % 50 == 0)
+				text_snapshot(txt);
+		}
+		text_history_compact(txt, 2);
+		text_defragment(txt, 1 << 20);
+		for (int i = 0; i < READERS; i++) {
+			pthread_join(threads[i], NULL);
+			errors += readers[i].errors;
+			text_version_release(readers[i].version);
+		}
+		free(expect);
+	}
+	text_free(txt);
+	printf("text-version-test: %zu errors\n", errors);
+	return errors != 0;
+}
@@ -1,79 +1,1045 @@
 #include <stdlib.h>
 #include <string.h>
 #include <regex.h>
+#if CONFIG_THREADS
+#include <stdint.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <pthread.h>
+#endif
 
 #include "text-regex.h"
+#include "text-motions.h"
+#include "util.h"
+#if CONFIG_BUILTIN_REGEX
+#include "rx.h"
+#endif
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LITERAL_SIMD 1
+#include <immintrin.h>
+#endif
+
+/* size of the first block of lines examined by a backward search */
+#define BACKWARD_BLOCK (1 << 12)
+/* lines with the literal are matched in the remaining region at once, if
+ * more than LITERAL_HITS were closer than LITERAL_DISTANCE bytes on average */
+#define LITERAL_HITS 16
+#define LITERAL_DISTANCE 256
+/* forward searches of at least PARALLEL_MIN bytes are split into units of
+ * about PARALLEL_UNIT bytes, searched by up to PARALLEL_THREADS threads */
+#define PARALLEL_MIN (1 << 23)
+#define PARALLEL_UNIT (1 << 20)
+#define PARALLEL_THREADS 64
+
+/* Patterns compiled with REG_NEWLINE can only match within a line, unless
+ * they contain a new line, literally or through a class including it. Searches for them stream over the text:
+ * the complete lines within a piece are matched in place, only lines which
+ * span multiple pieces are copied. Memory use is thus bounded by the longest
+ * such line rather than the size of the searched range. */
+/*
+ * Most patterns contain a literal every match has to include. The streamed
+ * searches look for it first and only run the regex on the lines where it
+ * occurs. A pattern which is nothing but a literal needs no regex at all.
+ */
 struct Regex {
+#if CONFIG_BUILTIN_REGEX
+	Rx *rx;             /* NULL if nothing should match */
+#else
 	regex_t regex;
+#endif
+	bool multiline;     /* whether matches might span lines */
+	char *literal;      /* bytes which occur in every match, or NULL */
+	size_t literal_len;
+	bool pure;          /* whether the pattern matches exactly the literal */
+#if CONFIG_THREADS
+	char *pattern;      /* as compiled, to create the clones */
+	int cflags;
+	Regex **clones;     /* private copies for the worker threads */
+	size_t nclones;
+	struct Parallel *parallel; /* units of the last parallel search */
+#endif
 };
 
+static bool literal_analyze(Regex*, const char *string, int cflags);
+#if CONFIG_THREADS
+static void parallel_free(Regex*);
+#endif
+
+/* whether matches might span lines, which they can not with REG_NEWLINE
+ * unless a new line is part of the pattern or of \s, \W, [:space:] or
+ * [:cntrl:] */
+static bool regex_multiline(const char *string, int cflags) {
+	if (!(cflags & REG_NEWLINE) || strchr(string, '\n'))
+		return true;
+	return strstr(string, "\\s") || strstr(string, "\\W") ||
+	       strstr(string, "[:space:]") || strstr(string, "[:cntrl:]");
+}
+
 Regex *text_regex_new(void) {
 	Regex *r = calloc(1, sizeof(Regex));
 	if (!r)
 		return NULL;
+#if !CONFIG_BUILTIN_REGEX
 	regcomp(&r->regex, "\0\0", 0); /* this should not match anything */
+#endif
 	return r;
 }
 
 int text_regex_compile(Regex *regex, const char *string, int cflags) {
+#if CONFIG_BUILTIN_REGEX
+	rx_free(regex->rx);
+	regex->rx = NULL;
+	int r = rx_compile(&regex->rx, string, cflags);
+#else
 	int r = regcomp(&regex->regex, string, cflags);
 	if (r)
 		regcomp(&regex->regex, "\0\0", 0);
+#endif
+	regex->multiline = !r && regex_multiline(string, cflags);
+	free(regex->literal);
+	regex->literal = NULL;
+	regex->literal_len = 0;
+	regex->pure = false;
+	if (!r && !regex->multiline)
+		literal_analyze(regex, string, cflags);
+#if CONFIG_THREADS
+	parallel_free(regex);
+	free(regex->pattern);
+	regex->pattern = r ? NULL : strdup(string);
+	regex->cflags = cflags;
+#endif
 	return r;
 }
 
 void text_regex_free(Regex *r) {
 	if (!r)
 		return;
+#if CONFIG_BUILTIN_REGEX
+	rx_free(r->rx);
+#else
 	regfree(&r->regex);
+#endif
+	free(r->literal);
+#if CONFIG_THREADS
+	parallel_free(r);
+	free(r->pattern);
+#endif
 	free(r);
 }
 
+/* length of the (possibly multibyte) character at `s' */
+static size_t literal_char(const char *s) {
+	size_t len = 1;
+	if ((unsigned char)s[0] >= 0xc0) {
+		while ((s[len] & 0xc0) == 0x80)
+			len++;
+	}
+	return len;
+}
+
+/* skip a bracket expression starting after the opening `[' */
+static const char *literal_skip_bracket(const char *s) {
+	if (*s == '^')
+		s++;
+	if (*s == ']')
+		s++;
+	for (; *s && *s != ']'; s++) {
+		if (*s == '[' && (s[1] == ':' || s[1] == '=' || s[1] == '.')) {
+			char delim = s[1];
+			for (s += 2; *s && !(s[0] == delim && s[1] == ']'); s++);
+			if (!*s++)
+				return NULL;
+		}
+	}
+	return *s ? s + 1 : NULL;
+}
+
+/* skip a group starting after the opening `(' */
+static const char *literal_skip_group(const char *s) {
+	for (int depth = 1; *s; ) {
+		switch (*s++) {
+		case '\\':
+			if (!*s++)
+				return NULL;
+			break;
+		case '[':
+			if (!(s = literal_skip_bracket(s)))
+				return NULL;
+			break;
+		case '(':
+			depth++;
+			break;
+		case ')':
+			if (--depth == 0)
+				return s;
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* parse an interval starting after the opening `{', store its minimum */
+static const char *literal_skip_interval(const char *s, unsigned long *min) {
+	char *end;
+	*min = strtoul(s, &end, 10);
+	if (end == s)
+		return NULL;
+	for (s = end; *s >= '0' && *s <= '9'; s++);
+	if (*s == ',')
+		for (s++; *s >= '0' && *s <= '9'; s++);
+	return *s == '}' ? s + 1 : NULL;
+}
+
+/* Extract the longest run of consecutive literal characters from the top
+ * level concatenation of an extended regular expression. Everything else
+ * (groups, bracket expressions, anchors, escapes other than quoted special
+ * characters) only ends the current run. Patterns with an alternation at
+ * the top level, or anything not understood, yield no literal. */
+static bool literal_analyze(Regex *r, const char *string, int cflags) {
+	if (!(cflags & REG_EXTENDED) || (cflags & REG_ICASE) || !*string)
+		return false;
+	size_t size = strlen(string);
+	char *run = malloc(size), *best = malloc(size);
+	size_t run_len = 0, best_len = 0;
+	bool pure = true;
+	if (!run || !best)
+		goto err;
+	for (const char *s = string; *s; ) {
+		const char *atom = s;
+		size_t atom_len = 0;
+		switch (*s) {
+		case '|':
+		case ')':
+		case '*':
+		case '+':
+		case '?':
+		case '{':
+			goto err;
+		case '(':
+			s = literal_skip_group(s + 1);
+			break;
+		case '[':
+			s = literal_skip_bracket(s + 1);
+			break;
+		case '.':
+		case '^':
+		case '$':
+			s++;
+			break;
+		case '\\':
+			if (!s[1])
+				goto err;
+			if (strchr("^.[]$()|*+?{}\\/", s[1])) {
+				atom = s + 1;
+				atom_len = 1;
+			}
+			s += 2;
+			break;
+		default:
+			atom_len = literal_char(s);
+			s += atom_len;
+			break;
+		}
+		if (!s)
+			goto err;
+		bool optional = false, repeated = false;
+		unsigned long min;
+		switch (*s) {
+		case '*':
+		case '?':
+			optional = true;
+			s++;
+			break;
+		case '+':
+			repeated = true;
+			s++;
+			break;
+		case '{':
+			if (!(s = literal_skip_interval(s + 1, &min)))
+				goto err;
+			optional = min == 0;
+			repeated = !optional;
+			break;
+		}
+		if (atom_len > 0 && !optional) {
+			memcpy(run + run_len, atom, atom_len);
+			run_len += atom_len;
+		}
+		if (atom_len == 0 || optional || repeated) {
+			pure = false;
+			if (run_len > best_len) {
+				memcpy(best, run, run_len);
+				best_len = run_len;
+			}
+			run_len = 0;
+		}
+	}
+	if (run_len > best_len) {
+		memcpy(best, run, run_len);
+		best_len = run_len;
+	}
+	free(run);
+	if (best_len == 0) {
+		free(best);
+		return false;
+	}
+	r->literal = best;
+	r->literal_len = best_len;
+	r->pure = pure;
+	return true;
+err:
+	free(run);
+	free(best);
+	return false;
+}
+
+/* Literal search kernels, they compare the first and last byte of the
+ * literal against a whole block of positions and only verify candidates
+ * where both agree. The vectorized variants are selected at runtime. */
+static const char *literal_find_scalar(const char *data, size_t len, const char *lit, size_t n) {
+	if (n > len)
+		return NULL;
+	const char *last = data + len - n;
+	for (const char *cur = data; cur <= last; cur++) {
+		if (!(cur = memchr(cur, lit[0], last - cur + 1)))
+			return NULL;
+		if (memcmp(cur + 1, lit + 1, n - 1) == 0)
+			return cur;
+	}
+	return NULL;
+}
+
+#if LITERAL_SIMD
+__attribute__((target("sse2")))
+static const char *literal_find_sse2(const char *data, size_t len, const char *lit, size_t n) {
+	if (n > len)
+		return NULL;
+	const __m128i first = _mm_set1_epi8(lit[0]), last = _mm_set1_epi8(lit[n-1]);
+	const char *cur = data, *end = data + len - n + 1;
+	for (; end - cur >= 16; cur += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)cur);
+		__m128i b = _mm_loadu_si128((const __m128i*)(cur + n - 1));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+		for (; mask; mask &= mask - 1) {
+			const char *hit = cur + __builtin_ctz(mask);
+			if (memcmp(hit + 1, lit + 1, n - 1) == 0)
+				return hit;
+		}
+	}
+	return literal_find_scalar(cur, data + len - cur, lit, n);
+}
+
+__attribute__((target("avx2")))
+static const char *literal_find_avx2(const char *data, size_t len, const char *lit, size_t n) {
+	if (n > len)
+		return NULL;
+	const __m256i first = _mm256_set1_epi8(lit[0]), last = _mm256_set1_epi8(lit[n-1]);
+	const char *cur = data, *end = data + len - n + 1;
+	for (; end - cur >= 32; cur += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)cur);
+		__m256i b = _mm256_loadu_si256((const __m256i*)(cur + n - 1));
+		unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+		for (; mask; mask &= mask - 1) {
+			const char *hit = cur + __builtin_ctz(mask);
+			if (memcmp(hit + 1, lit + 1, n - 1) == 0)
+				return hit;
+		}
+	}
+	return literal_find_sse2(cur, data + len - cur, lit, n);
+}
+#endif
+
+static const char *(*literal_find_kernel)(const char*, size_t, const char*, size_t);
+
+static void literal_kernel_init(void) {
+	literal_find_kernel = literal_find_scalar;
+#if LITERAL_SIMD
+	if (__builtin_cpu_supports("avx2"))
+		literal_find_kernel = literal_find_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		literal_find_kernel = literal_find_sse2;
+#endif
+}
+
+/* return a pointer to the first occurrence of lit[0, n) in data[0, len) or NULL */
+static const char *literal_find(const char *data, size_t len, const char *lit, size_t n) {
+	if (!literal_find_kernel)
+		literal_kernel_init();
+	return literal_find_kernel(data, len, lit, n);
+}
+
 int text_regex_match(Regex *r, const char *data, int eflags) {
+#if CONFIG_BUILTIN_REGEX
+	if (!r->rx)
+		return REG_NOMATCH;
+	return rx_exec(r->rx, data, strlen(data), 0, NULL, eflags);
+#else
 	return regexec(&r->regex, data, 0, NULL, eflags);
+#endif
 }
 
-int text_search_range_forward(Text *txt, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags) {
-	char *buf = text_bytes_alloc0(txt, pos, len);
-	if (!buf)
-		return REG_NOMATCH;
-	regmatch_t match[nmatch];
-	int ret = regexec(&r->regex, buf, nmatch, match, eflags);
-	if (!ret) {
-		for (size_t i = 0; i < nmatch; i++) {
-			pmatch[i].start = match[i].rm_so == -1 ? EPOS : pos + match[i].rm_so;
-			pmatch[i].end = match[i].rm_eo == -1 ? EPOS : pos + match[i].rm_eo;
+#if CONFIG_BUILTIN_REGEX
+typedef RxMatch Match;
+
+/* convert matches relative to `pos' */
+static void match_convert(RegexMatch pmatch[], const Match match[], size_t nmatch, size_t pos) {
+	for (size_t i = 0; i < nmatch; i++) {
+		pmatch[i].start = match[i].start == RX_NOPOS ? EPOS : pos + match[i].start;
+		pmatch[i].end = match[i].end == RX_NOPOS ? EPOS : pos + match[i].end;
+	}
+}
+
+/* feed the engine directly from the pieces */
+static size_t text_chunk(void *arg, size_t pos, bool backward, const char **data) {
+	Iterator it = text_iterator_get(arg, pos);
+	if (!text_iterator_valid(&it))
+		return 0;
+	if (!backward) {
+		*data = it.text;
+		return it.end - it.text;
+	}
+	if (it.text == it.start) {
+		if (!text_iterator_prev(&it))
+			return 0;
+		it.text = it.end;
+	}
+	*data = it.start;
+	return it.text - it.start;
+}
+#else
+typedef regmatch_t Match;
+
+static void match_convert(RegexMatch pmatch[], const Match match[], size_t nmatch, size_t pos) {
+	for (size_t i = 0; i < nmatch; i++) {
+		pmatch[i].start = match[i].rm_so == -1 ? EPOS : pos + match[i].rm_so;
+		pmatch[i].end = match[i].rm_eo == -1 ? EPOS : pos + match[i].rm_eo;
+	}
+}
+#endif
+
+#if !CONFIG_BUILTIN_REGEX
+typedef struct {
+	const char *data;
+	size_t len;
+} Chunk;
+
+/* remember the first chunk, stop if the range consists of more */
+static bool chunk_single(const char *data, size_t len, void *arg) {
+	Chunk *chunk = arg;
+	if (chunk->data)
+		return false;
+	chunk->data = data;
+	chunk->len = len;
+	return true;
+}
+#endif
+
+typedef struct {
+	Regex *r;
+	size_t nmatch;
+	Match *match;
+	RegexMatch *pmatch;
+	int eflags;         /* as passed by the caller, applying to the start and end of the range */
+	size_t start, end;  /* searched range */
+	size_t pos;         /* position of the next chunk */
+	char *buf;          /* line spanning multiple chunks */
+	size_t len, size;   /* bytes used and allocated in buf */
+	size_t bufpos;      /* position of the first byte in buf */
+	char *copy;         /* NUL terminated copy for regexec(3) without REG_STARTEND */
+	size_t copy_size;
+	int ret;
+} Search;
+
+static bool search_reserve(Search *s, size_t len) {
+	if (s->size - s->len > len)
+		return true;
+	size_t size = MAX(s->len + len + 1, 2 * s->size);
+	char *buf = realloc(s->buf, size);
+	if (!buf) {
+		s->ret = REG_ESPACE;
+		return false;
+	}
+	s->buf = buf;
+	s->size = size;
+	return true;
+}
+
+/* carry over an incomplete line to be completed by the following chunks */
+static bool search_append(Search *s, const char *data, size_t len, size_t pos) {
+	if (len == 0)
+		return true;
+	if (!search_reserve(s, len))
+		return false;
+	if (s->len == 0)
+		s->bufpos = pos;
+	memcpy(s->buf + s->len, data, len);
+	s->len += len;
+	return true;
+}
+
+/* match complete lines (except at the end of the range) starting at `pos',
+ * returns false once the search is done */
+static bool search_lines(Search *s, const char *data, size_t len, size_t pos) {
+	int eflags = s->eflags;
+	if (pos != s->start)
+		eflags &= ~REG_NOTBOL;
+	if (pos + len != s->end)
+		eflags |= REG_NOTEOL;
+	size_t nmatch = MAX(s->nmatch, 1);
+#if CONFIG_BUILTIN_REGEX
+	int ret = rx_exec(s->r->rx, data, len, nmatch, s->match, eflags);
+#else
+	s->match[0] = (regmatch_t){ .rm_so = 0, .rm_eo = len };
+#ifdef REG_STARTEND
+	eflags |= REG_STARTEND;
+#else
+	if (s->copy_size <= len) {
+		char *copy = realloc(s->copy, len + 1);
+		if (!copy) {
+			s->ret = REG_ESPACE;
+			return false;
+		}
+		s->copy = copy;
+		s->copy_size = len + 1;
+	}
+	memcpy(s->copy, data, len);
+	s->copy[len] = '\0';
+	data = s->copy;
+#endif
+	int ret = regexec(&s->r->regex, data, nmatch, s->match, eflags);
+#endif
+	if (ret == REG_NOMATCH)
+		return true;
+	RegexMatch first;
+	match_convert(&first, s->match, 1, pos);
+	if (!ret && first.start == pos + len && pos + len != s->end)
+		return true; /* found again at the start of the following lines */
+	if (!ret)
+		match_convert(s->pmatch, s->match, s->nmatch, pos);
+	s->ret = ret;
+	return false;
+}
+
+/* like search_lines, but only examine the lines containing the literal */
+static bool search_region(Search *s, const char *data, size_t len, size_t pos) {
+	Regex *r = s->r;
+	if (!r->literal)
+		return search_lines(s, data, len, pos);
+	size_t hits = 0;
+	for (const char *cur = data, *end = data + len; cur < end; ) {
+		if (++hits > LITERAL_HITS && (size_t)(cur - data) < hits * LITERAL_DISTANCE) {
+			/* the literal is too common to be worth it */
+			return search_lines(s, cur, end - cur, pos + (cur - data));
+		}
+		const char *hit = literal_find(cur, end - cur, r->literal, r->literal_len);
+		if (!hit)
+			return true;
+		if (r->pure) {
+			for (size_t i = 0; i < s->nmatch; i++)
+				s->pmatch[i].start = s->pmatch[i].end = EPOS;
+			if (s->nmatch > 0) {
+				s->pmatch[0].start = pos + (hit - data);
+				s->pmatch[0].end = s->pmatch[0].start + r->literal_len;
+			}
+			s->ret = 0;
+			return false;
 		}
+		const char *bol = hit, *eol = memchr(hit, '\n', end - hit);
+		while (bol > cur && bol[-1] != '\n')
+			bol--;
+		eol = eol ? eol + 1 : end;
+		if (!search_lines(s, bol, eol - bol, pos + (bol - data)))
+			return false;
+		cur = eol;
+	}
+	return true;
+}
+
+static const char *search_newline_last(const char *data, size_t len) {
+	for (const char *cur = data + len; cur > data; cur--) {
+		if (cur[-1] == '\n')
+			return cur - 1;
 	}
+	return NULL;
+}
+
+static bool search_chunk(const char *data, size_t len, void *arg) {
+	Search *s = arg;
+	size_t pos = s->pos;
+	s->pos += len;
+	const char *nl = memchr(data, '\n', len);
+	if (!nl)
+		return search_append(s, data, len, pos);
+	if (s->len > 0) {
+		/* complete the line started in previous chunks */
+		size_t head = nl - data + 1;
+		if (!search_append(s, data, head, pos))
+			return false;
+		size_t line = s->len;
+		s->len = 0;
+		if (!search_region(s, s->buf, line, s->bufpos))
+			return false;
+		data += head;
+		len -= head;
+		pos += head;
+	}
+	nl = search_newline_last(data, len);
+	size_t lines = nl ? (size_t)(nl - data + 1) : 0;
+	if (lines > 0 && !search_region(s, data, lines, pos))
+		return false;
+	return search_append(s, data + lines, len - lines, pos + lines);
+}
+
+/* search the whole range at once, for patterns which might span lines */
+static int search_multiline(Text *txt, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags) {
+	Match match[nmatch > 0 ? nmatch : 1];
+#if CONFIG_BUILTIN_REGEX
+	RxInput in = { .chunk = text_chunk, .arg = txt };
+	int ret = rx_search(r->rx, &in, pos, pos + len, nmatch, match, eflags);
+	if (!ret)
+		match_convert(pmatch, match, nmatch, 0);
+	return ret;
+#else
+	char *buf = NULL;
+	int ret;
+#ifdef REG_STARTEND
+	/* search a range within a single piece in place */
+	Chunk chunk = { 0 };
+	Filerange range = { .start = pos, .end = pos + len };
+	if (len > 0 && text_chunks(txt, &range, chunk_single, &chunk) && chunk.len == len) {
+		match[0] = (regmatch_t){ .rm_so = 0, .rm_eo = len };
+		ret = regexec(&r->regex, chunk.data, nmatch, match, eflags|REG_STARTEND);
+	} else
+#endif
+	{
+		if (!(buf = text_bytes_alloc0(txt, pos, len)))
+			return REG_NOMATCH;
+		ret = regexec(&r->regex, buf, nmatch, match, eflags);
+	}
+	if (!ret)
+		match_convert(pmatch, match, nmatch, pos);
 	free(buf);
 	return ret;
+#endif
 }
 
-int text_search_range_backward(Text *txt, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags) {
-	char *buf = text_bytes_alloc0(txt, pos, len);
-	if (!buf)
+/* stream over the lines of the range in the text, or in a version of it */
+static int search_lines_range(Text *txt, const TextVersion *v, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags) {
+	Match match[nmatch > 0 ? nmatch : 1];
+	Search s = {
+		.r = r, .nmatch = nmatch, .match = match, .pmatch = pmatch,
+		.eflags = eflags, .start = pos, .end = pos + len, .pos = pos,
+		.ret = REG_NOMATCH,
+	};
+	Filerange range = { .start = pos, .end = pos + len };
+	bool done = v ? text_version_chunks(v, &range, search_chunk, &s) :
+	                text_chunks(txt, &range, search_chunk, &s);
+	if (done && s.ret == REG_NOMATCH) {
+		/* the last line, or an empty range */
+		if (s.len > 0 || len == 0)
+			search_region(&s, s.len > 0 ? s.buf : "", s.len, s.len > 0 ? s.bufpos : pos);
+	}
+	free(s.buf);
+	free(s.copy);
+	return s.ret;
+}
+
+#if CONFIG_THREADS
+/* A large range is split into units of complete lines which are handed out
+ * in order to a pool of threads. Each of them searches a version of the text
+ * with its own clone of the regex, the calling thread joins in with the
+ * original. The first match is that of the first unit holding any, it is
+ * reported once all units in front of it are known to hold none; units past
+ * it are no longer handed out. The results are kept: successive searches
+ * over the same, unmodified range, such as those of the x command, resume
+ * from them rather than searching the units again. */
+
+#define UNIT_PENDING (-1)
+
+typedef struct {
+	size_t start, end;  /* lines of the unit */
+	int ret;            /* result of its search, UNIT_PENDING if unknown */
+} Unit;
+
+typedef struct Parallel {
+	Text *txt;          /* text and revision the units were searched in */
+	size_t revision;
+	size_t end;         /* end of the searched range */
+	int eflags;         /* as applying to the first unit */
+	size_t nmatch;      /* matches kept per unit */
+	Unit *units;
+	RegexMatch *matches;
+	size_t count;       /* number of units */
+	/* state while searching, protected by workers.lock */
+	const TextVersion *version;
+	Regex *regex;
+	size_t next;        /* unit to hand out next */
+	size_t first;       /* first unit known to match, count if none */
+	size_t done;        /* units in front of it hold no match */
+	size_t busy;        /* units being searched */
+} Parallel;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work;    /* signaled when units are available */
+	pthread_cond_t done;    /* signaled whenever a unit was searched */
+	Parallel *job;          /* search in progress, NULL if none */
+	size_t threads;         /* number of worker threads */
+	bool init;
+} workers = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+/* where the search of a unit by the current thread is abandoned */
+static __thread sigjmp_buf *parallel_fault;
+
+static void parallel_units_free(Parallel *p) {
+	if (!p)
+		return;
+	free(p->units);
+	free(p->matches);
+	free(p);
+}
+
+static void parallel_free(Regex *r) {
+	for (size_t i = 0; i < r->nclones; i++)
+		text_regex_free(r->clones[i]);
+	free(r->clones);
+	r->clones = NULL;
+	r->nclones = 0;
+	parallel_units_free(r->parallel);
+	r->parallel = NULL;
+}
+
+/* search a unit, fails with REG_ESPACE if its data became inaccessible,
+ * i.e. the mmap-ed file was truncated, see text_regex_sigbus */
+static int parallel_search(Parallel *p, Unit *u, Regex *r, RegexMatch *match, int eflags) {
+	sigjmp_buf fault;
+	if (sigsetjmp(fault, 1)) {
+		parallel_fault = NULL;
+		return REG_ESPACE;
+	}
+	parallel_fault = &fault;
+	int ret = search_lines_range(NULL, p->version, u->start, u->end - u->start, r, p->nmatch, match, eflags);
+	parallel_fault = NULL;
+	return ret;
+}
+
+/* search the next unit, called and returning with the lock held */
+static void parallel_work(Parallel *p, Regex *r) {
+	size_t i = p->next++;
+	Unit *u = &p->units[i];
+	RegexMatch *match = &p->matches[i * p->nmatch];
+	int eflags = i > 0 ? p->eflags & ~REG_NOTBOL : p->eflags;
+	if (u->end != p->end)
+		eflags |= REG_NOTEOL;
+	p->busy++;
+	pthread_mutex_unlock(&workers.lock);
+	int ret = parallel_search(p, u, r, match, eflags);
+	/* an empty match at the end is found again by the next unit */
+	if (!ret && match[0].start == u->end && u->end != p->end)
+		ret = REG_NOMATCH;
+	pthread_mutex_lock(&workers.lock);
+	u->ret = ret;
+	if (ret != REG_NOMATCH && i < p->first)
+		p->first = i;
+	p->busy--;
+	pthread_cond_broadcast(&workers.done);
+}
+
+static void *worker_main(void *arg) {
+	size_t id = (uintptr_t)arg;
+	pthread_mutex_lock(&workers.lock);
+	for (;;) {
+		Parallel *p = workers.job;
+		if (p && p->next < p->first && id < p->regex->nclones)
+			parallel_work(p, p->regex->clones[id]);
+		else
+			pthread_cond_wait(&workers.work, &workers.lock);
+	}
+	return NULL;
+}
+
+/* start a worker for each additional processor, asynchronous signals are
+ * left to the main thread. Faults are delivered to the thread causing them */
+static void workers_init(void) {
+	workers.init = true;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t threads = cpus > 1 ? MIN((size_t)cpus - 1, PARALLEL_THREADS - 1) : 0;
+	sigset_t all, old;
+	sigfillset(&all);
+	sigdelset(&all, SIGBUS);
+	sigdelset(&all, SIGSEGV);
+	sigdelset(&all, SIGFPE);
+	sigdelset(&all, SIGILL);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (pthread_t tid; workers.threads < threads; workers.threads++) {
+		if (pthread_create(&tid, NULL, worker_main, (void*)(uintptr_t)workers.threads))
+			break;
+		pthread_detach(tid);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* compile a clone of the regex for each worker, as far as possible */
+static void parallel_clones(Regex *r) {
+	if (r->nclones >= workers.threads || !r->pattern)
+		return;
+	Regex **clones = realloc(r->clones, workers.threads * sizeof *clones);
+	if (!clones)
+		return;
+	r->clones = clones;
+	while (r->nclones < workers.threads) {
+		Regex *clone = text_regex_new();
+		if (!clone || text_regex_compile(clone, r->pattern, r->cflags)) {
+			text_regex_free(clone);
+			return;
+		}
+		r->clones[r->nclones++] = clone;
+	}
+}
+
+typedef struct {
+	size_t pos;         /* position of the next chunk */
+	size_t found;       /* position after the first new line */
+} Newline;
+
+static bool chunk_newline(const char *data, size_t len, void *arg) {
+	Newline *nl = arg;
+	const char *c = memchr(data, '\n', len);
+	if (c) {
+		nl->found = nl->pos + (c - data) + 1;
+		return false;
+	}
+	nl->pos += len;
+	return true;
+}
+
+/* the first line begin at or after pos, or end if there is none before */
+static size_t parallel_boundary(Text *txt, size_t pos, size_t end) {
+	char c;
+	if (text_byte_get(txt, pos - 1, &c) && c == '\n')
+		return pos;
+	Newline nl = { .pos = pos, .found = end };
+	Filerange range = { .start = pos, .end = end };
+	text_chunks(txt, &range, chunk_newline, &nl);
+	return MIN(nl.found, end);
+}
+
+static Parallel *parallel_new(Text *txt, size_t pos, size_t end, size_t nmatch, int eflags) {
+	Parallel *p = calloc(1, sizeof *p);
+	if (!p)
+		return NULL;
+	size_t count = (end - pos) / PARALLEL_UNIT + 1;
+	p->units = calloc(count, sizeof *p->units);
+	p->matches = calloc(count * nmatch, sizeof *p->matches);
+	if (!p->units || !p->matches) {
+		parallel_units_free(p);
+		return NULL;
+	}
+	for (size_t start = pos; start < end; ) {
+		size_t next = end - start > PARALLEL_UNIT ? parallel_boundary(txt, start + PARALLEL_UNIT, end) : end;
+		p->units[p->count++] = (Unit){ .start = start, .end = next, .ret = UNIT_PENDING };
+		start = next;
+	}
+	p->txt = txt;
+	p->revision = text_revision(txt);
+	p->end = end;
+	p->eflags = eflags;
+	p->nmatch = nmatch;
+	p->first = p->count;
+	return p;
+}
+
+/* search the units in parallel, returns the first match */
+static int parallel_run(Parallel *p, const TextVersion *v, Regex *r, size_t nmatch, RegexMatch pmatch[]) {
+	p->version = v;
+	p->regex = r;
+	pthread_mutex_lock(&workers.lock);
+	workers.job = p;
+	pthread_cond_broadcast(&workers.work);
+	for (;;) {
+		while (p->done < p->count && p->units[p->done].ret == REG_NOMATCH)
+			p->done++;
+		if (p->done == p->count || p->units[p->done].ret != UNIT_PENDING)
+			break;
+		if (p->next < p->first)
+			parallel_work(p, r);
+		else
+			pthread_cond_wait(&workers.done, &workers.lock);
+	}
+	while (p->busy > 0)
+		pthread_cond_wait(&workers.done, &workers.lock);
+	workers.job = NULL;
+	pthread_mutex_unlock(&workers.lock);
+	p->version = NULL;
+	if (p->done == p->count)
 		return REG_NOMATCH;
-	regmatch_t match[nmatch];
-	char *cur = buf;
-	int ret = REG_NOMATCH;
-	while (!regexec(&r->regex, cur, nmatch, match, eflags)) {
-		ret = 0;
-		for (size_t i = 0; i < nmatch; i++) {
-			pmatch[i].start = match[i].rm_so == -1 ? EPOS : pos + (size_t)(cur - buf) + match[i].rm_so;
-			pmatch[i].end = match[i].rm_eo == -1 ? EPOS : pos + (size_t)(cur - buf) + match[i].rm_eo;
+	memcpy(pmatch, &p->matches[p->done * p->nmatch], nmatch * sizeof *pmatch);
+	return p->units[p->done].ret;
+}
+
+static int search_parallel(Text *txt, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags) {
+	size_t end = pos + len, n = MAX(nmatch, 1);
+	Parallel *p = r->parallel;
+	if (p && (p->txt != txt || p->revision != text_revision(txt) || p->end != end ||
+	    p->nmatch != n || (p->eflags & REG_NOTEOL) != (eflags & REG_NOTEOL) ||
+	    p->count == 0 || p->units[0].start > pos)) {
+		parallel_units_free(p);
+		r->parallel = p = NULL;
+	}
+	if (p) {
+		/* complete the unit containing pos, then resume with the next */
+		size_t lo = 0, hi = p->count - 1;
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo + 1) / 2;
+			if (p->units[mid].start <= pos)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
+		Unit *u = &p->units[lo];
+		RegexMatch match[n];
+		int flags = u->end != end ? eflags | REG_NOTEOL : eflags;
+		int ret = search_lines_range(txt, NULL, pos, u->end - pos, r, n, match, flags);
+		if (!ret && match[0].start == u->end && u->end != end)
+			ret = REG_NOMATCH;
+		if (ret != REG_NOMATCH) {
+			memcpy(pmatch, match, nmatch * sizeof *pmatch);
+			return ret;
 		}
-		if (match[0].rm_so == 0 && match[0].rm_eo == 0) {
+		size_t i = lo + 1;
+		while (i < p->count && p->units[i].ret == REG_NOMATCH)
+			i++;
+		if (i == p->count)
+			return REG_NOMATCH;
+		if (p->units[i].ret != UNIT_PENDING) {
+			memcpy(pmatch, &p->matches[i * n], nmatch * sizeof *pmatch);
+			return p->units[i].ret;
+		}
+		pos = p->units[i].start;
+		len = end - pos;
+		eflags &= ~REG_NOTBOL;
+	}
+	if (!workers.init)
+		workers_init();
+	if (!literal_find_kernel)
+		literal_kernel_init();
+	parallel_clones(r);
+	TextVersion *v = NULL;
+	if (len < PARALLEL_MIN || r->nclones == 0 || !(v = text_version_get(txt)) ||
+	    !(p = parallel_new(txt, pos, end, n, eflags))) {
+		text_version_release(v);
+		return search_lines_range(txt, NULL, pos, len, r, nmatch, pmatch, eflags);
+	}
+	int ret = parallel_run(p, v, r, nmatch, pmatch);
+	text_version_release(v);
+	parallel_units_free(r->parallel);
+	r->parallel = p;
+	return ret;
+}
+#endif
+
+void text_regex_sigbus(void) {
+#if CONFIG_THREADS
+	if (parallel_fault)
+		siglongjmp(*parallel_fault, 1);
+#endif
+}
+
+int text_search_range_forward(Text *txt, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags) {
+#if CONFIG_BUILTIN_REGEX
+	if (!r->rx)
+		return REG_NOMATCH;
+#endif
+	if (r->multiline)
+		return search_multiline(txt, pos, len, r, nmatch, pmatch, eflags);
+#if CONFIG_THREADS
+	if (len >= PARALLEL_MIN || r->parallel)
+		return search_parallel(txt, pos, len, r, nmatch, pmatch, eflags);
+#endif
+	return search_lines_range(txt, NULL, pos, len, r, nmatch, pmatch, eflags);
+}
+
+/* find the last of the successive matches, streaming over the range */
+static int search_last(Text *txt, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags) {
+	RegexMatch match[nmatch > 0 ? nmatch : 1];
+	size_t cur = pos, end = pos + len;
+	int ret = REG_NOMATCH, flags = eflags;
+	char c;
+	while (!text_search_range_forward(txt, cur, end - cur, r, nmatch, match, flags)) {
+		ret = 0;
+		memcpy(pmatch, match, nmatch * sizeof *match);
+		if (nmatch == 0)
+			break;
+		if (match[0].start == cur && match[0].end == cur) {
 			/* empty match at the beginning of cur, advance to next line */
-			if ((cur = strchr(cur, '\n')))
-				cur++;
-			else
+			cur = text_line_next(txt, cur);
+			if (cur > end || cur == match[0].start || !text_byte_get(txt, cur - 1, &c) || c != '\n')
 				break;
-
 		} else {
-			cur += match[0].rm_eo;
+			cur = match[0].end;
 		}
+		flags = eflags & ~REG_NOTBOL;
+		if (cur > pos && text_byte_get(txt, cur - 1, &c) && c != '\n')
+			flags |= REG_NOTBOL;
 	}
-	free(buf);
 	return ret;
 }
+
+int text_search_range_backward(Text *txt, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags) {
+#if CONFIG_BUILTIN_REGEX
+	if (!r->rx)
+		return REG_NOMATCH;
+	/* the successive matches are streamed over the pieces */
+	if (r->multiline)
+		return search_last(txt, pos, len, r, nmatch, pmatch, eflags);
+#else
+	if (r->multiline) {
+		char *buf = text_bytes_alloc0(txt, pos, len);
+		if (!buf)
+			return REG_NOMATCH;
+		regmatch_t match[nmatch];
+		char *cur = buf;
+		int ret = REG_NOMATCH;
+		while (!regexec(&r->regex, cur, nmatch, match, eflags)) {
+			ret = 0;
+			match_convert(pmatch, match, nmatch, pos + (size_t)(cur - buf));
+			if (match[0].rm_so == 0 && match[0].rm_eo == 0) {
+				/* empty match at the beginning of cur, advance to next line */
+				if ((cur = strchr(cur, '\n')))
+					cur++;
+				else
+					break;
+
+			} else {
+				cur += match[0].rm_eo;
+			}
+		}
+		free(buf);
+		return ret;
+	}
+#endif
+
+	/* scan blocks of lines in front of the range end, doubling their size.
+	 * Matches can not span lines, hence the last one within the closest
+	 * block containing any is the last one of the whole range */
+	size_t end = pos + len, block = BACKWARD_BLOCK;
+	for (size_t hi = end, lo; hi > pos || hi == end; hi = lo, block *= 2) {
+		lo = hi - MIN(block, hi - pos);
+		if (lo > pos)
+			lo = MAX(text_line_begin(txt, lo), pos);
+		int flags = lo == pos ? eflags : eflags & ~REG_NOTBOL;
+		if (hi != end)
+			flags |= REG_NOTEOL;
+		if (!search_last(txt, lo, hi - lo, r, nmatch, pmatch, flags))
+			return 0;
+		if (lo == pos)
+			break;
+	}
+	return REG_NOMATCH;
+}
@@ -13,5 +13,9 @@ void text_regex_free(Regex *r);
 int text_regex_match(Regex*, const char *data, int eflags);
 int text_search_range_forward(Text*, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags);
 int text_search_range_backward(Text*, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags);
+/* to be called by a SIGBUS handler: if the thread is searching part of a
+ * range in parallel it abandons it, the search fails with REG_ESPACE once
+ * all others are done. Otherwise the function returns. */
+void text_regex_sigbus(void);
 
 #endif
@@ -11,6 +11,16 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LINES_SIMD 1
+#include <immintrin.h>
+#endif
+#if CONFIG_THREADS
+#include <pthread.h>
+#endif
 #if CONFIG_ACL
 #include <sys/acl.h>
 #endif
@@ -21,6 +31,7 @@
 #include "text.h"
 #include "text-util.h"
 #include "text-motions.h"
+#include "array.h"
 #include "util.h"
 
 /* Allocate buffers holding the actual file content in junks of size: */
@@ -29,6 +40,43 @@
  * directely. Hence the former can be truncated, while doing so on the latter
  * results in havoc. */
 #define BUFFER_MMAP_SIZE (1 << 23)
+/* mmap(2)-ed files are represented by buffers covering windows of this size,
+ * mapped on first access, of which at most BUFFER_WINDOW_RESIDENT are kept
+ * resident at any time */
+#define BUFFER_WINDOW_SIZE (1 << 26)
+#define BUFFER_WINDOW_RESIDENT 4
+/* The original file content is represented by pieces of at most this size.
+ * This bounds the work needed to count the new lines of a piece which is
+ * split by a modification. */
+#define PIECE_LOAD_SIZE (1 << 20)
+/* Amount of data read or indexed by a single text_load_poll call */
+#define LOAD_STEP_SIZE (1 << 22)
+/* Pieces, changes and actions are allocated from blocks of this size */
+#define POOL_BLOCK_SIZE (1 << 16)
+/* Format of the file persisting the undo history, see history_store */
+#define HISTORY_MAGIC "vis-undo"
+#define HISTORY_VERSION 1
+#define HISTORY_HEADER 16
+#define HISTORY_FOOTER 24
+#define HISTORY_PIECE_FILE 1
+#define HISTORY_NONE UINT64_MAX
+#define HISTORY_BEGIN (UINT64_MAX - 1)
+#define HISTORY_END (UINT64_MAX - 2)
+/* Format of the journal guarding delta saves, see text_save_commit_delta */
+#define JOURNAL_MAGIC "vis-save"
+#define JOURNAL_HEADER 48
+/* pieces shorter than this are merged with their neighbours by text_defragment, */
+#define DEFRAG_PIECE (1 << 10)
+/* into pieces of at most this size */
+#define DEFRAG_RUN (1 << 16)
+/* Format of the swap file journaling unsaved modifications, see swap_record */
+#define SWAP_MAGIC "vis-swap"
+#define SWAP_HEADER 40
+#define SWAP_RECORD 24
+/* insertions of at least this size refer to the data of their pieces instead of copying it */
+#define SWAP_REFERENCE (1 << 12)
+/* swap files exceeding this size and twice the text are rewritten from scratch */
+#define SWAP_COMPACT (1 << 20)
 
 /* Buffer holding the file content, either readonly mmap(2)-ed from the original
  * file or heap allocated to store the modifications.
@@ -41,11 +89,23 @@ struct Buffer {
 	enum {                     /* type of allocation */
 		MMAP_ORIG,         /* mmap(2)-ed from an external file */
 		MMAP,              /* mmap(2)-ed from a temporary file only known to this process */
-		MALLOC,            /* heap allocated buffer using malloc(3) */
+		ANON,              /* anonymous memory mmap(2)-ed by buffer_alloc */
 	} type;
+	size_t offset;             /* file offset of mmap(2)-ed windows */
+	size_t used;               /* last access of resident windows, 0 otherwise */
+	bool mapped;               /* whether the file was mmap(2)-ed into the reserved window */
+	bool detached;             /* whether pages of the window were replaced by private copies */
+	size_t pieces;             /* number of pieces referring to data of this buffer */
+	Array stored;              /* BufferRange already written to the history file */
 	Buffer *next;              /* next junk */
 };
 
+typedef struct {
+	size_t off;                /* offset into the buffer data */
+	size_t len;                /* length of the range */
+	uint64_t pos;              /* offset of the range in the history file */
+} BufferRange;
+
 /* A piece holds a reference (but doesn't itself store) a certain amount of data.
  * All active pieces chained together form the whole content of the document.
  * At the beginning there exists only one piece, spanning the whole document.
@@ -56,10 +116,19 @@ struct Buffer {
 struct Piece {
 	Text *text;             /* text to which this piece belongs */
 	Piece *prev, *next;     /* pointers to the logical predecessor/successor */
-	Piece *global_prev;     /* double linked list in order of allocation, */
-	Piece *global_next;     /* used to free individual pieces */
+	Buffer *buf;            /* buffer holding the data */
 	const char *data;       /* pointer into a Buffer holding the data */
 	size_t len;             /* the length in number of bytes of the data */
+	size_t lines;           /* number of new lines in data or EPOS if not yet known */
+	size_t refs;            /* number of changes referring to this piece */
+	Piece *parent;          /* balanced binary search tree (treap) indexing all */
+	Piece *left, *right;    /* pieces which are currently part of the document */
+	size_t subtree_len;     /* sum of the lengths of all pieces in this subtree */
+	size_t subtree_lines;   /* sum of the new lines in this subtree or EPOS if unknown */
+	unsigned int priority;  /* random heap priority used to keep the tree balanced */
+	Piece *data_parent;     /* second treap indexing all non-empty pieces of the */
+	Piece *data_left;       /* document by the address of their data, used to map */
+	Piece *data_right;      /* marks back to the piece they belong to */
 };
 
 /* used to transform a global position (byte offset starting from the beginning
@@ -78,6 +147,16 @@ typedef struct {
 	size_t len;             /* the sum of the lengths of the pieces which form this span */
 } Span;
 
+/* Pieces are shared among changes, each change records references to the
+ * pieces of its spans. Once the last one is gone and the piece is no longer
+ * part of the document it can be released.
+ */
+typedef struct PieceRef PieceRef;
+struct PieceRef {
+	Piece *piece;           /* referenced piece, part of either span */
+	PieceRef *next;         /* next reference of the same change */
+};
+
 /* A Change keeps all needed information to redo/undo an insertion/deletion. */
 typedef struct Change Change;
 struct Change {
@@ -86,6 +165,7 @@ struct Change {
 	size_t pos;             /* absolute position at which the change occured */
 	Change *next;           /* next change which is part of the same action */
 	Change *prev;           /* previous change which is part of the same action */
+	PieceRef *refs;         /* all pieces which are part of either span */
 };
 
 /* An Action is a list of Changes which are used to undo/redo all modifications
@@ -100,6 +180,7 @@ struct Action {
 	Action *later;          /* the next Action, chronologically */
 	time_t time;            /* when the first change of this action was performed */
 	size_t seq;             /* a unique, strictly increasing identifier */
+	bool keep;              /* used to mark the actions surviving a history_prune */
 };
 
 typedef struct {
@@ -107,45 +188,206 @@ typedef struct {
 	size_t lineno;          /* line number in file i.e. number of '\n' in [0, pos) */
 } LineCache;
 
+/* Positions reported by text_history_get, computed on demand */
+typedef struct {
+	size_t seq;             /* sequence number of the action the list starts from, */
+	Action *next;           /* the next one to visit or NULL once the root is reached */
+	Array pos;              /* position of the oldest change of each visited action */
+} ChangeList;
+
+/* A modified range, as computed by text_diff */
+typedef struct {
+	size_t gap;             /* unmodified bytes since the end of the previous hunk */
+	size_t len;             /* length of the range in the state reached so far */
+	size_t orig;            /* length of the range it replaced in the initial state */
+	size_t prev, next;      /* index of the neighbouring hunks, EPOS if none */
+} DiffHunk;
+
+/* Hunk overwritten while a Diff is journaled, restored by diff_rollback */
+typedef struct {
+	size_t index;
+	DiffHunk hunk;
+} DiffTouch;
+
+typedef struct {
+	Array hunks;            /* DiffHunk in order of creation, linked in document order */
+	size_t live;            /* number of linked hunks */
+	size_t cur;             /* index of the most recently visited one, EPOS if none */
+	size_t pos;             /* its position in the state reached so far and */
+	size_t orig;            /* in the initial one */
+	bool journaling;        /* whether modifications are to be rolled back, */
+	Array journal;          /* DiffTouch of the hunks modified since then and */
+	size_t journal_length, journal_live, journal_cur, journal_pos, journal_orig;
+} Diff;
+
+/* Data of a piece merged by text_defragment, used to resolve marks into it */
+typedef struct {
+	const char *from;       /* former data of the piece, */
+	size_t len;             /* its length and */
+	const char *to;         /* where it was copied to */
+} Relocation;
+
+/* Data of the text spliced into the buffered records once they are written */
+typedef struct {
+	size_t off;             /* offset of the checksum in Swap.data preceded by the record header, */
+	const char *data;       /* the data inserted by the record and */
+	size_t len;             /* its length */
+} SwapRef;
+
+/* Crash recovery journal of the modifications since the file was saved */
+typedef struct {
+	char *path;             /* hidden `.filename.swap' file, NULL if disabled */
+	int fd;                 /* its file descriptor, -1 until the first write */
+	uint64_t header[5];     /* magic, inode, size and mtime of the file the records apply to */
+	char *data;             /* records not yet written to the file, */
+	size_t len, size;       /* their length and the allocated size */
+	size_t open;            /* offset of the last record in data if it can still be extended, EPOS otherwise */
+	Array refs;             /* SwapRef of the records not holding their data, ordered by offset */
+	uint64_t written;       /* length of the swap file */
+	uint64_t synced;        /* length of the swap file known to be on disk */
+	bool stale;             /* whether records were lost and the next write has to store the whole text */
+	bool replay;            /* whether the swap file is currently being replayed */
+} Swap;
+
+/* A memory block holding a number of equally sized objects */
+typedef struct PoolBlock PoolBlock;
+struct PoolBlock {
+	PoolBlock *next;        /* next block of the same pool */
+	union {                 /* start of the object storage, suitably aligned */
+		long double ld;
+		long long ll;
+		void *ptr;
+	} data[];
+};
+
+/* Allocator for objects of a fixed size. Objects are carved out of large
+ * blocks which are only released as a whole, individually freed objects
+ * are kept in a free list for later reuse. */
+typedef struct {
+	size_t size;            /* size of an object, a multiple of the alignment */
+	PoolBlock *blocks;      /* all blocks allocated so far, most recent first */
+	size_t unused;          /* number of never used objects at the end of the first block */
+	void *free;             /* singly linked list of released objects */
+	size_t objects;         /* number of objects currently in use */
+	size_t nblocks;         /* number of allocated blocks */
+} Pool;
+
 /* The main struct holding all information of a given file */
 struct Text {
 	Buffer *buf;            /* original file content at the time of load operation */
+	int fd;                 /* file backing mmap(2)-ed windows, -1 if none */
+	size_t clock;           /* window access counter */
+	size_t resident;        /* number of windows whose pages are resident */
+	Buffer *load;           /* buffer still being read from fd by text_load_async */
+	size_t load_size;       /* number of bytes to read into it */
+	size_t load_pos;        /* position up to which new lines have been indexed */
+	bool loading;           /* whether text_load_poll has work left */
+	void (*load_done)(Text*, void *data); /* completion callback of text_load_async */
+	void *load_data;
 	Buffer *buffers;        /* all buffers which have been allocated to hold insertion data */
-	Piece *pieces;          /* all pieces which have been allocated, used to free them */
+	Buffer *retired;        /* released ones whose address range is kept reserved */
+	Pool pieces;            /* storage for all pieces, */
+	Pool refs;              /* piece references, */
+	Pool changes;           /* changes and */
+	Pool actions;           /* actions, released as a whole upon text_free */
 	Piece *cache;           /* most recently modified piece */
 	Piece begin, end;       /* sentinel nodes which always exists but don't hold any data */
+	Piece *root;            /* root of the tree indexing the active pieces by position */
+	Piece *data_root;       /* root of the tree indexing the active pieces by data address */
+	size_t active;          /* number of active pieces i.e. those forming the document */
+	unsigned int seed;      /* state of the pseudo random generator for tree priorities */
 	Action *history;        /* undo tree */
 	Action *current_action; /* action holding all file changes until a snapshot is performed */
 	Action *last_action;    /* the last action added to the tree, chronologically */
 	Action *saved_action;   /* the last action at the time of the save operation */
+	Array timeline;         /* all actions in chronological order, i.e. sorted by seq */
+	ChangeList changelist;  /* cached results of text_history_get */
 	size_t size;            /* current file content size in bytes */
+	size_t revision;        /* changes along with the content, unique across texts */
+	size_t history_actions; /* maximal number of actions kept in the undo tree, 0 for no limit */
+	size_t history_size;    /* maximal size of the undo history in bytes, 0 for no limit */
+	bool history_persist;   /* whether the undo history is stored alongside the file */
+	bool save_delta;        /* whether text_save_begin_delta may be used */
+	bool history_pending;   /* whether the history still has to be restored from history_path */
+	char *history_path;     /* file holding the history, its data section is described by */
+	uint64_t history_data;  /* the BufferRange of each buffer and ends at this offset */
 	struct stat info;       /* stat as probed at load time */
+	size_t save_copied;     /* bytes of the last save copied by the kernel from fd */
+	size_t save_written;    /* bytes of the last save written from memory */
+	size_t bytes_copied;    /* bytes copied out by text_bytes_get */
+	size_t bytes_chunked;   /* bytes passed in place to text_chunks callbacks */
+	Array changed;          /* Filerange of the file overwritten by delta saves */
+	size_t versions;        /* number of unreleased TextVersion, buffers are kept meanwhile */
+	TextVersion *version;   /* last one taken, shared while its revision is current */
+	Swap swap;              /* journal of unsaved modifications */
+	Diff diff;              /* cached result of text_diff_range between the states */
+	size_t diff_from, diff_to; /* with these ids, diff_from is EPOS if invalid */
+	Array relocations;      /* Relocation of merged pieces, ordered by former address */
 	LineCache lines;        /* mapping between absolute pos in bytes and logical line breaks */
 	enum TextNewLine newlines; /* which type of new lines does the file use */
 };
 
+/* A contiguous part of the document as captured by a TextVersion */
+typedef struct {
+	size_t pos;                /* absolute position of the first byte */
+	size_t len;                /* number of bytes */
+	const char *data;          /* buffer data referenced by a piece at capture time */
+} VersionChunk;
+
+struct TextVersion {
+	Text *txt;                 /* text the version was taken from */
+	size_t revision;           /* text revision captured */
+	size_t refs;               /* number of text_version_get callers sharing it */
+	size_t size;               /* size of the document at that time */
+	size_t count;              /* number of chunks */
+	VersionChunk chunks[];     /* content in document order, sorted by pos */
+};
+
 struct TextSave {                  /* used to hold context between text_save_{begin,commit} calls */
 	Text *txt;                 /* text to operate on */
 	char *filename;            /* filename to save to as given to text_save_begin */
 	char *tmpname;             /* temporary name used for atomic rename(2) */
 	int fd;                    /* file descriptor to write data to using text_save_write */
+	size_t pos;                /* end of the contiguously written ranges, EPOS if there are gaps */
+	char *history;             /* file to store the undo history in, NULL if not persistent */
 	enum {
 		TEXT_SAVE_UNKNOWN,
 		TEXT_SAVE_ATOMIC,  /* create a new file, write content, atomically rename(2) over old file */
 		TEXT_SAVE_INPLACE, /* truncate file, overwrite content (any error will result in data loss) */
+		TEXT_SAVE_DELTA,   /* overwrite only the modified part of the mmap-ed file, guarded by a journal */
 	} type;
+	Filerange delta;           /* range of the text to write to the same offset in a delta save */
+	size_t size;               /* file size before a delta save */
+	size_t end;                /* end of the original file content overwritten by it */
+	char *journal;             /* file holding the original content overwritten by a delta save */
 };
 
 /* buffer management */
 static Buffer *buffer_alloc(Text *txt, size_t size);
 static Buffer *buffer_read(Text *txt, size_t size, int fd);
-static Buffer *buffer_mmap(Text *txt, size_t size, int fd, off_t offset);
+static Buffer *buffer_mmap(Text *txt, size_t size, int fd);
+static Buffer *buffer_window(Text *txt, size_t off);
+static bool buffer_map(Text *txt, Buffer *buf);
+static bool buffer_map_range(Text *txt, size_t start, size_t end);
+static void buffer_access(Text *txt, Buffer *buf);
+static void buffer_trim(Text *txt, Buffer *keep);
+static void buffer_load(Text *txt, size_t len);
+static size_t buffer_mapped(Text *txt);
+static bool file_changed(Text *txt, size_t off, size_t len);
+static bool file_changed_add(Text *txt, size_t start, size_t end);
 static void buffer_free(Buffer *buf);
+static void *buffer_anon(void *addr, size_t size, int prot);
 static bool buffer_capacity(Buffer *buf, size_t len);
 static const char *buffer_append(Buffer *buf, const char *data, size_t len);
 static bool buffer_insert(Buffer *buf, size_t pos, const char *data, size_t len);
 static bool buffer_delete(Buffer *buf, size_t pos, size_t len);
 static const char *buffer_store(Text *txt, const char *data, size_t len);
+/* memory pools */
+static void pool_init(Pool *pool, size_t size);
+static void *pool_alloc(Pool *pool);
+static void pool_free(Pool *pool, void *obj);
+static void pool_release(Pool *pool);
+static void text_changed(Text *txt);
 /* cache layer */
 static void cache_piece(Text *txt, Piece *p);
 static bool cache_contains(Text *txt, Piece *p);
@@ -153,23 +395,56 @@ static bool cache_insert(Text *txt, Piece *p, size_t off, const char *data, size
 static bool cache_delete(Text *txt, Piece *p, size_t off, size_t len);
 /* piece management */
 static Piece *piece_alloc(Text *txt);
-static void piece_free(Piece *p);
-static void piece_init(Piece *p, Piece *prev, Piece *next, const char *data, size_t len);
+static void piece_free(Text *txt, Piece *p);
+static void piece_init(Piece *p, Piece *prev, Piece *next, Buffer *buf, const char *data, size_t len);
+static void piece_access(Piece *p);
 static Location piece_get_intern(Text *txt, size_t pos);
 static Location piece_get_extern(Text *txt, size_t pos);
+/* piece index */
+static void tree_update_path(Piece *p);
+static void tree_insert_after(Text *txt, Piece *prev, Piece *p);
+static void tree_remove(Text *txt, Piece *p);
+static void data_tree_insert(Text *txt, Piece *p);
+static void data_tree_remove(Text *txt, Piece *p);
+static Piece *data_tree_find(Text *txt, const char *addr);
+static void piece_index(Text *txt, Piece *prev, Piece *p);
+static void piece_unindex(Text *txt, Piece *p);
 /* span management */
 static void span_init(Span *span, Piece *start, Piece *end);
 static void span_swap(Text *txt, Span *old, Span *new);
 /* change management */
 static Change *change_alloc(Text *txt, size_t pos);
-static void change_free(Change *c);
+static bool change_ref(Text *txt, Change *c, Piece *start, Piece *end);
+static void change_free(Text *txt, Change *c);
 /* action management */
 static Action *action_alloc(Text *txt);
-static void action_free(Action *a);
+static void action_free(Text *txt, Action *a);
+/* history pruning */
+static size_t history_size(Text *txt);
+static void history_prune(Text *txt, Action *root);
+static void history_compact(Text *txt, size_t count);
+static bool history_exceeds(Text *txt, size_t actions, size_t size);
+static void history_limit(Text *txt);
+static void history_index(Text *txt);
+static void buffer_collect(Text *txt);
+/* defragmentation */
+static Relocation *relocation_find(Text *txt, const char *addr);
+static void relocation_drop(Text *txt, Buffer *buf);
+/* persistent history */
+static bool history_store(Text *txt, const char *path);
+static void history_restore(Text *txt);
+/* crash recovery journal */
+static void swap_record(Text *txt, size_t pos, size_t del, size_t ins);
+static bool swap_write(Text *txt);
+static void swap_discard(Text *txt);
 /* logical line counting cache */
 static void lineno_cache_invalidate(LineCache *cache);
 static size_t lines_skip_forward(Text *txt, size_t pos, size_t lines, size_t *lines_skiped);
-static size_t lines_count(Text *txt, size_t pos, size_t len);
+static void lines_kernel_setup(void);
+static size_t lines_count(const char *data, size_t len);
+static const char *lines_find(const char *data, size_t len, size_t *n);
+static size_t piece_lines(Piece *p);
+static size_t piece_lines_range(Piece *p, size_t off, size_t len);
 
 static ssize_t write_all(int fd, const char *buf, size_t count) {
 	size_t rem = count;
@@ -195,11 +470,11 @@ static Buffer *buffer_alloc(Text *txt, size_t size) {
 		return NULL;
 	if (BUFFER_SIZE > size)
 		size = BUFFER_SIZE;
-	if (!(buf->data = malloc(size))) {
+	if ((buf->data = buffer_anon(NULL, size, PROT_READ|PROT_WRITE)) == MAP_FAILED) {
 		free(buf);
 		return NULL;
 	}
-	buf->type = MALLOC;
+	buf->type = ANON;
 	buf->size = size;
 	buf->next = txt->buffers;
 	txt->buffers = buf;
@@ -227,35 +502,182 @@ static Buffer *buffer_read(Text *txt, size_t size, int fd) {
 	return buf;
 }
 
-static Buffer *buffer_mmap(Text *txt, size_t size, int fd, off_t offset) {
-	Buffer *buf = calloc(1, sizeof(Buffer));
-	if (!buf)
+/* Reserve address space for the whole file, represented by consecutive
+ * windows of at most BUFFER_WINDOW_SIZE bytes, the first of which is returned.
+ * The file is only mmap(2)-ed into a window once it is accessed. */
+static Buffer *buffer_mmap(Text *txt, size_t size, int fd) {
+	char *data = buffer_anon(NULL, size, PROT_NONE);
+	if (data == MAP_FAILED)
 		return NULL;
-	if (size) {
-		buf->data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, offset);
-		if (buf->data == MAP_FAILED) {
-			free(buf);
+	Buffer *first = NULL;
+	for (size_t off = 0; off < size; off += BUFFER_WINDOW_SIZE) {
+		Buffer *buf = calloc(1, sizeof(Buffer));
+		if (!buf) {
+			munmap(data + off, size - off);
 			return NULL;
 		}
+		buf->type = MMAP_ORIG;
+		buf->data = data + off;
+		buf->offset = off;
+		buf->size = MIN(size - off, BUFFER_WINDOW_SIZE);
+		buf->len = buf->size;
+		buf->next = txt->buffers;
+		txt->buffers = buf;
+		if (!first)
+			first = buf;
+	}
+	return first;
+}
+
+/* get the window holding the given file offset */
+static Buffer *buffer_window(Text *txt, size_t off) {
+	for (Buffer *buf = txt->buffers; buf; buf = buf->next) {
+		if (buf->type != ANON && buf->offset <= off && off < buf->offset + buf->len)
+			return buf;
+	}
+	return txt->buf;
+}
+
+/* mmap(2) the file into the reserved window if not yet done */
+static bool buffer_map(Text *txt, Buffer *buf) {
+	if (buf->type != MMAP_ORIG || buf->mapped)
+		return true;
+	if (txt->fd == -1 || mmap(buf->data, buf->size, PROT_READ, MAP_SHARED|MAP_FIXED, txt->fd, buf->offset) == MAP_FAILED)
+		return false;
+	posix_madvise(buf->data, buf->size, POSIX_MADV_SEQUENTIAL);
+	buf->mapped = true;
+	return true;
+}
+
+/* map the windows overlapping the file range [start, end) */
+static bool buffer_map_range(Text *txt, size_t start, size_t end) {
+	for (Buffer *buf = txt->buffers; buf; buf = buf->next) {
+		if (buf->offset < end && start < buf->offset + buf->size && !buffer_map(txt, buf))
+			return false;
+	}
+	return true;
+}
+
+/* note an access to the data of a window, mapping it on first use. The pages
+ * of the least recently used one are released when too many become resident.
+ * If the window can not be mapped it reads as zeros, like a truncated file. */
+static void buffer_access(Text *txt, Buffer *buf) {
+	if (buf->type == ANON)
+		return;
+	if (!buffer_map(txt, buf) && buffer_anon(buf->data, buf->size, PROT_READ) != MAP_FAILED)
+		buf->mapped = true;
+	if (!buf->used && ++txt->resident > BUFFER_WINDOW_RESIDENT)
+		buffer_trim(txt, buf);
+	buf->used = ++txt->clock;
+}
+
+/* Drop the resident pages of the least recently used window, other than
+ * `keep', by mapping the file anew at the same address. Pointers into the
+ * window remain valid, the data is paged in again once accessed. */
+static void buffer_trim(Text *txt, Buffer *keep) {
+	Buffer *lru = NULL;
+	for (Buffer *buf = txt->buffers; buf; buf = buf->next) {
+		if (buf->used && buf != keep && !buf->detached && (!lru || buf->used < lru->used))
+			lru = buf;
+	}
+	if (!lru || txt->fd == -1)
+		return;
+	if (mmap(lru->data, lru->size, PROT_READ, MAP_SHARED|MAP_FIXED, txt->fd, lru->offset) == MAP_FAILED)
+		return;
+	posix_madvise(lru->data, lru->size, POSIX_MADV_SEQUENTIAL);
+	lru->used = 0;
+	txt->resident--;
+}
+
+/* size of the file as mmap-ed by text_load, 0 if it was read */
+static size_t buffer_mapped(Text *txt) {
+	size_t size = 0;
+	for (Buffer *buf = txt->buffers; buf; buf = buf->next) {
+		if (buf->type == MMAP_ORIG || buf->type == MMAP)
+			size += buf->len;
+	}
+	return size;
+}
+
+/* whether the file content in [off, off+len) might differ from the mmap-ed one */
+static bool file_changed(Text *txt, size_t off, size_t len) {
+	for (size_t i = 0; i < array_length(&txt->changed); i++) {
+		Filerange *r = array_get(&txt->changed, i);
+		if (off < r->end && r->start < off + len)
+			return true;
+	}
+	return false;
+}
+
+/* record that the file range [start, end) was overwritten, merging it with
+ * the overlapping or adjacent ranges */
+static bool file_changed_add(Text *txt, size_t start, size_t end) {
+	Filerange range = { .start = start, .end = end };
+	size_t len = 0;
+	if (start >= end)
+		return true;
+	for (size_t i = 0; i < array_length(&txt->changed); i++) {
+		Filerange *r = array_get(&txt->changed, i);
+		if (r->end < range.start || range.end < r->start) {
+			if (i != len)
+				array_set(&txt->changed, len, r);
+			len++;
+		} else {
+			range.start = MIN(range.start, r->start);
+			range.end = MAX(range.end, r->end);
+		}
+	}
+	txt->changed.len = len;
+	return array_add(&txt->changed, &range);
+}
+
+/* Read the content of the buffer loaded in the background up to `len' bytes.
+ * Once completely read the file is closed. If it was truncated or can no
+ * longer be read, the remainder is filled with zeros. */
+static void buffer_load(Text *txt, size_t len) {
+	Buffer *buf = txt->load;
+	if (!buf)
+		return;
+	if (len > txt->load_size)
+		len = txt->load_size;
+	while (buf->len < len) {
+		ssize_t r = read(txt->fd, buf->data + buf->len, len - buf->len);
+		if (r == -1 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if (r <= 0) {
+			memset(buf->data + buf->len, 0, txt->load_size - buf->len);
+			buf->len = txt->load_size;
+			break;
+		}
+		buf->len += r;
+	}
+	if (buf->len == txt->load_size) {
+		close(txt->fd);
+		txt->fd = -1;
+		txt->load = NULL;
 	}
-	buf->type = MMAP_ORIG;
-	buf->size = size;
-	buf->len = size;
-	buf->next = txt->buffers;
-	txt->buffers = buf;
-	return buf;
 }
 
 static void buffer_free(Buffer *buf) {
 	if (!buf)
 		return;
-	if (buf->type == MALLOC)
-		free(buf->data);
-	else if ((buf->type == MMAP_ORIG || buf->type == MMAP) && buf->data)
+	array_release(&buf->stored);
+	if (buf->data)
 		munmap(buf->data, buf->size);
 	free(buf);
 }
 
+/* map `size' zero filled bytes which are not backed by any file, replacing
+ * the mapping at `addr' if given. Inaccessible ones occupy no memory. */
+static void *buffer_anon(void *addr, size_t size, int prot) {
+	int fd = open("/dev/zero", O_RDONLY);
+	if (fd == -1)
+		return MAP_FAILED;
+	void *data = mmap(addr, size, prot, MAP_PRIVATE|(addr ? MAP_FIXED : 0), fd, 0);
+	close(fd);
+	return data;
+}
+
 /* check whether buffer has enough free space to store len bytes */
 static bool buffer_capacity(Buffer *buf, size_t len) {
 	return buf->size - buf->len >= len;
@@ -272,7 +694,7 @@ static const char *buffer_append(Buffer *buf, const char *data, size_t len) {
  * a pointer to the storage location or NULL if allocation failed. */
 static const char *buffer_store(Text *txt, const char *data, size_t len) {
 	Buffer *buf = txt->buffers;
-	if ((!buf || !buffer_capacity(buf, len)) && !(buf = buffer_alloc(txt, len)))
+	if ((!buf || buf == txt->load || !buffer_capacity(buf, len)) && !(buf = buffer_alloc(txt, len)))
 		return NULL;
 	return buffer_append(buf, data, len);
 }
@@ -306,6 +728,49 @@ static bool buffer_delete(Buffer *buf, size_t pos, size_t len) {
 	return true;
 }
 
+static void pool_init(Pool *pool, size_t size) {
+	size_t align = sizeof(((PoolBlock*)0)->data[0]);
+	memset(pool, 0, sizeof *pool);
+	pool->size = (size + align - 1) / align * align;
+}
+
+/* allocate a zero initialized object */
+static void *pool_alloc(Pool *pool) {
+	void *obj = pool->free;
+	if (obj) {
+		pool->free = *(void**)obj;
+	} else {
+		size_t count = (POOL_BLOCK_SIZE - sizeof(PoolBlock)) / pool->size;
+		if (!pool->unused) {
+			PoolBlock *block = malloc(POOL_BLOCK_SIZE);
+			if (!block)
+				return NULL;
+			block->next = pool->blocks;
+			pool->blocks = block;
+			pool->unused = count;
+			pool->nblocks++;
+		}
+		obj = (char*)pool->blocks->data + (count - pool->unused--) * pool->size;
+	}
+	pool->objects++;
+	return memset(obj, 0, pool->size);
+}
+
+/* return an object to the pool, its memory is reused by subsequent allocations */
+static void pool_free(Pool *pool, void *obj) {
+	*(void**)obj = pool->free;
+	pool->free = obj;
+	pool->objects--;
+}
+
+static void pool_release(Pool *pool) {
+	for (PoolBlock *next, *block = pool->blocks; block; block = next) {
+		next = block->next;
+		free(block);
+	}
+	pool_init(pool, pool->size);
+}
+
 /* cache the given piece if it is the most recently changed one */
 static void cache_piece(Text *txt, Piece *p) {
 	Buffer *buf = txt->buffers;
@@ -344,9 +809,15 @@ static bool cache_insert(Text *txt, Piece *p, size_t off, const char *data, size
 	size_t bufpos = p->data + off - buf->data;
 	if (!buffer_insert(buf, bufpos, data, len))
 		return false;
+	if (p->len == 0)
+		data_tree_insert(txt, p);
 	p->len += len;
+	if (p->lines != EPOS)
+		p->lines += lines_count(data, len);
+	tree_update_path(p);
 	txt->current_action->change->new.len += len;
 	txt->size += len;
+	text_changed(txt);
 	return true;
 }
 
@@ -359,11 +830,20 @@ static bool cache_delete(Text *txt, Piece *p, size_t off, size_t len) {
 		return false;
 	Buffer *buf = txt->buffers;
 	size_t bufpos = p->data + off - buf->data;
-	if (off + len > p->len || !buffer_delete(buf, bufpos, len))
+	if (off + len > p->len)
+		return false;
+	size_t lines = p->lines == EPOS ? EPOS : lines_count(p->data + off, len);
+	if (!buffer_delete(buf, bufpos, len))
 		return false;
 	p->len -= len;
+	if (lines != EPOS)
+		p->lines -= lines;
+	if (p->len == 0)
+		data_tree_remove(txt, p);
+	tree_update_path(p);
 	txt->current_action->change->new.len -= len;
 	txt->size -= len;
+	text_changed(txt);
 	return true;
 }
 
@@ -380,12 +860,31 @@ static void span_init(Span *span, Piece *start, Piece *end) {
 	span->len = len;
 }
 
+/* remove all pieces of the span from the piece index */
+static void span_unindex(Text *txt, Span *span) {
+	for (Piece *p = span->start; p; p = p->next) {
+		piece_unindex(txt, p);
+		if (p == span->end)
+			break;
+	}
+}
+
+/* add all pieces of the span to the piece index, the predecessor of
+ * the first piece has to be indexed already (or be the begin sentinel) */
+static void span_index(Text *txt, Span *span) {
+	for (Piece *p = span->start; p; p = p->next) {
+		piece_index(txt, p->prev, p);
+		if (p == span->end)
+			break;
+	}
+}
+
 /* swap out an old span and replace it with a new one.
  *
  *  - if old is an empty span do not remove anything, just insert the new one
  *  - if new is an empty span do not insert anything, just remove the old one
  *
- * adjusts the document size accordingly.
+ * adjusts the document size and the piece index accordingly.
  */
 static void span_swap(Text *txt, Span *old, Span *new) {
 	if (old->len == 0 && new->len == 0) {
@@ -394,25 +893,36 @@ static void span_swap(Text *txt, Span *old, Span *new) {
 		/* insert new span */
 		new->start->prev->next = new->start;
 		new->end->next->prev = new->end;
+		span_index(txt, new);
 	} else if (new->len == 0) {
 		/* delete old span */
 		old->start->prev->next = old->end->next;
 		old->end->next->prev = old->start->prev;
+		span_unindex(txt, old);
 	} else {
 		/* replace old with new */
 		old->start->prev->next = new->start;
 		old->end->next->prev = new->end;
+		span_unindex(txt, old);
+		span_index(txt, new);
 	}
 	txt->size -= old->len;
 	txt->size += new->len;
+	text_changed(txt);
 }
 
 /* allocate a new action, set its pointers to the other actions in the history,
  * and set it as txt->history. All further changes will be associated with this action. */
 static Action *action_alloc(Text *txt) {
-	Action *new = calloc(1, sizeof(Action));
+	if (txt->history && (txt->history_actions || txt->history_size))
+		history_limit(txt);
+	Action *new = pool_alloc(&txt->actions);
 	if (!new)
 		return NULL;
+	if (!array_add_ptr(&txt->timeline, new)) {
+		pool_free(&txt->actions, new);
+		return NULL;
+	}
 	new->time = time(NULL);
 	txt->current_action = new;
 
@@ -439,47 +949,299 @@ static Action *action_alloc(Text *txt) {
 	return new;
 }
 
-static void action_free(Action *a) {
-	if (!a)
-		return;
+static void action_free(Text *txt, Action *a) {
 	for (Change *next, *c = a->change; c; c = next) {
 		next = c->next;
-		change_free(c);
+		change_free(txt, c);
 	}
-	free(a);
+	pool_free(&txt->actions, a);
 }
 
 static Piece *piece_alloc(Text *txt) {
-	Piece *p = calloc(1, sizeof(Piece));
+	Piece *p = pool_alloc(&txt->pieces);
 	if (!p)
 		return NULL;
 	p->text = txt;
-	p->global_next = txt->pieces;
-	if (txt->pieces)
-		txt->pieces->global_prev = p;
-	txt->pieces = p;
 	return p;
 }
 
-static void piece_free(Piece *p) {
-	if (!p)
-		return;
-	if (p->global_prev)
-		p->global_prev->global_next = p->global_next;
-	if (p->global_next)
-		p->global_next->global_prev = p->global_prev;
-	if (p->text->pieces == p)
-		p->text->pieces = p->global_next;
-	if (p->text->cache == p)
-		p->text->cache = NULL;
-	free(p);
-}
-
-static void piece_init(Piece *p, Piece *prev, Piece *next, const char *data, size_t len) {
+static void piece_free(Text *txt, Piece *p) {
+	if (txt->cache == p)
+		txt->cache = NULL;
+	if (p->buf)
+		p->buf->pieces--;
+	pool_free(&txt->pieces, p);
+}
+
+static void piece_init(Piece *p, Piece *prev, Piece *next, Buffer *buf, const char *data, size_t len) {
 	p->prev = prev;
 	p->next = next;
+	p->buf = buf;
 	p->data = data;
 	p->len = len;
+	p->lines = EPOS;
+	if (buf)
+		buf->pieces++;
+}
+
+/* make the data of the piece available, reading it if necessary */
+static void piece_access(Piece *p) {
+	Buffer *buf = p->buf;
+	if (!buf)
+		return;
+	if (buf->type != ANON)
+		buffer_access(p->text, buf);
+	else if (buf == p->text->load && p->data + p->len > buf->data + buf->len)
+		buffer_load(p->text, p->data + p->len - buf->data);
+}
+
+/* get the number of new lines of the piece, count them if not yet known */
+static size_t piece_lines(Piece *p) {
+	if (p->lines == EPOS) {
+		piece_access(p);
+		p->lines = lines_count(p->data, p->len);
+	}
+	return p->lines;
+}
+
+/* count the new lines in the piece range [off, off+len), if the total is
+ * known and the range spans most of the piece count the remainder instead */
+static size_t piece_lines_range(Piece *p, size_t off, size_t len) {
+	piece_access(p);
+	if (p->lines != EPOS && len > p->len / 2) {
+		return p->lines - lines_count(p->data, off) -
+		       lines_count(p->data + off + len, p->len - off - len);
+	}
+	return lines_count(p->data + off, len);
+}
+
+/* new line count of the piece range [off, off+len) if that of the whole piece
+ * is already known. Used to initialize pieces resulting from a split, without
+ * scanning (potentially huge) not yet counted pieces. */
+static size_t piece_lines_split(Piece *p, size_t off, size_t len) {
+	return p->lines == EPOS ? EPOS : piece_lines_range(p, off, len);
+}
+
+/* The pieces which currently form the document are additionally indexed by
+ * a treap, i.e. a binary search tree ordered by document position which is
+ * kept balanced by maintaining heap order on random node priorities. Every
+ * node stores the accumulated length of its subtree, hence mapping between
+ * pieces and absolute positions takes expected O(log n) time. The sentinel
+ * nodes are not part of the tree. The tree mirrors the linked list and is
+ * only modified by span_swap (and the cache layer adjusting piece lengths).
+ */
+static size_t tree_len(Piece *p) {
+	return p ? p->subtree_len : 0;
+}
+
+static void tree_update(Piece *p) {
+	p->subtree_len = tree_len(p->left) + p->len + tree_len(p->right);
+	size_t left = p->left ? p->left->subtree_lines : 0;
+	size_t right = p->right ? p->right->subtree_lines : 0;
+	if (left == EPOS || p->lines == EPOS || right == EPOS)
+		p->subtree_lines = EPOS;
+	else
+		p->subtree_lines = left + p->lines + right;
+}
+
+/* number of new lines in the subtree rooted at p. new line counts are
+ * determined lazily, that is unknown ones are calculated (and remembered)
+ * on first use. Ancestors of p are not updated, their count remains
+ * unknown until they are queried themselves. */
+static size_t tree_lines(Piece *p) {
+	if (!p)
+		return 0;
+	if (p->subtree_lines == EPOS)
+		p->subtree_lines = tree_lines(p->left) + piece_lines(p) + tree_lines(p->right);
+	return p->subtree_lines;
+}
+
+/* recalculate the accumulated lengths from p upwards to the root */
+static void tree_update_path(Piece *p) {
+	for (; p; p = p->parent)
+		tree_update(p);
+}
+
+/* replace the child `old' of `parent' (or the root if parent is NULL) with `new' */
+static void tree_replace_child(Text *txt, Piece *parent, Piece *old, Piece *new) {
+	if (!parent)
+		txt->root = new;
+	else if (parent->left == old)
+		parent->left = new;
+	else
+		parent->right = new;
+	if (new)
+		new->parent = parent;
+}
+
+/* rotate p one level up such that it takes the place of its parent */
+static void tree_rotate_up(Text *txt, Piece *p) {
+	Piece *q = p->parent;
+	tree_replace_child(txt, q->parent, q, p);
+	if (q->left == p) {
+		q->left = p->right;
+		if (q->left)
+			q->left->parent = q;
+		p->right = q;
+	} else {
+		q->right = p->left;
+		if (q->right)
+			q->right->parent = q;
+		p->left = q;
+	}
+	q->parent = p;
+	tree_update(q);
+	tree_update(p);
+}
+
+static unsigned int tree_priority(Text *txt) {
+	/* xorshift32 */
+	unsigned int x = txt->seed;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return txt->seed = x;
+}
+
+/* add p to the tree such that it immediately follows prev which is either
+ * already part of the tree or the begin sentinel */
+static void tree_insert_after(Text *txt, Piece *prev, Piece *p) {
+	Piece *parent;
+	bool left = true;
+	if (prev == &txt->begin) {
+		for (parent = txt->root; parent && parent->left; parent = parent->left);
+	} else if (!prev->right) {
+		parent = prev;
+		left = false;
+	} else {
+		for (parent = prev->right; parent->left; parent = parent->left);
+	}
+
+	p->left = p->right = NULL;
+	p->parent = parent;
+	p->priority = tree_priority(txt);
+	if (!parent)
+		txt->root = p;
+	else if (left)
+		parent->left = p;
+	else
+		parent->right = p;
+	tree_update_path(p);
+	while (p->parent && p->parent->priority > p->priority)
+		tree_rotate_up(txt, p);
+}
+
+static void tree_remove(Text *txt, Piece *p) {
+	while (p->left && p->right)
+		tree_rotate_up(txt, p->left->priority < p->right->priority ? p->left : p->right);
+	Piece *parent = p->parent;
+	tree_replace_child(txt, parent, p, p->left ? p->left : p->right);
+	tree_update_path(parent);
+	p->parent = p->left = p->right = NULL;
+}
+
+/* returns the absolute position of the first byte of an indexed piece */
+static size_t tree_pos(Piece *p) {
+	size_t pos = tree_len(p->left);
+	for (; p->parent; p = p->parent) {
+		if (p->parent->right == p)
+			pos += tree_len(p->parent->left) + p->parent->len;
+	}
+	return pos;
+}
+
+/* The second tree contains the same pieces (except empty ones) ordered by the
+ * memory address of their data. The data of distinct active pieces never
+ * overlaps, hence there exists at most one piece for any given address. It
+ * shares the heap priorities of the position tree but needs no additional
+ * bookkeeping.
+ */
+static void data_tree_replace_child(Text *txt, Piece *parent, Piece *old, Piece *new) {
+	if (!parent)
+		txt->data_root = new;
+	else if (parent->data_left == old)
+		parent->data_left = new;
+	else
+		parent->data_right = new;
+	if (new)
+		new->data_parent = parent;
+}
+
+static void data_tree_rotate_up(Text *txt, Piece *p) {
+	Piece *q = p->data_parent;
+	data_tree_replace_child(txt, q->data_parent, q, p);
+	if (q->data_left == p) {
+		q->data_left = p->data_right;
+		if (q->data_left)
+			q->data_left->data_parent = q;
+		p->data_right = q;
+	} else {
+		q->data_right = p->data_left;
+		if (q->data_right)
+			q->data_right->data_parent = q;
+		p->data_left = q;
+	}
+	q->data_parent = p;
+}
+
+static bool data_tree_contains(Text *txt, Piece *p) {
+	return p->data_parent || txt->data_root == p;
+}
+
+static void data_tree_insert(Text *txt, Piece *p) {
+	Piece *parent = NULL;
+	for (Piece *cur = txt->data_root; cur; ) {
+		parent = cur;
+		cur = p->data < cur->data ? cur->data_left : cur->data_right;
+	}
+	p->data_left = p->data_right = NULL;
+	p->data_parent = parent;
+	if (!parent)
+		txt->data_root = p;
+	else if (p->data < parent->data)
+		parent->data_left = p;
+	else
+		parent->data_right = p;
+	while (p->data_parent && p->data_parent->priority > p->priority)
+		data_tree_rotate_up(txt, p);
+}
+
+static void data_tree_remove(Text *txt, Piece *p) {
+	if (!data_tree_contains(txt, p))
+		return;
+	while (p->data_left && p->data_right) {
+		data_tree_rotate_up(txt, p->data_left->priority < p->data_right->priority ?
+		                    p->data_left : p->data_right);
+	}
+	data_tree_replace_child(txt, p->data_parent, p, p->data_left ? p->data_left : p->data_right);
+	p->data_parent = p->data_left = p->data_right = NULL;
+}
+
+/* find the active piece whose data contains addr */
+static Piece *data_tree_find(Text *txt, const char *addr) {
+	for (Piece *p = txt->data_root; p; ) {
+		if (addr < p->data)
+			p = p->data_left;
+		else if (addr < p->data + p->len)
+			return p;
+		else
+			p = p->data_right;
+	}
+	return NULL;
+}
+
+/* add p, following prev, to both piece indices */
+static void piece_index(Text *txt, Piece *prev, Piece *p) {
+	tree_insert_after(txt, prev, p);
+	if (p->len > 0)
+		data_tree_insert(txt, p);
+	txt->active++;
+}
+
+static void piece_unindex(Text *txt, Piece *p) {
+	tree_remove(txt, p);
+	data_tree_remove(txt, p);
+	txt->active--;
 }
 
 /* returns the piece holding the text at byte offset pos. if pos happens to
@@ -491,11 +1253,20 @@ static void piece_init(Piece *p, Piece *prev, Piece *next, const char *data, siz
  * in particular if pos is zero, the begin sentinel piece is returned.
  */
 static Location piece_get_intern(Text *txt, size_t pos) {
-	size_t cur = 0;
-	for (Piece *p = &txt->begin; p->next; p = p->next) {
-		if (cur <= pos && pos <= cur + p->len)
-			return (Location){ .piece = p, .off = pos - cur };
-		cur += p->len;
+	if (pos == 0)
+		return (Location){ .piece = &txt->begin, .off = 0 };
+
+	/* find the first piece ending at or after pos */
+	for (Piece *p = txt->root; p; ) {
+		size_t left = tree_len(p->left);
+		if (pos <= left) {
+			p = p->left;
+		} else if (pos <= left + p->len) {
+			return (Location){ .piece = p, .off = pos - left };
+		} else {
+			pos -= left + p->len;
+			p = p->right;
+		}
 	}
 
 	return (Location){ 0 };
@@ -507,19 +1278,22 @@ static Location piece_get_intern(Text *txt, size_t pos) {
  * the last piece holding data is returned.
  */
 static Location piece_get_extern(Text *txt, size_t pos) {
-	size_t cur = 0;
-
 	if (pos > 0 && pos == txt->size) {
-		Piece *p = txt->begin.next;
-		while (p->next->next)
-			p = p->next;
+		Piece *p = txt->end.prev;
 		return (Location){ .piece = p, .off = p->len };
 	}
 
-	for (Piece *p = txt->begin.next; p->next; p = p->next) {
-		if (cur <= pos && pos < cur + p->len)
-			return (Location){ .piece = p, .off = pos - cur };
-		cur += p->len;
+	/* find the first piece ending after pos */
+	for (Piece *p = txt->root; p; ) {
+		size_t left = tree_len(p->left);
+		if (pos < left) {
+			p = p->left;
+		} else if (pos < left + p->len) {
+			return (Location){ .piece = p, .off = pos - left };
+		} else {
+			pos -= left + p->len;
+			p = p->right;
+		}
 	}
 
 	return (Location){ 0 };
@@ -534,7 +1308,7 @@ static Change *change_alloc(Text *txt, size_t pos) {
 		if (!a)
 			return NULL;
 	}
-	Change *c = calloc(1, sizeof(Change));
+	Change *c = pool_alloc(&txt->changes);
 	if (!c)
 		return NULL;
 	c->pos = pos;
@@ -545,14 +1319,33 @@ static Change *change_alloc(Text *txt, size_t pos) {
 	return c;
 }
 
-static void change_free(Change *c) {
-	if (!c)
-		return;
-	/* only free the new part of the span, the old one is still in use */
-	piece_free(c->new.start);
-	if (c->new.start != c->new.end)
-		piece_free(c->new.end);
-	free(c);
+/* reference all pieces from start to end, which have to be linked */
+static bool change_ref(Text *txt, Change *c, Piece *start, Piece *end) {
+	for (Piece *p = start; p; p = p->next) {
+		PieceRef *ref = pool_alloc(&txt->refs);
+		if (!ref)
+			return false;
+		ref->piece = p;
+		ref->next = c->refs;
+		c->refs = ref;
+		p->refs++;
+		if (p == end)
+			break;
+	}
+	return true;
+}
+
+/* pieces which are neither part of the document nor referenced by
+ * any other change are no longer needed */
+static void change_free(Text *txt, Change *c) {
+	for (PieceRef *next, *ref = c->refs; ref; ref = next) {
+		next = ref->next;
+		Piece *p = ref->piece;
+		if (--p->refs == 0 && !p->parent && txt->root != p)
+			piece_free(txt, p);
+		pool_free(&txt->refs, ref);
+	}
+	pool_free(&txt->changes, c);
 }
 
 /* When inserting new data there are 2 cases to consider.
@@ -585,6 +1378,7 @@ static void change_free(Change *c) {
 bool text_insert(Text *txt, size_t pos, const char *data, size_t len) {
 	if (len == 0)
 		return true;
+	history_restore(txt);
 	if (pos > txt->size)
 		return false;
 	if (pos < txt->lines.pos)
@@ -595,8 +1389,10 @@ bool text_insert(Text *txt, size_t pos, const char *data, size_t len) {
 	if (!p)
 		return false;
 	size_t off = loc.off;
-	if (cache_insert(txt, p, off, data, len))
+	if (cache_insert(txt, p, off, data, len)) {
+		swap_record(txt, pos, 0, len);
 		return true;
+	}
 
 	Change *c = change_alloc(txt, pos);
 	if (!c)
@@ -612,7 +1408,10 @@ bool text_insert(Text *txt, size_t pos, const char *data, size_t len) {
 		 * remove, just add a new piece holding the extra text */
 		if (!(new = piece_alloc(txt)))
 			return false;
-		piece_init(new, p, p->next, data, len);
+		piece_init(new, p, p->next, txt->buffers, data, len);
+		new->lines = lines_count(data, len);
+		if (!change_ref(txt, c, new, new))
+			return false;
 		span_init(&c->new, new, new);
 		span_init(&c->old, NULL, NULL);
 	} else {
@@ -626,16 +1425,23 @@ bool text_insert(Text *txt, size_t pos, const char *data, size_t len) {
 		Piece *after = piece_alloc(txt);
 		if (!before || !new || !after)
 			return false;
-		piece_init(before, p->prev, new, p->data, off);
-		piece_init(new, before, after, data, len);
-		piece_init(after, new, p->next, p->data + off, p->len - off);
-
+		piece_init(before, p->prev, new, p->buf, p->data, off);
+		piece_init(new, before, after, txt->buffers, data, len);
+		piece_init(after, new, p->next, p->buf, p->data + off, p->len - off);
+		new->lines = lines_count(data, len);
+		before->lines = piece_lines_split(p, 0, off);
+		if (before->lines != EPOS)
+			after->lines = p->lines - before->lines;
+
+		if (!change_ref(txt, c, before, after) || !change_ref(txt, c, p, p))
+			return false;
 		span_init(&c->new, before, after);
 		span_init(&c->old, p, p);
 	}
 
 	cache_piece(txt, new);
 	span_swap(txt, &c->old, &c->new);
+	swap_record(txt, pos, 0, len);
 	return true;
 }
 
@@ -678,6 +1484,7 @@ static size_t action_undo(Text *txt, Action *a) {
 	size_t pos = EPOS;
 	for (Change *c = a->change; c; c = c->next) {
 		span_swap(txt, &c->new, &c->old);
+		swap_record(txt, c->old.start ? tree_pos(c->old.start) : c->pos, c->new.len, c->old.len);
 		pos = c->pos;
 	}
 	return pos;
@@ -690,6 +1497,7 @@ static size_t action_redo(Text *txt, Action *a) {
 		c = c->next;
 	for ( ; c; c = c->prev) {
 		span_swap(txt, &c->old, &c->new);
+		swap_record(txt, c->new.start ? tree_pos(c->new.start) : c->pos, c->old.len, c->new.len);
 		pos = c->pos;
 		if (c->new.len > c->old.len)
 			pos += c->new.len - c->old.len;
@@ -699,6 +1507,7 @@ static size_t action_redo(Text *txt, Action *a) {
 
 size_t text_undo(Text *txt) {
 	size_t pos = EPOS;
+	history_restore(txt);
 	/* taking a snapshot makes sure that txt->current_action is reset */
 	text_snapshot(txt);
 	Action *a = txt->history->prev;
@@ -712,6 +1521,7 @@ size_t text_undo(Text *txt) {
 
 size_t text_redo(Text *txt) {
 	size_t pos = EPOS;
+	history_restore(txt);
 	/* taking a snapshot makes sure that txt->current_action is reset */
 	text_snapshot(txt);
 	Action *a = txt->history->next;
@@ -723,90 +1533,1639 @@ size_t text_redo(Text *txt) {
 	return pos;
 }
 
-static bool history_change_branch(Action *a) {
-	bool changed = false;
-	while (a->prev) {
-		if (a->prev->next != a) {
-			a->prev->next = a;
-			changed = true;
-		}
-		a = a->prev;
+/* index of the action in the chronologically ordered `actions', EPOS if absent */
+static size_t action_index(Array *actions, Action *a) {
+	size_t lo = 0, hi = array_length(actions);
+	while (a && lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		Action *m = array_get_ptr(actions, mid);
+		if (m->seq == a->seq)
+			return mid;
+		if (m->seq < a->seq)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-	return changed;
+	return EPOS;
+}
+
+/* rebuild the chronological index after actions were freed or restored,
+ * it never grows hence no memory needs to be allocated */
+static void history_index(Text *txt) {
+	Action *first = txt->last_action;
+	while (first && first->earlier)
+		first = first->earlier;
+	array_clear(&txt->timeline);
+	for (Action *a = first; a; a = a->later)
+		array_add_ptr(&txt->timeline, a);
+	array_clear(&txt->changelist.pos);
+	txt->changelist.next = NULL;
+	txt->changelist.seq = EPOS;
 }
 
+/* undo up to the closest common ancestor of the current state and `a',
+ * then redo along the branch leading to `a'. Both ancestor chains are
+ * walked in lock step, a parent is always older than its children. */
 static size_t history_traverse_to(Text *txt, Action *a) {
 	size_t pos = EPOS;
 	if (!a)
 		return pos;
-	bool changed = history_change_branch(a);
-	if (!changed) {
-		if (a->seq == txt->history->seq) {
-			return txt->lines.pos;
-		} else if (a->seq > txt->history->seq) {
-			while (txt->history != a)
-				pos = text_redo(txt);
-			return pos;
-		} else if (a->seq < txt->history->seq) {
-			while (txt->history != a)
-				pos = text_undo(txt);
-			return pos;
-		}
-	} else {
-		while (txt->history->prev && txt->history->prev->next == txt->history)
-			text_undo(txt);
-		pos = text_undo(txt);
-		while (txt->history != a)
-			pos = text_redo(txt);
-		return pos;
+	if (a == txt->history)
+		return txt->lines.pos;
+	Action *common = txt->history;
+	for (Action *cur = a; cur != common; ) {
+		if (cur->seq > common->seq)
+			cur = cur->prev;
+		else
+			common = common->prev;
 	}
+	while (txt->history != common)
+		pos = text_undo(txt);
+	for (Action *cur = a; cur != common; cur = cur->prev)
+		cur->prev->next = cur;
+	while (txt->history != a)
+		pos = text_redo(txt);
 	return pos;
 }
 
-size_t text_earlier(Text *txt, int count) {
-	Action *a = txt->history;
-	while (count-- > 0 && a->earlier)
-		a = a->earlier;
-	return history_traverse_to(txt, a);
+/* memory used by the undo history: all pieces which are not part of the
+ * document, changes, actions and the data stored in insertion buffers */
+static size_t history_size(Text *txt) {
+	size_t size = (txt->pieces.objects - txt->active) * txt->pieces.size +
+	              txt->refs.objects * txt->refs.size +
+	              txt->changes.objects * txt->changes.size +
+	              txt->actions.objects * txt->actions.size;
+	for (Buffer *buf = txt->buffers; buf; buf = buf->next) {
+		if (buf != txt->buf && buf->type == ANON)
+			size += buf->len;
+	}
+	return size;
 }
 
-size_t text_later(Text *txt, int count) {
-	Action *a = txt->history;
-	while (count-- > 0 && a->later)
-		a = a->later;
-	return history_traverse_to(txt, a);
-}
+/* Make `root', an ancestor of the current state, the new root of the undo
+ * tree. All actions which are not part of its subtree are discarded, this
+ * includes the changes of `root' itself, since it can no longer be undone.
+ * Pieces and buffers which are no longer referenced are released.
+ */
+static void history_prune(Text *txt, Action *root) {
+	Action *first = root;
+	while (first->prev)
+		first = first->prev;
+	if (first == root)
+		return;
 
-size_t text_restore(Text *txt, time_t time) {
-	Action *a = txt->history;
-	while (time < a->time && a->earlier)
-		a = a->earlier;
-	while (time > a->time && a->later)
-		a = a->later;
-	time_t diff = labs(a->time - time);
-	if (a->earlier && a->earlier != txt->history && labs(a->earlier->time - time) < diff)
-		a = a->earlier;
-	if (a->later && a->later != txt->history && labs(a->later->time - time) < diff)
-		a = a->later;
-	return history_traverse_to(txt, a);
-}
+	/* actions are chronologically ordered, parents precede their children */
+	for (Action *a = first; a; a = a->later)
+		a->keep = (a == root) || (a->prev && a->prev->keep);
+
+	Action *last = NULL;
+	for (Action *later, *a = first; a; a = later) {
+		later = a->later;
+		if (a->keep) {
+			a->earlier = last;
+			if (last)
+				last->later = a;
+			last = a;
+			continue;
+		}
+		if (txt->saved_action == a)
+			txt->saved_action = NULL;
+		action_free(txt, a);
+	}
+	last->later = NULL;
+	txt->last_action = last;
 
-time_t text_state(Text *txt) {
-	return txt->history->time;
+	for (Change *next, *c = root->change; c; c = next) {
+		next = c->next;
+		change_free(txt, c);
+	}
+	root->change = NULL;
+	root->prev = NULL;
+	root->earlier = NULL;
+	history_index(txt);
+	buffer_collect(txt);
 }
 
-static bool preserve_acl(int src, int dest) {
-#if CONFIG_ACL
-	acl_t acl = acl_get_fd(src);
-	if (!acl)
-		return errno == ENOTSUP ? true : false;
-	if (acl_set_fd(dest, acl) == -1) {
-		acl_free(acl);
-		return false;
+/* release the memory of insertion buffers no longer referenced by any piece.
+ * Their pages are replaced by inaccessible ones, reserving the addresses
+ * until text_free: marks are raw pointers, a stale one would otherwise
+ * resolve into a new buffer placed at the same address. */
+static void buffer_collect(Text *txt) {
+	for (Buffer *next, **prev = &txt->buffers, *buf = txt->buffers; buf; buf = next) {
+		next = buf->next;
+		if (buf->pieces == 0 && buf != txt->buffers && buf != txt->buf && buf->type == ANON &&
+		    !txt->versions && !array_length(&txt->swap.refs) &&
+		    buffer_anon(buf->data, buf->size, PROT_NONE) != MAP_FAILED) {
+			*prev = next;
+			relocation_drop(txt, buf);
+			array_release(&buf->stored);
+			buf->next = txt->retired;
+			txt->retired = buf;
+		} else {
+			prev = &buf->next;
+		}
 	}
-	acl_free(acl);
-#endif /* CONFIG_ACL */
-	return true;
+}
+
+/* discard all history except for the `count' states preceding the current one */
+static void history_compact(Text *txt, size_t count) {
+	Action *root = txt->history;
+	while (count-- > 0 && root->prev)
+		root = root->prev;
+	history_prune(txt, root);
+}
+
+/* enforce the configured history limits whenever a new action is started,
+ * to avoid doing so every time the history is shrunk to three quarters of them */
+static bool history_exceeds(Text *txt, size_t actions, size_t size) {
+	return (actions && txt->actions.objects > actions) ||
+	       (size && history_size(txt) > size);
+}
+
+static void history_limit(Text *txt) {
+	size_t actions = txt->history_actions, size = txt->history_size;
+	if (!history_exceeds(txt, actions, size))
+		return;
+	actions -= actions / 4;
+	size -= size / 4;
+	size_t depth = 0;
+	for (Action *a = txt->history; a->prev; a = a->prev)
+		depth++;
+	do {
+		if (actions && depth >= actions)
+			depth = actions - 1;
+		else
+			depth /= 2;
+		history_compact(txt, depth);
+	} while (depth > 0 && history_exceeds(txt, actions, size));
+}
+
+void text_history_limit(Text *txt, size_t actions, size_t size) {
+	txt->history_actions = actions;
+	txt->history_size = size;
+	text_snapshot(txt);
+	history_limit(txt);
+}
+
+size_t text_history_compact(Text *txt, size_t count) {
+	history_restore(txt);
+	text_snapshot(txt);
+	size_t size = history_size(txt);
+	history_compact(txt, count);
+	return size - history_size(txt);
+}
+
+static int piece_cmp(const void *a, const void *b) {
+	uintptr_t pa = (uintptr_t)*(Piece* const*)a, pb = (uintptr_t)*(Piece* const*)b;
+	return pa < pb ? -1 : pa > pb;
+}
+
+/* Relocations are sorted by their former address, find the one containing addr */
+static Relocation *relocation_find(Text *txt, const char *addr) {
+	size_t lo = 0, hi = array_length(&txt->relocations);
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		Relocation *r = array_get(&txt->relocations, mid);
+		if (addr < r->from)
+			hi = mid;
+		else if (addr >= r->from + r->len)
+			lo = mid + 1;
+		else
+			return r;
+	}
+	return NULL;
+}
+
+static int relocation_cmp(const void *a, const void *b) {
+	uintptr_t ra = (uintptr_t)((const Relocation*)a)->from, rb = (uintptr_t)((const Relocation*)b)->from;
+	return ra < rb ? -1 : ra > rb;
+}
+
+/* forget all relocations from or to the data of a buffer about to be freed */
+static void relocation_drop(Text *txt, Buffer *buf) {
+	size_t len = 0;
+	for (size_t i = 0; i < array_length(&txt->relocations); i++) {
+		Relocation *r = array_get(&txt->relocations, i);
+		if ((buf->data <= r->from && r->from < buf->data + buf->size) ||
+		    (buf->data <= r->to && r->to < buf->data + buf->size))
+			continue;
+		array_set(&txt->relocations, len++, r);
+	}
+	txt->relocations.len = len;
+}
+
+/* pieces still linked to by those of the undo history, sorted by address */
+static bool defrag_pinned(Text *txt, Array *pinned) {
+	for (Action *a = txt->current_action ? txt->current_action : txt->last_action; a; a = a->earlier) {
+		for (Change *c = a->change; c; c = c->next) {
+			Span *spans[] = { &c->old, &c->new };
+			for (size_t i = 0; i < LENGTH(spans); i++) {
+				if (spans[i]->start && (!array_add_ptr(pinned, spans[i]->start->prev) ||
+				    !array_add_ptr(pinned, spans[i]->end->next)))
+					return false;
+			}
+		}
+	}
+	if (array_length(pinned))
+		qsort(pinned->items, array_length(pinned), sizeof(Piece*), piece_cmp);
+	return true;
+}
+
+static bool defrag_candidate(Text *txt, Array *pinned, Piece *p) {
+	if (p == &txt->end || p->refs || p->len >= DEFRAG_PIECE)
+		return false;
+	return !array_length(pinned) || !bsearch(&p, pinned->items, array_length(pinned), sizeof(Piece*), piece_cmp);
+}
+
+/* replace the run of pieces from start to end, holding len bytes, by a single one */
+static Piece *defrag_merge(Text *txt, Piece *start, Piece *end, size_t len) {
+	bool contiguous = true;
+	size_t count = 1;
+	for (Piece *p = start; p != end; p = p->next, count++) {
+		if (p->buf != start->buf || p->data + p->len != p->next->data)
+			contiguous = false;
+	}
+	Buffer *buf = start->buf;
+	const char *data = start->data;
+	if (!contiguous) {
+		buf = txt->buffers;
+		if ((!buf || buf == txt->load || !buffer_capacity(buf, len)) && !(buf = buffer_alloc(txt, len)))
+			return NULL;
+		if (!array_reserve(&txt->relocations, array_length(&txt->relocations) + count))
+			return NULL;
+		data = buf->data + buf->len;
+		for (Piece *p = start; ; p = p->next) {
+			Relocation r = { .from = p->data, .len = p->len, .to = buf->data + buf->len };
+			piece_access(p);
+			buffer_append(buf, p->data, p->len);
+			if (r.len)
+				array_add(&txt->relocations, &r);
+			if (p == end)
+				break;
+		}
+	}
+	Piece *new = piece_alloc(txt);
+	if (!new)
+		return NULL;
+	piece_init(new, start->prev, end->next, buf, data, len);
+	new->lines = 0;
+	for (Piece *p = start; ; p = p->next) {
+		if (new->lines != EPOS)
+			new->lines = p->lines == EPOS ? EPOS : new->lines + p->lines;
+		if (p == end)
+			break;
+	}
+	Span old, merged;
+	span_init(&old, start, end);
+	span_init(&merged, new, new);
+	span_swap(txt, &old, &merged);
+	for (Piece *next, *p = start; ; p = next) {
+		next = p->next;
+		piece_free(txt, p);
+		if (p == end)
+			break;
+	}
+	return new;
+}
+
+/* Pieces which are no longer referenced by the undo history only ever change
+ * their neighbours. Runs of short ones, not linked to by any piece of the
+ * history either, are replaced by a single piece. Their data is copied unless
+ * it is already contiguous. Marks into the former data are relocated. */
+size_t text_defragment(Text *txt, size_t max) {
+	size_t copied = 0;
+	Array pinned;
+	array_init(&pinned);
+	if (txt->history_pending || !defrag_pinned(txt, &pinned))
+		goto out;
+	for (Piece *p = txt->begin.next; p != &txt->end && copied < max; ) {
+		Piece *start = p, *end = NULL;
+		size_t len = 0;
+		for (; defrag_candidate(txt, &pinned, p) && len + p->len <= DEFRAG_RUN; p = p->next) {
+			end = p;
+			len += p->len;
+		}
+		if (!end || end == start || len == 0) {
+			p = end ? end->next : p->next;
+			continue;
+		}
+		const char *data = start->data;
+		Piece *merged = defrag_merge(txt, start, end, len);
+		if (!merged)
+			break;
+		if (merged->data != data)
+			copied += len;
+	}
+	if (copied)
+		qsort(txt->relocations.items, array_length(&txt->relocations), sizeof(Relocation), relocation_cmp);
+	buffer_collect(txt);
+out:
+	array_release(&pinned);
+	return copied;
+}
+
+/* The undo history can be persisted in a hidden file next to the one being
+ * edited. It consists of a fixed header, an append only data section holding
+ * the content of all pieces which are not part of the saved document, an
+ * index describing the pieces, changes and actions, and a fixed footer:
+ *
+ *   "vis-undo" version | data ... | index ... | index offset, length "vis-undo"
+ *
+ * Pieces of the saved document are stored as offsets into the file itself.
+ * Upon each save the new data is appended and the index is rewritten.
+ * The index is a sequence of native endian 64bit integers.
+ */
+static char *hidden_path(const char *filename, const char *ext) {
+	char *copy1 = strdup(filename), *copy2 = strdup(filename), *path = NULL;
+	if (copy1 && copy2) {
+		const char *dir = dirname(copy1), *base = basename(copy2);
+		size_t len = strlen(dir) + strlen(base) + strlen(ext) + sizeof("/..");
+		if ((path = malloc(len)))
+			snprintf(path, len, "%s/.%s.%s", dir, base, ext);
+	}
+	free(copy1);
+	free(copy2);
+	return path;
+}
+
+static bool sync_dir(const char *filename) {
+	char *copy = strdup(filename);
+	int dir = copy ? open(dirname(copy), O_DIRECTORY|O_RDONLY) : -1;
+	free(copy);
+	if (dir == -1)
+		return false;
+	bool synced = (fsync(dir) == 0);
+	return close(dir) == 0 && synced;
+}
+
+static bool history_read(int fd, void *data, size_t len, uint64_t off) {
+	for (char *buf = data; len > 0; ) {
+		ssize_t ret = pread(fd, buf, len, off);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+		buf += ret;
+		off += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+static bool history_write(int fd, const void *data, size_t len, uint64_t off) {
+	for (const char *buf = data; len > 0; ) {
+		ssize_t ret = pwrite(fd, buf, len, off);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+		buf += ret;
+		off += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+/* order pieces by the location of their data */
+static int piece_data_cmp(const void *a, const void *b) {
+	const Piece *pa = *(Piece* const*)a, *pb = *(Piece* const*)b;
+	if (pa->buf != pb->buf)
+		return (uintptr_t)pa->buf < (uintptr_t)pb->buf ? -1 : 1;
+	return (uintptr_t)pa->data < (uintptr_t)pb->data ? -1 : (uintptr_t)pa->data > (uintptr_t)pb->data;
+}
+
+static int range_cmp(const void *a, const void *b) {
+	const BufferRange *ra = a, *rb = b;
+	return ra->off < rb->off ? -1 : ra->off > rb->off;
+}
+
+/* find the history file offset of data previously written from this buffer */
+static uint64_t buffer_stored(Buffer *buf, const char *data, size_t len) {
+	size_t off = data - buf->data, lo = 0, hi = array_length(&buf->stored);
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		BufferRange *r = array_get(&buf->stored, mid);
+		if (r->off <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	BufferRange *r = lo > 0 ? array_get(&buf->stored, lo - 1) : NULL;
+	if (r && off + len <= r->off + r->len)
+		return r->pos + (off - r->off);
+	return HISTORY_NONE;
+}
+
+static uint64_t history_piece(Array *pieces, Text *txt, Piece *p) {
+	if (p == &txt->begin)
+		return HISTORY_BEGIN;
+	if (p == &txt->end)
+		return HISTORY_END;
+	if (!p)
+		return HISTORY_NONE;
+	Piece **found = bsearch(&p, pieces->items, array_length(pieces), sizeof(Piece*), piece_cmp);
+	return found ? (uint64_t)(found - (Piece**)pieces->items) : HISTORY_NONE;
+}
+
+static uint64_t history_action(Array *actions, Action *a) {
+	size_t index = action_index(actions, a);
+	return index == EPOS ? HISTORY_NONE : index;
+}
+
+static bool history_put(Array *index, uint64_t value) {
+	return array_add(index, &value);
+}
+
+/* write the history of the just saved document to the given file */
+static bool history_store(Text *txt, const char *path) {
+	bool ret = false, fresh;
+	int fd = -1;
+	Array pieces, data, index;
+	array_init(&pieces);
+	array_init(&data);
+	array_init_sized(&index, sizeof(uint64_t));
+
+	fresh = !txt->history_path || strcmp(path, txt->history_path) != 0;
+	if ((fd = open(path, O_RDWR|O_CREAT, 0600)) == -1)
+		goto out;
+	if (!fresh) {
+		/* make sure nobody else modified the file in the meantime */
+		struct stat meta;
+		uint64_t footer[3];
+		fresh = fstat(fd, &meta) == -1 || meta.st_size < HISTORY_HEADER + HISTORY_FOOTER ||
+		        !history_read(fd, footer, sizeof footer, meta.st_size - HISTORY_FOOTER) ||
+		        footer[0] != txt->history_data || memcmp(&footer[2], HISTORY_MAGIC, 8) != 0;
+	}
+
+	/* collect all pieces of the document and those referenced by the undo tree */
+	for (Piece *p = txt->begin.next; p && p != &txt->end; p = p->next) {
+		if (!array_add_ptr(&pieces, p))
+			goto out;
+	}
+	for (size_t i = 0; i < array_length(&txt->timeline); i++) {
+		Action *a = array_get_ptr(&txt->timeline, i);
+		for (Change *c = a->change; c; c = c->next) {
+			for (PieceRef *ref = c->refs; ref; ref = ref->next) {
+				if (!array_add_ptr(&pieces, ref->piece))
+					goto out;
+			}
+		}
+	}
+	qsort(pieces.items, array_length(&pieces), sizeof(Piece*), piece_cmp);
+	size_t npieces = 0;
+	for (size_t i = 0; i < array_length(&pieces); i++) {
+		Piece *p = array_get_ptr(&pieces, i);
+		if (npieces == 0 || array_get_ptr(&pieces, npieces-1) != p)
+			array_set_ptr(&pieces, npieces++, p);
+	}
+	pieces.len = npieces;
+
+	/* pieces which are no longer part of the document need their data stored */
+	size_t live = 0;
+	for (size_t i = 0; i < npieces; i++) {
+		Piece *p = array_get_ptr(&pieces, i);
+		if (p->parent || txt->root == p || !p->len)
+			continue;
+		if (!array_add_ptr(&data, p))
+			goto out;
+		live += p->len;
+	}
+
+	/* start over once most of the data section is no longer used */
+	if (!fresh && txt->history_data - HISTORY_HEADER > 2 * live + BUFFER_SIZE)
+		fresh = true;
+
+	if (fresh) {
+		char header[HISTORY_HEADER] = HISTORY_MAGIC;
+		uint64_t version = HISTORY_VERSION;
+		memcpy(header + 8, &version, sizeof version);
+		free(txt->history_path);
+		if (!(txt->history_path = strdup(path)))
+			goto out;
+		for (Buffer *buf = txt->buffers; buf; buf = buf->next)
+			array_clear(&buf->stored);
+		txt->history_data = HISTORY_HEADER;
+		if (ftruncate(fd, 0) == -1 || !history_write(fd, header, sizeof header, 0))
+			goto out;
+	}
+
+	/* append the data not yet stored, coalescing adjacent pieces */
+	size_t ndata = 0;
+	for (size_t i = 0; i < array_length(&data); i++) {
+		Piece *p = array_get_ptr(&data, i);
+		if (buffer_stored(p->buf, p->data, p->len) == HISTORY_NONE)
+			array_set_ptr(&data, ndata++, p);
+	}
+	data.len = ndata;
+	qsort(data.items, ndata, sizeof(Piece*), piece_data_cmp);
+	for (size_t i = 0; i < ndata; ) {
+		Piece *p = array_get_ptr(&data, i);
+		Buffer *buf = p->buf;
+		piece_access(p);
+		const char *start = p->data, *end = p->data + p->len;
+		for (i++; i < ndata; i++) {
+			Piece *q = array_get_ptr(&data, i);
+			if (q->buf != buf || q->data > end)
+				break;
+			if (q->data + q->len > end)
+				end = q->data + q->len;
+		}
+		BufferRange r = { .off = start - buf->data, .len = end - start, .pos = txt->history_data };
+		if (!buf->stored.elem_size)
+			array_init_sized(&buf->stored, sizeof(BufferRange));
+		if (!history_write(fd, start, r.len, r.pos) || !array_add(&buf->stored, &r))
+			goto out;
+		txt->history_data += r.len;
+		qsort(buf->stored.items, array_length(&buf->stored), sizeof(BufferRange), range_cmp);
+	}
+
+	/* rewrite the index */
+	struct stat *info = &txt->info;
+	bool ok = history_put(&index, info->st_size) &&
+	          history_put(&index, info->st_mtim.tv_sec) &&
+	          history_put(&index, info->st_mtim.tv_nsec) &&
+	          history_put(&index, info->st_ino) &&
+	          history_put(&index, npieces);
+	for (size_t i = 0; ok && i < npieces; i++) {
+		Piece *p = array_get_ptr(&pieces, i);
+		bool active = p->parent || txt->root == p;
+		ok = history_put(&index, active ? HISTORY_PIECE_FILE : 0) &&
+		     history_put(&index, active ? tree_pos(p) : p->len ? buffer_stored(p->buf, p->data, p->len) : 0) &&
+		     history_put(&index, p->len) &&
+		     history_put(&index, history_piece(&pieces, txt, p->prev)) &&
+		     history_put(&index, history_piece(&pieces, txt, p->next));
+	}
+	ok = ok && history_put(&index, txt->active);
+	for (Piece *p = txt->begin.next; ok && p != &txt->end; p = p->next)
+		ok = history_put(&index, history_piece(&pieces, txt, p));
+	Array *actions = &txt->timeline;
+	ok = ok && history_put(&index, array_length(actions)) &&
+	     history_put(&index, history_action(actions, txt->history)) &&
+	     history_put(&index, history_action(actions, txt->saved_action));
+	for (size_t i = 0; ok && i < array_length(actions); i++) {
+		Action *a = array_get_ptr(actions, i);
+		size_t nchanges = 0;
+		for (Change *c = a->change; c; c = c->next)
+			nchanges++;
+		ok = history_put(&index, a->time) &&
+		     history_put(&index, history_action(actions, a->prev)) &&
+		     history_put(&index, history_action(actions, a->next)) &&
+		     history_put(&index, nchanges);
+		for (Change *c = a->change; ok && c; c = c->next) {
+			size_t nrefs = 0;
+			for (PieceRef *ref = c->refs; ref; ref = ref->next)
+				nrefs++;
+			ok = history_put(&index, c->pos) &&
+			     history_put(&index, history_piece(&pieces, txt, c->old.start)) &&
+			     history_put(&index, history_piece(&pieces, txt, c->old.end)) &&
+			     history_put(&index, c->old.len) &&
+			     history_put(&index, history_piece(&pieces, txt, c->new.start)) &&
+			     history_put(&index, history_piece(&pieces, txt, c->new.end)) &&
+			     history_put(&index, c->new.len) &&
+			     history_put(&index, nrefs);
+			for (PieceRef *ref = c->refs; ok && ref; ref = ref->next)
+				ok = history_put(&index, history_piece(&pieces, txt, ref->piece));
+		}
+	}
+	if (!ok)
+		goto out;
+
+	size_t len = array_length(&index) * sizeof(uint64_t);
+	uint64_t footer[3] = { txt->history_data, len };
+	memcpy(&footer[2], HISTORY_MAGIC, 8);
+	ret = history_write(fd, index.items, len, txt->history_data) &&
+	      history_write(fd, footer, sizeof footer, txt->history_data + len) &&
+	      ftruncate(fd, txt->history_data + len + sizeof footer) == 0 &&
+	      fsync(fd) == 0;
+out:
+	if (!ret && txt->history_path && strcmp(path, txt->history_path) == 0) {
+		/* the state of the file is unknown, start over next time */
+		free(txt->history_path);
+		txt->history_path = NULL;
+	}
+	if (fd != -1)
+		close(fd);
+	array_release(&pieces);
+	array_release(&data);
+	array_release(&index);
+	return ret;
+}
+
+typedef struct {
+	const uint64_t *cur, *end;
+	bool error;
+} HistoryReader;
+
+static uint64_t history_get(HistoryReader *r) {
+	if (r->cur == r->end) {
+		r->error = true;
+		return 0;
+	}
+	return *r->cur++;
+}
+
+/* resolve a piece reference, valid are indices of pieces and the sentinels */
+static Piece *history_get_piece(HistoryReader *r, Text *txt, Piece **pieces, size_t npieces, bool sentinels) {
+	uint64_t i = history_get(r);
+	if (i < npieces)
+		return pieces ? pieces[i] : &txt->begin;
+	if (i == HISTORY_NONE)
+		return NULL;
+	if (sentinels && i == HISTORY_BEGIN)
+		return &txt->begin;
+	if (sentinels && i == HISTORY_END)
+		return &txt->end;
+	r->error = true;
+	return NULL;
+}
+
+static Action *history_get_action(HistoryReader *r, Action **actions, size_t nactions) {
+	uint64_t i = history_get(r);
+	if (i < nactions)
+		return actions ? actions[i] : NULL;
+	if (i != HISTORY_NONE)
+		r->error = true;
+	return NULL;
+}
+
+/* Parse the index of a history file. The first pass only checks its
+ * consistency, the second one (with allocated pieces and actions) links
+ * them together. */
+static bool history_parse(Text *txt, HistoryReader *r, Buffer *buf, uint64_t data,
+                          Piece **pieces, Action **actions) {
+	struct stat *info = &txt->info;
+	if (history_get(r) != (uint64_t)info->st_size ||
+	    history_get(r) != (uint64_t)info->st_mtim.tv_sec ||
+	    history_get(r) != (uint64_t)info->st_mtim.tv_nsec ||
+	    history_get(r) != (uint64_t)info->st_ino)
+		return false;
+	size_t npieces = history_get(r);
+	if (r->error || npieces > (size_t)(r->end - r->cur) / 5)
+		return false;
+	const uint64_t *records = r->cur;
+	for (size_t i = 0; i < npieces; i++) {
+		uint64_t flags = history_get(r), off = history_get(r), len = history_get(r);
+		if (flags == HISTORY_PIECE_FILE) {
+			if (off > txt->size || len > txt->size - off)
+				return false;
+		} else if (flags != 0 || (len && (off < HISTORY_HEADER || off > data || len > data - off))) {
+			return false;
+		}
+		Piece *prev = history_get_piece(r, txt, pieces, npieces, true);
+		Piece *next = history_get_piece(r, txt, pieces, npieces, true);
+		if (pieces) {
+			Piece *p = pieces[i];
+			if (flags == HISTORY_PIECE_FILE)
+				piece_init(p, prev, next, buffer_window(txt, off), txt->buf ? txt->buf->data + off : NULL, len);
+			else
+				piece_init(p, prev, next, buf, len ? buf->data + (off - HISTORY_HEADER) : NULL, len);
+		}
+	}
+
+	/* the saved document consists of consecutive pieces of the file */
+	size_t ndoc = history_get(r), pos = 0;
+	if (r->error || ndoc > npieces)
+		return false;
+	Piece *tail = &txt->begin;
+	for (size_t i = 0, last = HISTORY_NONE; i < ndoc; i++) {
+		uint64_t j = history_get(r);
+		if (j >= npieces || j == last || records[5*j] != HISTORY_PIECE_FILE || records[5*j+1] != pos)
+			return false;
+		pos += records[5*j+2];
+		last = j;
+		if (pieces) {
+			Piece *p = pieces[j];
+			p->prev = tail;
+			tail->next = p;
+			piece_index(txt, tail, p);
+			tail = p;
+		}
+	}
+	if (pos != txt->size)
+		return false;
+	if (pieces) {
+		tail->next = &txt->end;
+		txt->end.prev = tail;
+	}
+
+	size_t nactions = history_get(r);
+	if (r->error || nactions == 0 || nactions > (size_t)(r->end - r->cur) / 4)
+		return false;
+	uint64_t history = history_get(r), saved = history_get(r);
+	if (history >= nactions || (saved >= nactions && saved != HISTORY_NONE))
+		return false;
+	for (size_t i = 0; i < nactions; i++) {
+		Action *a = actions ? actions[i] : NULL;
+		time_t time = history_get(r);
+		Action *prev = history_get_action(r, actions, nactions);
+		Action *next = history_get_action(r, actions, nactions);
+		size_t nchanges = history_get(r);
+		if (r->error || nchanges > (size_t)(r->end - r->cur) / 8)
+			return false;
+		if (a) {
+			a->time = time;
+			a->prev = prev;
+			a->next = next;
+			a->seq = i;
+			a->earlier = i > 0 ? actions[i-1] : NULL;
+			a->later = i+1 < nactions ? actions[i+1] : NULL;
+		}
+		Change *last = NULL;
+		for (size_t j = 0; j < nchanges; j++) {
+			Change *c = actions ? pool_alloc(&txt->changes) : NULL;
+			if (actions && !c)
+				return false;
+			Change tmp = { .pos = history_get(r) };
+			tmp.old.start = history_get_piece(r, txt, pieces, npieces, false);
+			tmp.old.end = history_get_piece(r, txt, pieces, npieces, false);
+			tmp.old.len = history_get(r);
+			tmp.new.start = history_get_piece(r, txt, pieces, npieces, false);
+			tmp.new.end = history_get_piece(r, txt, pieces, npieces, false);
+			tmp.new.len = history_get(r);
+			size_t nrefs = history_get(r);
+			if (r->error || nrefs > (size_t)(r->end - r->cur))
+				return false;
+			if (c) {
+				*c = tmp;
+				c->prev = last;
+				if (last)
+					last->next = c;
+				else
+					a->change = c;
+				last = c;
+			}
+			for (size_t k = 0; k < nrefs; k++) {
+				Piece *p = history_get_piece(r, txt, pieces, npieces, false);
+				if (!p)
+					return false;
+				if (c) {
+					PieceRef *ref = pool_alloc(&txt->refs);
+					if (!ref)
+						return false;
+					ref->piece = p;
+					ref->next = c->refs;
+					c->refs = ref;
+					p->refs++;
+				}
+			}
+		}
+	}
+
+	if (r->error || r->cur != r->end)
+		return false;
+	if (actions) {
+		txt->history = actions[history];
+		txt->saved_action = saved < nactions ? actions[saved] : NULL;
+		txt->last_action = actions[nactions-1];
+	}
+	return true;
+}
+
+/* Restore the history of a previous session, this replaces the pieces
+ * of the document. It is therefore done before the first modification. */
+static void history_restore(Text *txt) {
+	if (!txt->history_pending)
+		return;
+	txt->history_pending = false;
+	Action *root = txt->history;
+	if (txt->current_action || !root || root->prev || root->next || root->later)
+		return;
+
+	Buffer *buf = NULL;
+	Piece **pieces = NULL;
+	Action **actions = NULL;
+	uint64_t *index = NULL;
+	int fd = open(txt->history_path, O_RDONLY);
+	if (fd == -1)
+		return;
+
+	struct stat meta;
+	char header[HISTORY_HEADER];
+	uint64_t footer[3], version;
+	if (fstat(fd, &meta) == -1 || meta.st_size < HISTORY_HEADER + HISTORY_FOOTER ||
+	    !history_read(fd, header, sizeof header, 0) ||
+	    !history_read(fd, footer, sizeof footer, meta.st_size - HISTORY_FOOTER))
+		goto err;
+	memcpy(&version, header + 8, sizeof version);
+	uint64_t data = footer[0], len = footer[1];
+	if (memcmp(header, HISTORY_MAGIC, 8) != 0 || version != HISTORY_VERSION ||
+	    memcmp(&footer[2], HISTORY_MAGIC, 8) != 0 || data < HISTORY_HEADER ||
+	    len % sizeof(uint64_t) || data + len + HISTORY_FOOTER != (uint64_t)meta.st_size)
+		goto err;
+	if (!(index = malloc(len ? len : 1)) || !history_read(fd, index, len, data))
+		goto err;
+
+	HistoryReader r = { index, index + len / sizeof(uint64_t), false };
+	if (!history_parse(txt, &r, NULL, data, NULL, NULL))
+		goto err;
+	r.cur = index + 5;
+	size_t npieces = r.cur[-1];
+	r.cur += 5 * npieces;
+	r.cur += 1 + *r.cur;
+	size_t nactions = *r.cur;
+
+	size_t size = data - HISTORY_HEADER;
+	if (size > 0) {
+		if (!(buf = buffer_alloc(txt, size)))
+			goto err;
+		if (!history_read(fd, buf->data, size, HISTORY_HEADER))
+			goto err;
+		buf->len = size;
+		BufferRange range = { .off = 0, .len = size, .pos = HISTORY_HEADER };
+		array_init_sized(&buf->stored, sizeof(BufferRange));
+		if (!array_add(&buf->stored, &range))
+			goto err;
+	}
+
+	if (!(pieces = calloc(npieces ? npieces : 1, sizeof(Piece*))) ||
+	    !(actions = calloc(nactions, sizeof(Action*))) ||
+	    !array_reserve(&txt->timeline, nactions))
+		goto err;
+	for (size_t i = 0; i < npieces; i++) {
+		if (!(pieces[i] = piece_alloc(txt)))
+			goto err;
+	}
+	for (size_t i = 0; i < nactions; i++) {
+		if (!(actions[i] = pool_alloc(&txt->actions)))
+			goto err;
+	}
+
+	/* from here on the document is replaced, errors are no longer expected */
+	for (Piece *next, *p = txt->begin.next; p != &txt->end; p = next) {
+		next = p->next;
+		piece_unindex(txt, p);
+		piece_free(txt, p);
+	}
+	action_free(txt, root);
+	r.cur = index;
+	history_parse(txt, &r, buf, data, pieces, actions);
+	history_index(txt);
+	txt->cache = NULL;
+	lineno_cache_invalidate(&txt->lines);
+	txt->history_data = data;
+	free(pieces);
+	free(actions);
+	free(index);
+	close(fd);
+	return;
+err:
+	if (pieces) {
+		for (size_t i = 0; i < npieces && pieces[i]; i++)
+			piece_free(txt, pieces[i]);
+	}
+	if (actions) {
+		for (size_t i = 0; i < nactions && actions[i]; i++)
+			pool_free(&txt->actions, actions[i]);
+	}
+	if (buf) {
+		txt->buffers = buf->next;
+		buffer_free(buf);
+	}
+	free(pieces);
+	free(actions);
+	free(index);
+	close(fd);
+	/* start over with a new file upon the next save */
+	free(txt->history_path);
+	txt->history_path = NULL;
+}
+
+bool text_history_file(Text *txt, const char *filename) {
+	free(txt->history_path);
+	txt->history_path = NULL;
+	txt->history_pending = false;
+	txt->history_persist = filename != NULL;
+	if (!filename)
+		return true;
+	if (!(txt->history_path = hidden_path(filename, "undo")))
+		return false;
+	txt->history_pending = true;
+	return true;
+}
+
+/* Unsaved modifications are journaled in a hidden swap file next to the
+ * edited one, such that they can be recovered after a crash:
+ *
+ *   "vis-swap" inode size mtime.sec mtime.nsec | record ...
+ *
+ * Each record replaces `del' bytes at `pos' by `ins' bytes of data:
+ *
+ *   pos del ins | data ... | checksum
+ *
+ * all of them native endian 64bit integers. The records apply to the file
+ * described by the header, replaying stops at the first incomplete one.
+ * They are buffered in memory and only written by text_swap_sync, editing
+ * thus never waits for the disk. Large insertions, e.g. undoing the deletion
+ * of a huge range, refer to the data of their pieces instead of copying it.
+ * The buffers are not collected until the referenced data is written.
+ */
+static uint64_t swap_hash(uint64_t hash, const char *data, size_t len) {
+	for (const unsigned char *cur = (const unsigned char*)data, *end = cur + len; cur < end; cur++)
+		hash = (hash ^ *cur) * 1099511628211u;
+	return hash;
+}
+
+static bool swap_reserve(Swap *swap, size_t len) {
+	if (swap->size - swap->len >= len)
+		return true;
+	size_t size = MAX(swap->len + len, 2 * swap->size);
+	char *data = realloc(swap->data, size);
+	if (!data)
+		return false;
+	swap->data = data;
+	swap->size = size;
+	return true;
+}
+
+/* like text_bytes_get, without accounting for the copied bytes */
+static void swap_copy(Text *txt, char *buf, size_t pos, size_t len) {
+	for (Iterator it = text_iterator_get(txt, pos);
+	     len > 0 && text_iterator_valid(&it);
+	     text_iterator_next(&it)) {
+		size_t n = MIN((size_t)(it.end - it.text), len);
+		memcpy(buf, it.text, n);
+		buf += n;
+		len -= n;
+	}
+}
+
+/* describe the file the following records apply to */
+static void swap_base(Text *txt) {
+	Swap *swap = &txt->swap;
+	struct stat *info = &txt->info;
+	memcpy(&swap->header[0], SWAP_MAGIC, sizeof swap->header[0]);
+	swap->header[1] = info->st_ino;
+	swap->header[2] = info->st_size;
+	swap->header[3] = info->st_mtim.tv_sec;
+	swap->header[4] = info->st_mtim.tv_nsec;
+}
+
+/* append the checksum to the last record, it can no longer be extended */
+static void swap_close(Swap *swap) {
+	if (swap->open == EPOS)
+		return;
+	uint64_t hash = swap_hash(1469598103934665603u, swap->data + swap->open, swap->len - swap->open);
+	memcpy(swap->data + swap->len, &hash, sizeof hash);
+	swap->len += sizeof hash;
+	swap->open = EPOS;
+}
+
+/* Record that `del' bytes at `pos' were replaced by the `ins' bytes now found
+ * there. Modifications within or right after the data of the last record,
+ * as caused by typing or backspacing, extend it instead of adding a new one. */
+static void swap_record(Text *txt, size_t pos, size_t del, size_t ins) {
+	Swap *swap = &txt->swap;
+	if (!swap->path || swap->replay || swap->stale)
+		return;
+	if (swap->fd == -1 && swap->len == 0)
+		swap_base(txt);
+	bool copy = ins < SWAP_REFERENCE;
+	/* room for the copied data, a new record header and the checksums */
+	if (!swap_reserve(swap, (copy ? ins : 0) + SWAP_RECORD + 2 * sizeof(uint64_t))) {
+		swap->stale = true;
+		return;
+	}
+	uint64_t record[3];
+	if (swap->open != EPOS) {
+		memcpy(record, swap->data + swap->open, sizeof record);
+		size_t start = record[0], end = record[0] + record[2];
+		if (copy && start <= pos && pos <= end) {
+			size_t inside = MIN(del, end - pos);
+			char *data = swap->data + swap->open + SWAP_RECORD + (pos - start);
+			memmove(data + ins, data + inside, end - pos - inside);
+			swap->len = swap->len - inside + ins;
+			record[1] += del - inside;
+			record[2] = record[2] - inside + ins;
+			memcpy(swap->data + swap->open, record, sizeof record);
+			swap_copy(txt, data, pos, ins);
+			return;
+		}
+		swap_close(swap);
+	}
+	record[0] = pos;
+	record[1] = del;
+	record[2] = ins;
+	memcpy(swap->data + swap->len, record, sizeof record);
+	swap->len += sizeof record;
+	if (copy) {
+		swap->open = swap->len - sizeof record;
+		swap_copy(txt, swap->data + swap->len, pos, ins);
+		swap->len += ins;
+		return;
+	}
+	for (Iterator it = text_iterator_get(txt, pos); ins > 0 && text_iterator_valid(&it); text_iterator_next(&it)) {
+		SwapRef ref = { .off = swap->len, .data = it.text, .len = MIN((size_t)(it.end - it.text), ins) };
+		if (!array_add(&swap->refs, &ref)) {
+			swap->stale = true;
+			return;
+		}
+		ins -= ref.len;
+	}
+	/* room for the checksum, computed once the data is written */
+	swap->len += sizeof(uint64_t);
+	/* the referenced data must no longer be modified in place */
+	txt->cache = NULL;
+}
+
+/* write the buffered records, splicing in the referenced data and completing
+ * the checksums of the records it belongs to */
+static bool swap_flush(Swap *swap) {
+	size_t done = 0;
+	uint64_t off = swap->written;
+	for (size_t i = 0, n = array_length(&swap->refs); i < n; ) {
+		SwapRef *ref = array_get(&swap->refs, i);
+		size_t end = ref->off;
+		uint64_t hash = swap_hash(1469598103934665603u, swap->data + end - SWAP_RECORD, SWAP_RECORD);
+		if (!history_write(swap->fd, swap->data + done, end - done, off))
+			return false;
+		off += end - done;
+		for (; i < n && (ref = array_get(&swap->refs, i))->off == end; i++) {
+			if (!history_write(swap->fd, ref->data, ref->len, off))
+				return false;
+			hash = swap_hash(hash, ref->data, ref->len);
+			off += ref->len;
+		}
+		memcpy(swap->data + end, &hash, sizeof hash);
+		done = end;
+	}
+	if (!history_write(swap->fd, swap->data + done, swap->len - done, off))
+		return false;
+	swap->written = off + swap->len - done;
+	return true;
+}
+
+/* write the whole text as a single record replacing the file content to a
+ * new swap file, which atomically replaces the existing one */
+static bool swap_compact(Text *txt) {
+	Swap *swap = &txt->swap;
+	size_t len = strlen(swap->path);
+	char *tmpname = malloc(len + 2);
+	if (!tmpname)
+		return false;
+	snprintf(tmpname, len + 2, "%s~", swap->path);
+	swap_base(txt);
+	uint64_t record[3] = { 0, swap->header[2], txt->size };
+	uint64_t hash = swap_hash(1469598103934665603u, (char*)record, sizeof record);
+	uint64_t off = SWAP_HEADER + sizeof record;
+	int fd = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	bool ret = fd != -1 &&
+	           history_write(fd, swap->header, SWAP_HEADER, 0) &&
+	           history_write(fd, record, sizeof record, SWAP_HEADER);
+	for (Iterator it = text_iterator_get(txt, 0); ret && text_iterator_valid(&it); text_iterator_next(&it)) {
+		size_t n = it.end - it.text;
+		ret = history_write(fd, it.text, n, off);
+		hash = swap_hash(hash, it.text, n);
+		off += n;
+	}
+	ret = ret && history_write(fd, &hash, sizeof hash, off) &&
+	      fdatasync(fd) == 0 && rename(tmpname, swap->path) == 0;
+	if (!ret) {
+		if (fd != -1) {
+			close(fd);
+			unlink(tmpname);
+		}
+		free(tmpname);
+		return false;
+	}
+	free(tmpname);
+	sync_dir(swap->path);
+	if (swap->fd != -1)
+		close(swap->fd);
+	swap->fd = fd;
+	swap->written = swap->synced = off + sizeof hash;
+	swap->len = 0;
+	swap->open = EPOS;
+	array_clear(&swap->refs);
+	swap->stale = false;
+	return true;
+}
+
+static bool swap_write(Text *txt) {
+	Swap *swap = &txt->swap;
+	if (!swap->path)
+		return true;
+	swap_close(swap);
+	if (swap->len == 0 && !swap->stale)
+		return true;
+	if (swap->fd == -1) {
+		swap->written = swap->synced = 0;
+		if (!swap->stale) {
+			swap->fd = open(swap->path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+			if (swap->fd != -1 && history_write(swap->fd, swap->header, SWAP_HEADER, 0))
+				swap->written = SWAP_HEADER;
+			else
+				swap->stale = true;
+		}
+	}
+	/* bound the size of the swap file by that of the text, amortizing the cost */
+	uint64_t size = swap->written + swap->len;
+	for (size_t i = 0; i < array_length(&swap->refs); i++)
+		size += ((SwapRef*)array_get(&swap->refs, i))->len;
+	if (swap->stale || (size > SWAP_COMPACT && size > 2 * (uint64_t)txt->size))
+		return swap_compact(txt);
+	bool ret = swap_flush(swap);
+	if (!ret)
+		swap->stale = true;
+	swap->len = 0;
+	array_clear(&swap->refs);
+	return ret;
+}
+
+/* remove the swap file, i.e. once all modifications were saved */
+static void swap_discard(Text *txt) {
+	Swap *swap = &txt->swap;
+	if (swap->fd != -1) {
+		close(swap->fd);
+		unlink(swap->path);
+	}
+	swap->fd = -1;
+	swap->len = 0;
+	swap->open = EPOS;
+	array_clear(&swap->refs);
+	swap->written = swap->synced = 0;
+	swap->stale = false;
+}
+
+bool text_swap_file(Text *txt, const char *filename) {
+	Swap *swap = &txt->swap;
+	char *path = NULL;
+	if (filename && !(path = hidden_path(filename, "swap")))
+		return false;
+	if (path && swap->path && strcmp(path, swap->path) == 0) {
+		free(path);
+		return true;
+	}
+	swap_discard(txt);
+	free(swap->path);
+	swap->path = path;
+	/* earlier modifications were not recorded */
+	swap->stale = path && text_modified(txt);
+	return true;
+}
+
+bool text_swap_sync(Text *txt) {
+	Swap *swap = &txt->swap;
+	if (!swap_write(txt))
+		return false;
+	if (swap->fd == -1 || swap->synced == swap->written)
+		return true;
+	if (fdatasync(swap->fd) == -1 || (swap->synced == 0 && !sync_dir(swap->path)))
+		return false;
+	swap->synced = swap->written;
+	return true;
+}
+
+bool text_swap_recover(Text *txt) {
+	Swap *swap = &txt->swap;
+	if (!swap->path || swap->fd != -1 || txt->current_action || text_modified(txt)) {
+		errno = EBUSY;
+		return false;
+	}
+	int fd = open(swap->path, O_RDWR);
+	if (fd == -1)
+		return false;
+	/* data appended to the file since is part of the journal, see text_load_append */
+	struct stat *info = &txt->info;
+	uint64_t *header = swap->header;
+	if (!history_read(fd, header, SWAP_HEADER, 0) ||
+	    memcmp(&header[0], SWAP_MAGIC, sizeof header[0]) != 0 ||
+	    header[1] != (uint64_t)info->st_ino || header[2] > (uint64_t)txt->size ||
+	    (header[2] == (uint64_t)txt->size && (header[3] != (uint64_t)info->st_mtim.tv_sec ||
+	     header[4] != (uint64_t)info->st_mtim.tv_nsec))) {
+		close(fd);
+		errno = EINVAL;
+		return false;
+	}
+
+	char *data = NULL;
+	uint64_t record[3], hash, off = SWAP_HEADER;
+	swap->replay = true;
+	text_snapshot(txt);
+	text_delete(txt, header[2], txt->size - header[2]);
+	while (history_read(fd, record, sizeof record, off)) {
+		size_t pos = record[0], del = record[1], ins = record[2];
+		if (record[2] > SIZE_MAX - sizeof hash || pos > txt->size || del > txt->size - pos)
+			break;
+		char *buf = realloc(data, ins + 1);
+		if (!buf)
+			break;
+		data = buf;
+		if (!history_read(fd, data, ins, off + sizeof record) ||
+		    !history_read(fd, &hash, sizeof hash, off + sizeof record + ins))
+			break;
+		uint64_t check = swap_hash(swap_hash(1469598103934665603u, (char*)record, sizeof record), data, ins);
+		if (check != hash || !text_delete(txt, pos, del) || !text_insert(txt, pos, data, ins))
+			break;
+		off += sizeof record + ins + sizeof hash;
+	}
+	text_snapshot(txt);
+	swap->replay = false;
+	free(data);
+	/* continue appending after the last complete record */
+	if (ftruncate(fd, off) == -1) {
+		close(fd);
+		swap->stale = true;
+		return true;
+	}
+	swap->fd = fd;
+	swap->written = swap->synced = off;
+	return true;
+}
+
+size_t text_earlier(Text *txt, int count) {
+	history_restore(txt);
+	size_t index = action_index(&txt->timeline, txt->history);
+	if (count > 0)
+		index = (size_t)count < index ? index - count : 0;
+	return history_traverse_to(txt, array_get_ptr(&txt->timeline, index));
+}
+
+size_t text_later(Text *txt, int count) {
+	history_restore(txt);
+	size_t index = action_index(&txt->timeline, txt->history);
+	size_t last = array_length(&txt->timeline) - 1;
+	if (count > 0)
+		index = (size_t)count < last - index ? index + count : last;
+	return history_traverse_to(txt, array_get_ptr(&txt->timeline, index));
+}
+
+/* index of the first action created at or after `time', or the number of
+ * actions if there is none. Action times are assumed to be non-decreasing. */
+static size_t history_time(Text *txt, time_t time) {
+	size_t lo = 0, hi = array_length(&txt->timeline);
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		Action *a = array_get_ptr(&txt->timeline, mid);
+		if (a->time < time)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* find the state a walk along the chronological chain starting from the
+ * current one would end up at: going back it stops at the most recent action
+ * at or before `time', forward at the first one at or after it, in both cases
+ * unless an exact match does not exist. A closer neighbour is preferred. */
+static Action *history_closest(Text *txt, time_t time) {
+	Array *timeline = &txt->timeline;
+	size_t index = action_index(timeline, txt->history);
+	size_t last = array_length(timeline) - 1;
+	if (time < txt->history->time) {
+		index = history_time(txt, time + 1);
+		index = index > 0 ? index - 1 : 0;
+	}
+	Action *a = array_get_ptr(timeline, index);
+	if (time > a->time) {
+		index = MAX(index, history_time(txt, time));
+		a = array_get_ptr(timeline, MIN(index, last));
+	}
+	time_t diff = labs(a->time - time);
+	if (a->earlier && a->earlier != txt->history && labs(a->earlier->time - time) < diff)
+		a = a->earlier;
+	if (a->later && a->later != txt->history && labs(a->later->time - time) < diff)
+		a = a->later;
+	return a;
+}
+
+size_t text_restore(Text *txt, time_t time) {
+	history_restore(txt);
+	return history_traverse_to(txt, history_closest(txt, time));
+}
+
+time_t text_state(Text *txt) {
+	history_restore(txt);
+	return txt->history->time;
+}
+
+size_t text_state_id(Text *txt) {
+	history_restore(txt);
+	return txt->history->seq;
+}
+
+size_t text_state_saved(Text *txt) {
+	history_restore(txt);
+	return txt->saved_action ? txt->saved_action->seq : EPOS;
+}
+
+size_t text_state_at(Text *txt, time_t time) {
+	history_restore(txt);
+	return history_closest(txt, time)->seq;
+}
+
+/* position of the first piece of both spans, i.e. where the change replaced
+ * old.len bytes by new.len ones. If the modification started midway through
+ * a piece, the new span begins with the unmodified part preceding it. */
+static size_t change_start(Change *c) {
+	Piece *before = c->new.start;
+	if (c->old.start && before && before->data == c->old.start->data)
+		return c->pos - before->len;
+	return c->pos;
+}
+
+static DiffHunk *diff_hunk(Diff *diff, size_t index) {
+	return index == EPOS ? NULL : array_get(&diff->hunks, index);
+}
+
+/* return the hunk about to be modified, its former state is recorded if
+ * journaling. Room for it has to be reserved beforehand. */
+static DiffHunk *diff_touch(Diff *diff, size_t index) {
+	DiffHunk *h = diff_hunk(diff, index);
+	if (h && diff->journaling && index < diff->journal_length)
+		array_add(&diff->journal, &(DiffTouch){ .index = index, .hunk = *h });
+	return h;
+}
+
+/* move the cursor to the first hunk ending at or after `pos', or to the last one */
+static void diff_seek(Diff *diff, size_t pos) {
+	DiffHunk *h = diff_hunk(diff, diff->cur);
+	while (h && h->prev != EPOS && diff->pos - h->gap >= pos) {
+		DiffHunk *p = diff_hunk(diff, h->prev);
+		diff->pos -= h->gap + p->len;
+		diff->orig -= h->gap + p->orig;
+		diff->cur = h->prev;
+		h = p;
+	}
+	while (h && h->next != EPOS && diff->pos + h->len < pos) {
+		DiffHunk *n = diff_hunk(diff, h->next);
+		diff->pos += h->len + n->gap;
+		diff->orig += h->orig + n->gap;
+		diff->cur = h->next;
+		h = n;
+	}
+}
+
+/* replace `del' bytes at `pos' by `ins' new ones, merging all hunks which
+ * overlap or touch the modified range. Hunks are found by walking from the
+ * most recently visited one, i.e. in constant time for changes of nearby
+ * or consecutive positions as performed by a single action. */
+static bool diff_add(Diff *diff, size_t pos, size_t del, size_t ins) {
+	if (del == 0 && ins == 0)
+		return true;
+	if (!array_reserve(&diff->hunks, array_length(&diff->hunks) + 1))
+		return false;
+	if (diff->journaling && !array_reserve(&diff->journal, array_length(&diff->journal) + 3))
+		return false;
+	diff_seek(diff, pos);
+	size_t index = diff->cur, start = diff->pos;
+	DiffHunk *h = diff_hunk(diff, index);
+
+	if (!h || start + h->len < pos || start > pos + del) {
+		/* no hunk is affected, add a new one after or before h */
+		bool after = !h || start + h->len < pos;
+		DiffHunk new = {
+			.len = ins,
+			.orig = del,
+			.prev = after ? index : h->prev,
+			.next = after ? EPOS : index,
+		};
+		size_t orig;
+		if (after) {
+			new.gap = h ? pos - (start + h->len) : pos;
+			orig = h ? diff->orig + h->orig + new.gap : pos;
+		} else {
+			new.gap = pos - (start - h->gap);
+			orig = diff->orig - h->gap + new.gap;
+		}
+		array_add(&diff->hunks, &new);
+		size_t added = array_length(&diff->hunks) - 1;
+		if (new.prev != EPOS)
+			diff_touch(diff, new.prev)->next = added;
+		if (new.next != EPOS) {
+			h = diff_touch(diff, new.next);
+			h->prev = added;
+			h->gap = start - (pos + del);
+		}
+		diff->cur = added;
+		diff->pos = pos;
+		diff->orig = orig;
+		diff->live++;
+		return true;
+	}
+
+	/* merge h with all following hunks starting within the modified range */
+	size_t end = start + h->len, len = h->len, orig = h->orig;
+	size_t next = h->next, next_start = EPOS;
+	while (next != EPOS) {
+		DiffHunk *n = diff_hunk(diff, next);
+		next_start = end + n->gap;
+		if (next_start > pos + del)
+			break;
+		end = next_start + n->len;
+		len += n->len;
+		orig += n->orig;
+		next = n->next;
+		diff->live--;
+	}
+	size_t first = MIN(start, pos), last = MAX(end, pos + del);
+	h = diff_touch(diff, index);
+	h->gap -= start - first;
+	h->orig = (last - first) - len + orig;
+	h->len = (last - first) - del + ins;
+	h->next = next;
+	diff->pos = first;
+	diff->orig -= start - first;
+	DiffHunk *n = diff_touch(diff, next);
+	if (n) {
+		n->prev = index;
+		n->gap = next_start - last;
+	}
+
+	if (h->len == 0 && h->orig == 0) {
+		/* the modifications cancelled each other out */
+		size_t at = diff->orig;
+		DiffHunk *p = diff_touch(diff, h->prev);
+		if (p)
+			p->next = next;
+		if (n) {
+			n->prev = h->prev;
+			diff->pos = first + n->gap;
+			diff->orig = at + n->gap;
+			n->gap += h->gap;
+		}
+		if (p) {
+			diff->pos = first - h->gap - p->len;
+			diff->orig = at - h->gap - p->orig;
+		}
+		diff->cur = p ? h->prev : next;
+		diff->live--;
+	}
+	return true;
+}
+
+/* record all following modifications, to be undone by diff_rollback */
+static void diff_journal(Diff *diff) {
+	array_clear(&diff->journal);
+	diff->journaling = true;
+	diff->journal_length = array_length(&diff->hunks);
+	diff->journal_live = diff->live;
+	diff->journal_cur = diff->cur;
+	diff->journal_pos = diff->pos;
+	diff->journal_orig = diff->orig;
+}
+
+static void diff_rollback(Diff *diff) {
+	for (size_t i = array_length(&diff->journal); i-- > 0; ) {
+		DiffTouch *t = array_get(&diff->journal, i);
+		*diff_hunk(diff, t->index) = t->hunk;
+	}
+	diff->hunks.len = diff->journal_length;
+	diff->live = diff->journal_live;
+	diff->cur = diff->journal_cur;
+	diff->pos = diff->journal_pos;
+	diff->orig = diff->journal_orig;
+	diff->journaling = false;
+}
+
+static void diff_clear(Diff *diff) {
+	array_clear(&diff->hunks);
+	diff->live = 0;
+	diff->cur = EPOS;
+	diff->pos = diff->orig = 0;
+}
+
+static bool diff_undo(Diff *diff, Action *a) {
+	for (Change *c = a->change; c; c = c->next) {
+		if (!diff_add(diff, change_start(c), c->new.len, c->old.len))
+			return false;
+	}
+	return true;
+}
+
+static bool diff_redo(Diff *diff, Action *a) {
+	Change *c = a->change;
+	while (c && c->next)
+		c = c->next;
+	for ( ; c; c = c->prev) {
+		if (!diff_add(diff, change_start(c), c->old.len, c->new.len))
+			return false;
+	}
+	return true;
+}
+
+/* compose the changes on the path from one state to the other through their
+ * closest common ancestor, as text_undo/text_redo would perform them */
+static bool diff_path(Diff *diff, Action *a, Action *b) {
+	bool ret = true;
+	Array redo;
+	array_init(&redo);
+	while (ret && a != b) {
+		if (a->seq > b->seq) {
+			ret = diff_undo(diff, a);
+			a = a->prev;
+		} else {
+			ret = array_add_ptr(&redo, b);
+			b = b->prev;
+		}
+	}
+	for (size_t i = array_length(&redo); ret && i-- > 0; )
+		ret = diff_redo(diff, array_get_ptr(&redo, i));
+	array_release(&redo);
+	return ret;
+}
+
+/* report the hunks overlapping or touching r, all of them if it is NULL */
+static void diff_report(Diff *diff, const Filerange *r, bool (*hunk)(const TextDiff*, void *data), void *data) {
+	diff_seek(diff, r ? r->start : 0);
+	size_t pos = diff->pos, orig = diff->orig;
+	for (DiffHunk *h = diff_hunk(diff, diff->cur); h; h = diff_hunk(diff, h->next)) {
+		if (r && pos > r->end)
+			break;
+		TextDiff d = {
+			.from = { orig, orig + h->orig },
+			.to = { pos, pos + h->len },
+		};
+		if ((!r || d.to.end >= r->start) && !hunk(&d, data))
+			break;
+		DiffHunk *n = diff_hunk(diff, h->next);
+		if (n) {
+			pos += h->len + n->gap;
+			orig += h->orig + n->gap;
+		}
+	}
+}
+
+static Action *action_find(Text *txt, size_t seq) {
+	return array_get_ptr(&txt->timeline, action_index(&txt->timeline, &(Action){ .seq = seq }));
+}
+
+bool text_diff(Text *txt, size_t from, size_t to, bool (*hunk)(const TextDiff*, void *data), void *data) {
+	return text_diff_range(txt, from, to, NULL, hunk, data);
+}
+
+/* whether state b is reached from a by only redoing actions */
+static bool action_follows(Action *a, Action *b) {
+	while (b && b->seq > a->seq)
+		b = b->prev;
+	return a == b;
+}
+
+/* The differences from the last requested `from' state are kept up to date
+ * by composing only the actions performed since the previously requested
+ * `to' state. Anything else, like undoing, starts over since the composed
+ * hunks would differ from those of the direct path: a replacement undone
+ * afterwards would remain marked. The action still being recorded can grow
+ * further without a new state, its changes are thus applied temporarily and
+ * rolled back after reporting. Hunks left unlinked by merges are dropped
+ * once they dominate. */
+bool text_diff_range(Text *txt, size_t from, size_t to, const Filerange *r, bool (*hunk)(const TextDiff*, void *data), void *data) {
+	history_restore(txt);
+	Action *a = action_find(txt, from), *b = action_find(txt, to);
+	if (!a || !b)
+		return false;
+
+	Diff *diff = &txt->diff;
+	Action *open = b == txt->current_action ? b : NULL;
+	Action *base = open ? open->prev : b;
+	if (a == txt->current_action || !base) {
+		diff_clear(diff);
+		txt->diff_from = EPOS;
+		bool ret = diff_path(diff, a, b);
+		if (ret)
+			diff_report(diff, r, hunk, data);
+		diff_clear(diff);
+		return ret;
+	}
+
+	Action *cached = txt->diff_from == from ? action_find(txt, txt->diff_to) : NULL;
+	if (cached && (!action_follows(cached, base) || (cached != a && action_follows(cached, a))))
+		cached = NULL;
+	if (!cached || array_length(&diff->hunks) > 2 * diff->live + 4096) {
+		diff_clear(diff);
+		cached = a;
+	}
+	txt->diff_from = EPOS;
+	if (!diff_path(diff, cached, base))
+		return false;
+	txt->diff_from = from;
+	txt->diff_to = base->seq;
+
+	bool ret = true;
+	if (open) {
+		diff_seek(diff, r ? r->start : 0);
+		diff_journal(diff);
+		ret = diff_redo(diff, open);
+	}
+	if (ret)
+		diff_report(diff, r, hunk, data);
+	if (open)
+		diff_rollback(diff);
+	return ret;
+}
+
+static bool preserve_acl(int src, int dest) {
+#if CONFIG_ACL
+	acl_t acl = acl_get_fd(src);
+	if (!acl)
+		return errno == ENOTSUP ? true : false;
+	if (acl_set_fd(dest, acl) == -1) {
+		acl_free(acl);
+		return false;
+	}
+	acl_free(acl);
+#endif /* CONFIG_ACL */
+	return true;
 }
 
 static bool preserve_selinux_context(int src, int dest) {
@@ -925,20 +3284,25 @@ static bool text_save_commit_atomic(TextSave *ctx) {
 
 static bool text_save_begin_inplace(TextSave *ctx) {
 	Text *txt = ctx->txt;
-	struct stat meta = { 0 };
+	struct stat meta = { 0 }, mapped = { 0 };
 	int newfd = -1, saved_errno;
 	if ((ctx->fd = open(ctx->filename, O_CREAT|O_WRONLY, S_IRUSR|S_IWUSR)) == -1)
 		goto err;
 	if (fstat(ctx->fd, &meta) == -1)
 		goto err;
-	if (meta.st_dev == txt->info.st_dev && meta.st_ino == txt->info.st_ino &&
+	/* txt->info describes the file last saved to, which might be another one */
+	if (txt->fd != -1 && fstat(txt->fd, &mapped) == -1)
+		goto err;
+	if (meta.st_dev == mapped.st_dev && meta.st_ino == mapped.st_ino &&
 	    txt->buf && txt->buf->type == MMAP_ORIG && txt->buf->size) {
 		/* The file we are going to overwrite is currently mmap-ed from
-		 * text_load, therefore we copy the mmap-ed buffer to a temporary
-		 * file and remap it at the same position such that all pointers
+		 * text_load, therefore we copy the mmap-ed windows to a temporary
+		 * file and remap them at the same position such that all pointers
 		 * from the various pieces are still valid.
 		 */
-		size_t size = txt->buf->size;
+		size_t size = buffer_mapped(txt);
+		if (!buffer_map_range(txt, 0, size))
+			goto err;
 		char tmpname[32] = "/tmp/vis-XXXXXX";
 		mode_t mask = umask(S_IXUSR | S_IRWXG | S_IRWXO);
 		newfd = mkstemp(tmpname);
@@ -950,23 +3314,24 @@ static bool text_save_begin_inplace(TextSave *ctx) {
 		ssize_t written = write_all(newfd, txt->buf->data, size);
 		if (written == -1 || (size_t)written != size)
 			goto err;
-		if (munmap(txt->buf->data, size) == -1)
-			goto err;
-
-		void *data = mmap(txt->buf->data, size, PROT_READ, MAP_SHARED, newfd, 0);
-		if (data == MAP_FAILED)
-			goto err;
-		if (data != txt->buf->data) {
-			munmap(data, size);
-			goto err;
+		for (Buffer *buf = txt->buffers; buf; buf = buf->next) {
+			if (buf->type != MMAP_ORIG)
+				continue;
+			void *data = mmap(buf->data, buf->size, PROT_READ, MAP_SHARED|MAP_FIXED, newfd, buf->offset);
+			if (data == MAP_FAILED)
+				goto err;
+			posix_madvise(data, buf->size, POSIX_MADV_SEQUENTIAL);
+			buf->type = MMAP;
+			buf->used = 0;
+			buf->detached = false;
 		}
-		bool close_failed = (close(newfd) == -1);
+		txt->resident = 0;
+		array_clear(&txt->changed);
+		bool close_failed = (close(txt->fd) == -1);
+		txt->fd = newfd;
 		newfd = -1;
 		if (close_failed)
 			goto err;
-		txt->buf->data = data;
-		txt->buf->type = MMAP;
-		newfd = -1;
 	}
 	/* overwrite the exisiting file content, if somehting goes wrong
 	 * here we are screwed, TODO: make a backup before? */
@@ -997,9 +3362,270 @@ static bool text_save_commit_inplace(TextSave *ctx) {
 	return true;
 }
 
+/* Whether the piece holds the same content as the file of `size' bytes at
+ * offset `pos'. This is known for the pieces still referring to the same
+ * offset of the mmap-ed file, others are compared with the file content
+ * while the `budget' of bytes to read lasts. */
+static bool text_save_delta_piece(Text *txt, Piece *p, size_t pos, size_t size, size_t *budget, char *buf) {
+	if (pos + p->len > size)
+		return false;
+	if (p->buf && p->buf->type == MMAP_ORIG) {
+		size_t off = p->buf->offset + (p->data - p->buf->data);
+		if (off == pos && !file_changed(txt, off, p->len))
+			return true;
+	}
+	if (!buf || p->len > *budget)
+		return false;
+	*budget -= p->len;
+	piece_access(p);
+	for (size_t off = 0, len; off < p->len; off += len) {
+		len = MIN(p->len - off, BUFFER_SIZE);
+		if (!history_read(txt->fd, buf, len, pos + off) || memcmp(buf, p->data + off, len))
+			return false;
+	}
+	return true;
+}
+
+/* Determine the range of the text which differs from the mmap-ed file of
+ * `size' bytes. If the size did not change the content after it is also
+ * unmodified. The original file content in [range->start, *end) has to
+ * be overwritten. */
+static void text_save_delta_range(Text *txt, size_t size, Filerange *range, size_t *end) {
+	size_t start = 0, stop = txt->size, budget = size / 4;
+	char *buf = malloc(BUFFER_SIZE);
+	for (Piece *p = txt->begin.next; p != &txt->end && text_save_delta_piece(txt, p, start, size, &budget, buf); p = p->next)
+		start += p->len;
+	if (txt->size == size) {
+		for (Piece *p = txt->end.prev; stop > start && text_save_delta_piece(txt, p, stop - p->len, size, &budget, buf); p = p->prev)
+			stop -= p->len;
+	}
+	free(buf);
+	*range = (Filerange){ .start = start, .end = stop };
+	*end = txt->size == size ? stop : size;
+}
+
+/* Overwrite only the part of the file mmap-ed by text_load which differs
+ * from the text. This is only attempted if it touches a small fraction of
+ * the file, otherwise it is cheaper to rewrite it. The ranges passed to
+ * text_save_write_range are merely recorded, the text is only read upon
+ * text_save_commit_delta.
+ */
+static bool text_save_begin_delta(TextSave *ctx) {
+	Text *txt = ctx->txt;
+	struct stat meta = { 0 }, mapped = { 0 };
+	if (!txt->buf || txt->buf->type != MMAP_ORIG || txt->fd == -1)
+		return false;
+	if (fstat(txt->fd, &mapped) == -1)
+		return false;
+	if ((ctx->fd = open(ctx->filename, O_WRONLY)) == -1)
+		goto err;
+	if (fstat(ctx->fd, &meta) == -1)
+		goto err;
+	if (meta.st_dev != mapped.st_dev || meta.st_ino != mapped.st_ino)
+		goto err;
+	ctx->size = meta.st_size;
+	text_save_delta_range(txt, ctx->size, &ctx->delta, &ctx->end);
+	if (2 * (text_range_size(&ctx->delta) + ctx->end - ctx->delta.start) > ctx->size)
+		goto err;
+	ctx->type = TEXT_SAVE_DELTA;
+	return true;
+err:
+	if (ctx->fd != -1)
+		close(ctx->fd);
+	ctx->fd = -1;
+	return false;
+}
+
+/* Fall back to rewriting the whole file, the ranges recorded so far are written now */
+static bool text_save_delta_demote(TextSave *ctx) {
+	size_t pos = ctx->pos;
+	close(ctx->fd);
+	ctx->fd = -1;
+	ctx->type = TEXT_SAVE_UNKNOWN;
+	errno = 0;
+	if (!text_save_begin_atomic(ctx) && (errno == ENOSPC || !text_save_begin_inplace(ctx)))
+		return false;
+	ctx->pos = 0;
+	Filerange range = { .start = 0, .end = pos };
+	ssize_t written = text_save_write_range(ctx, &range);
+	return written != -1 && (size_t)written == pos;
+}
+
+/* Replace the mmap-ed pages covering the file range [start, end) by private
+ * copies, such that the pieces referring to them are unaffected when the
+ * range is overwritten. */
+static bool text_save_detach(Text *txt, size_t start, size_t end) {
+	size_t page = sysconf(_SC_PAGESIZE), size = buffer_mapped(txt);
+	start -= start % page;
+	end = MIN(end + (page - end % page) % page, size);
+	if (start >= end)
+		return true;
+	char tmpname[32] = "/tmp/vis-XXXXXX";
+	mode_t mask = umask(S_IXUSR | S_IRWXG | S_IRWXO);
+	int fd = mkstemp(tmpname);
+	umask(mask);
+	if (fd == -1)
+		return false;
+	bool ret = unlink(tmpname) == 0 && buffer_map_range(txt, start, end) &&
+	           history_write(fd, txt->buf->data + start, end - start, 0);
+	for (Buffer *buf = txt->buffers; ret && buf; buf = buf->next) {
+		size_t from = MAX(start, buf->offset), to = MIN(end, buf->offset + buf->size);
+		if (buf->type != MMAP_ORIG || from >= to)
+			continue;
+		buf->detached = true;
+		void *data = mmap(buf->data + (from - buf->offset), to - from, PROT_READ,
+		                  MAP_SHARED|MAP_FIXED, fd, from - start);
+		ret = (data != MAP_FAILED);
+	}
+	close(fd);
+	return ret;
+}
+
+/* Before a delta save overwrites the file range [start, end) its content
+ * is stored in a journal next to the file:
+ *
+ *   "vis-save" | inode | old size | new size | start | length | content | "vis-save"
+ *
+ * Together with the journal the file is then detached from the mmap-ed
+ * pages. Nothing has been written to the file itself yet.
+ */
+static bool text_save_delta_prepare(TextSave *ctx) {
+	Text *txt = ctx->txt;
+	struct stat meta = { 0 };
+	if (fstat(ctx->fd, &meta) == -1 || (size_t)meta.st_size != ctx->size)
+		return false;
+	size_t start = ctx->delta.start, end = ctx->end, len = end - start;
+	if (ctx->delta.start == ctx->delta.end && len == 0 && txt->size == ctx->size)
+		return true;
+	if (!(ctx->journal = hidden_path(ctx->filename, "save")))
+		return false;
+	int fd = open(ctx->journal, O_CREAT|O_WRONLY|O_TRUNC, S_IRUSR|S_IWUSR);
+	if (fd == -1)
+		goto err;
+	uint64_t header[] = { 0, meta.st_ino, ctx->size, txt->size, start, len };
+	memcpy(header, JOURNAL_MAGIC, sizeof header[0]);
+	char *buf = malloc(MIN(len, BUFFER_SIZE) + 1);
+	bool ret = buf && history_write(fd, header, sizeof header, 0);
+	for (size_t off = 0, rem; ret && off < len; off += rem) {
+		rem = MIN(len - off, BUFFER_SIZE);
+		ret = history_read(txt->fd, buf, rem, start + off) &&
+		      history_write(fd, buf, rem, JOURNAL_HEADER + off);
+	}
+	free(buf);
+	ret = ret && history_write(fd, JOURNAL_MAGIC, sizeof header[0], JOURNAL_HEADER + len);
+	ret = ret && fsync(fd) == 0;
+	if (close(fd) == -1 || !ret || !sync_dir(ctx->filename))
+		goto err;
+	if (!file_changed_add(txt, start, end) || !text_save_detach(txt, start, end))
+		goto err;
+	return true;
+err:
+	unlink(ctx->journal);
+	free(ctx->journal);
+	ctx->journal = NULL;
+	return false;
+}
+
+/* Roll back a delta save of `filename' which was interrupted before its
+ * journal was removed. An incomplete journal means the file was not yet
+ * touched. The journal is kept if the file can not be restored. */
+static void text_save_recover(const char *filename) {
+	char *journal = hidden_path(filename, "save");
+	int jfd = journal ? open(journal, O_RDONLY) : -1;
+	if (jfd == -1) {
+		free(journal);
+		return;
+	}
+	uint64_t header[6];
+	char magic[sizeof header[0]], *buf = NULL;
+	struct stat meta;
+	bool complete = history_read(jfd, header, sizeof header, 0) &&
+	                memcmp(header, JOURNAL_MAGIC, sizeof magic) == 0 &&
+	                header[5] <= SIZE_MAX - JOURNAL_HEADER &&
+	                history_read(jfd, magic, sizeof magic, JOURNAL_HEADER + header[5]) &&
+	                memcmp(magic, JOURNAL_MAGIC, sizeof magic) == 0;
+	/* a journal of a file which was since removed or replaced is stale */
+	bool done = !complete;
+	int fd = complete ? open(filename, O_WRONLY) : -1;
+	if (fd == -1 && complete) {
+		done = (errno == ENOENT);
+	} else if (fd != -1 && fstat(fd, &meta) == 0) {
+		/* the file is only ever extended up to its new size before being truncated */
+		uint64_t size = meta.st_size;
+		bool saving = size == header[2] || size == header[3] || (header[2] < size && size < header[3]);
+		done = (uint64_t)meta.st_ino != header[1] || !saving;
+		size_t start = header[4], len = header[5];
+		if (!done && (buf = malloc(MIN(len, BUFFER_SIZE) + 1))) {
+			done = true;
+			for (size_t off = 0, rem; done && off < len; off += rem) {
+				rem = MIN(len - off, BUFFER_SIZE);
+				done = history_read(jfd, buf, rem, JOURNAL_HEADER + off) &&
+				       history_write(fd, buf, rem, start + off);
+			}
+			done = done && ftruncate(fd, header[2]) == 0 && fsync(fd) == 0;
+		}
+	}
+	free(buf);
+	if (fd != -1)
+		close(fd);
+	close(jfd);
+	if (done && unlink(journal) == 0)
+		sync_dir(filename);
+	free(journal);
+}
+
+static bool text_save_commit_delta(TextSave *ctx) {
+	Text *txt = ctx->txt;
+	Filerange *range = &ctx->delta;
+	size_t rem = text_range_size(range), off = range->start;
+	for (Iterator it = text_iterator_get(txt, off);
+	     rem > 0 && text_iterator_valid(&it);
+	     text_iterator_next(&it)) {
+		size_t len = MIN((size_t)(it.end - it.text), rem);
+		if (!history_write(ctx->fd, it.text, len, off))
+			goto err;
+		txt->save_written += len;
+		off += len;
+		rem -= len;
+	}
+	if (rem > 0)
+		goto err;
+	if (txt->size != ctx->size && ftruncate(ctx->fd, txt->size) == -1)
+		goto err;
+	if (fsync(ctx->fd) == -1)
+		goto err;
+	struct stat meta = { 0 };
+	if (fstat(ctx->fd, &meta) == -1)
+		goto err;
+	bool close_failed = (close(ctx->fd) == -1);
+	ctx->fd = -1;
+	if (close_failed)
+		goto err;
+	if (ctx->journal && unlink(ctx->journal) == -1)
+		goto err;
+	if (ctx->journal && !sync_dir(ctx->filename))
+		return false;
+	txt->info = meta;
+	return true;
+err:
+	if (ctx->fd != -1)
+		close(ctx->fd);
+	ctx->fd = -1;
+	if (ctx->journal)
+		text_save_recover(ctx->filename);
+	return false;
+}
+
+void text_save_delta(Text *txt, bool enable) {
+	txt->save_delta = enable;
+}
+
 TextSave *text_save_begin(Text *txt, const char *filename) {
 	if (!filename)
 		return NULL;
+	history_restore(txt);
+	buffer_load(txt, txt->load_size);
+	txt->save_copied = txt->save_written = 0;
 	TextSave *ctx = calloc(1, sizeof *ctx);
 	if (!ctx)
 		return NULL;
@@ -1007,6 +3633,10 @@ TextSave *text_save_begin(Text *txt, const char *filename) {
 	ctx->fd = -1;
 	if (!(ctx->filename = strdup(filename)))
 		goto err;
+	if (txt->history_persist && !(ctx->history = hidden_path(filename, "undo")))
+		goto err;
+	if (txt->save_delta && text_save_begin_delta(ctx))
+		return ctx;
 	errno = 0;
 	if (text_save_begin_atomic(ctx))
 		return ctx;
@@ -1024,6 +3654,9 @@ bool text_save_commit(TextSave *ctx) {
 		return true;
 	bool ret;
 	Text *txt = ctx->txt;
+	if (ctx->type == TEXT_SAVE_DELTA && (ctx->pos != txt->size || !text_save_delta_prepare(ctx)) &&
+	    !text_save_delta_demote(ctx))
+		ctx->type = TEXT_SAVE_UNKNOWN;
 	switch (ctx->type) {
 	case TEXT_SAVE_ATOMIC:
 		ret = text_save_commit_atomic(ctx);
@@ -1031,6 +3664,9 @@ bool text_save_commit(TextSave *ctx) {
 	case TEXT_SAVE_INPLACE:
 		ret = text_save_commit_inplace(ctx);
 		break;
+	case TEXT_SAVE_DELTA:
+		ret = text_save_commit_delta(ctx);
+		break;
 	default:
 		ret = false;
 		break;
@@ -1039,6 +3675,14 @@ bool text_save_commit(TextSave *ctx) {
 	if (ret) {
 		txt->saved_action = txt->history;
 		text_snapshot(txt);
+		/* the history can only be related to the file if it holds the whole text */
+		if (ctx->history && ctx->pos == txt->size)
+			history_store(txt, ctx->history);
+		/* all journaled modifications are now part of the file */
+		char *swap = txt->swap.path && ctx->pos == txt->size ? hidden_path(ctx->filename, "swap") : NULL;
+		if (swap && strcmp(swap, txt->swap.path) == 0)
+			swap_discard(txt);
+		free(swap);
 	}
 	text_save_cancel(ctx);
 	return ret;
@@ -1054,6 +3698,8 @@ void text_save_cancel(TextSave *ctx) {
 		unlink(ctx->tmpname);
 	free(ctx->tmpname);
 	free(ctx->filename);
+	free(ctx->history);
+	free(ctx->journal);
 	free(ctx);
 	errno = saved_errno;
 }
@@ -1069,6 +3715,7 @@ bool text_save(Text *txt, const char *filename) {
  */
 bool text_save_range(Text *txt, Filerange *range, const char *filename) {
 	if (!filename) {
+		history_restore(txt);
 		txt->saved_action = txt->history;
 		text_snapshot(txt);
 		return true;
@@ -1076,16 +3723,77 @@ bool text_save_range(Text *txt, Filerange *range, const char *filename) {
 	TextSave *ctx = text_save_begin(txt, filename);
 	if (!ctx)
 		return false;
-	ssize_t written = text_write_range(txt, range, ctx->fd);
+	ssize_t written = text_save_write_range(ctx, range);
 	if (written == -1 || (size_t)written != text_range_size(range)) {
 		text_save_cancel(ctx);
 		return false;
 	}
-	return text_save_commit(ctx);
+	return text_save_commit(ctx);
+}
+
+/* Copy data of a piece referring to the mmap-ed file by sendfile(2), such
+ * that it does not pass through user space. Returns the number of bytes
+ * copied which is short if the kernel does not support it for the files. */
+static size_t text_save_copy(TextSave *ctx, const Piece *p, const char *data, size_t len) {
+	size_t rem = len;
+#ifdef __linux__
+	Text *txt = ctx->txt;
+	Buffer *buf = p->buf;
+	if (!buf || buf->type == ANON || txt->fd == -1)
+		return 0;
+	off_t off = buf->offset + (data - buf->data);
+	if (file_changed(txt, off, len))
+		return 0;
+	while (rem > 0) {
+		ssize_t copied = sendfile(ctx->fd, txt->fd, &off, rem);
+		if (copied == -1 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if (copied <= 0)
+			break;
+		rem -= copied;
+	}
+	txt->save_copied += len - rem;
+#endif
+	return len - rem;
 }
 
 ssize_t text_save_write_range(TextSave *ctx, Filerange *range) {
-	return text_write_range(ctx->txt, range, ctx->fd);
+	Text *txt = ctx->txt;
+	size_t size = text_range_size(range), rem = size;
+	if (ctx->type == TEXT_SAVE_DELTA) {
+		if (range->start == ctx->pos) {
+			ctx->pos = range->end;
+			return size;
+		}
+		if (!text_save_delta_demote(ctx)) {
+			ctx->pos = EPOS;
+			return -1;
+		}
+	}
+	for (Iterator it = text_iterator_get(txt, range->start);
+	     rem > 0 && text_iterator_valid(&it);
+	     text_iterator_next(&it)) {
+		size_t prem = it.end - it.text;
+		if (prem > rem)
+			prem = rem;
+		size_t copied = text_save_copy(ctx, it.piece, it.text, prem);
+		rem -= copied;
+		prem -= copied;
+		ssize_t written = write_all(ctx->fd, it.text + copied, prem);
+		if (written == -1) {
+			ctx->pos = EPOS;
+			return -1;
+		}
+		txt->save_written += written;
+		rem -= written;
+		if ((size_t)written != prem)
+			break;
+	}
+	if (range->start != ctx->pos || rem > 0)
+		ctx->pos = EPOS;
+	else
+		ctx->pos = range->end;
+	return size - rem;
 }
 
 ssize_t text_write(Text *txt, int fd) {
@@ -1112,16 +3820,39 @@ ssize_t text_write_range(Text *txt, Filerange *range, int fd) {
 }
 
 /* load the given file as starting point for further editing operations.
- * to start with an empty document, pass NULL as filename. */
-Text *text_load(const char *filename) {
+ * to start with an empty document, pass NULL as filename. In asynchronous
+ * mode small files are read, the windows of large ones mapped and all new
+ * lines indexed by text_load_poll */
+static Text *text_load_file(const char *filename, bool async) {
+	lines_kernel_setup();
 	Text *txt = calloc(1, sizeof(Text));
 	if (!txt)
 		return NULL;
 	int fd = -1;
-	piece_init(&txt->begin, NULL, &txt->end, NULL, 0);
-	piece_init(&txt->end, &txt->begin, NULL, NULL, 0);
+	txt->fd = -1;
+	piece_init(&txt->begin, NULL, &txt->end, NULL, NULL, 0);
+	piece_init(&txt->end, &txt->begin, NULL, NULL, NULL, 0);
+	pool_init(&txt->pieces, sizeof(Piece));
+	pool_init(&txt->refs, sizeof(PieceRef));
+	pool_init(&txt->changes, sizeof(Change));
+	pool_init(&txt->actions, sizeof(Action));
+	txt->seed = 2463534242;
+	txt->swap.fd = -1;
+	txt->swap.open = EPOS;
+	array_init_sized(&txt->swap.refs, sizeof(SwapRef));
+	array_init_sized(&txt->relocations, sizeof(Relocation));
+	array_init_sized(&txt->changed, sizeof(Filerange));
+	array_init(&txt->timeline);
+	array_init_sized(&txt->changelist.pos, sizeof(size_t));
+	txt->changelist.seq = EPOS;
+	array_init_sized(&txt->diff.hunks, sizeof(DiffHunk));
+	array_init_sized(&txt->diff.journal, sizeof(DiffTouch));
+	txt->diff.cur = EPOS;
+	txt->diff_from = EPOS;
 	lineno_cache_invalidate(&txt->lines);
+	text_changed(txt);
 	if (filename) {
+		text_save_recover(filename);
 		if ((fd = open(filename, O_RDONLY)) == -1)
 			goto out;
 		if (fstat(fd, &txt->info) == -1)
@@ -1132,19 +3863,40 @@ Text *text_load(const char *filename) {
 		}
 		// XXX: use lseek(fd, 0, SEEK_END); instead?
 		size_t size = txt->info.st_size;
-		if (size < BUFFER_MMAP_SIZE)
+		if (size < BUFFER_MMAP_SIZE && async) {
+			if ((txt->buf = buffer_alloc(txt, size))) {
+				txt->load = txt->buf;
+				txt->load_size = size;
+				txt->fd = fd;
+				fd = -1;
+			}
+		} else if (size < BUFFER_MMAP_SIZE) {
 			txt->buf = buffer_read(txt, size, fd);
-		else
-			txt->buf = buffer_mmap(txt, size, fd, 0);
+			size = txt->buf ? txt->buf->len : 0;
+		} else if ((txt->buf = buffer_mmap(txt, size, fd))) {
+			txt->fd = fd;
+			fd = -1;
+		}
 		if (!txt->buf)
 			goto out;
-		Piece *p = piece_alloc(txt);
-		if (!p)
-			goto out;
-		piece_init(&txt->begin, NULL, p, NULL, 0);
-		piece_init(p, &txt->begin, &txt->end, txt->buf->data, txt->buf->len);
-		piece_init(&txt->end, p, NULL, NULL, 0);
-		txt->size = txt->buf->len;
+		Piece *prev = &txt->begin;
+		Buffer *buf = txt->buf;
+		for (size_t off = 0; off < size; off += PIECE_LOAD_SIZE) {
+			Piece *p = piece_alloc(txt);
+			if (!p)
+				goto out;
+			if (off >= buf->offset + buf->len)
+				buf = buffer_window(txt, off);
+			size_t len = MIN(size - off, PIECE_LOAD_SIZE);
+			piece_init(p, prev, &txt->end, buf, txt->buf->data + off, len);
+			prev->next = p;
+			txt->end.prev = p;
+			piece_index(txt, prev, p);
+			prev = p;
+		}
+		txt->size = size;
+		txt->loading = async;
+		buffer_load(txt, 0);
 	}
 	/* write an empty action */
 	change_alloc(txt, EPOS);
@@ -1161,6 +3913,120 @@ out:
 	return NULL;
 }
 
+Text *text_load(const char *filename) {
+	return text_load_file(filename, false);
+}
+
+Text *text_load_async(const char *filename, void (*done)(Text*, void *data), void *data) {
+	Text *txt = text_load_file(filename, true);
+	if (txt) {
+		txt->load_done = done;
+		txt->load_data = data;
+	}
+	return txt;
+}
+
+/* Read the next junk of the file and count the new lines of the following
+ * pieces whose data is available. Edits shift the indexed position, pieces
+ * skipped or visited twice as a result are harmless since their new lines
+ * are otherwise counted on demand. */
+bool text_load_poll(Text *txt) {
+	if (!txt->loading)
+		return false;
+	if (txt->load)
+		buffer_load(txt, txt->load->len + LOAD_STEP_SIZE);
+	size_t budget = LOAD_STEP_SIZE;
+	Location loc = piece_get_intern(txt, MIN(txt->load_pos, txt->size));
+	size_t pos = MIN(txt->load_pos, txt->size) - loc.off;
+	Piece *p = loc.piece;
+	for (; p && p != &txt->end && budget > 0; p = p->next) {
+		if (p->text && p->lines == EPOS) {
+			Buffer *buf = txt->load;
+			if (buf && p->buf == buf && p->data + p->len > buf->data + buf->len)
+				break;
+			piece_lines(p);
+			tree_update_path(p);
+			budget -= MIN(budget, p->len);
+		}
+		pos += p->len;
+	}
+	txt->load_pos = MAX(txt->load_pos, pos);
+	if (txt->load || p != &txt->end)
+		return true;
+	txt->loading = false;
+	if (txt->load_done)
+		txt->load_done(txt, txt->load_data);
+	return false;
+}
+
+bool text_loading(Text *txt) {
+	return txt->loading;
+}
+
+int text_load_progress(Text *txt) {
+	if (!txt->loading || !txt->size)
+		return 100;
+	return MIN(txt->load_pos, txt->size) * 100 / txt->size;
+}
+
+/* The file grew since it was loaded or saved: if it is still the same one,
+ * insert the new data at the end as a separate state. As long as the text
+ * was unmodified the trailing bytes are compared to catch files which were
+ * rewritten rather than appended to. The journal does not record the data,
+ * it is already on disk. */
+size_t text_load_append(Text *txt, const char *filename) {
+	struct stat meta;
+	struct stat *info = &txt->info;
+	size_t len = 0, size = info->st_size;
+	char *buf = NULL;
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		return EPOS;
+	if (txt->loading || fstat(fd, &meta) == -1 || !S_ISREG(meta.st_mode) ||
+	    meta.st_dev != info->st_dev || meta.st_ino != info->st_ino ||
+	    (size_t)meta.st_size < size)
+		goto err;
+	if ((size_t)meta.st_size == size) {
+		close(fd);
+		return meta.st_mtime == info->st_mtime ? 0 : EPOS;
+	}
+	bool modified = text_modified(txt);
+	if (!(buf = malloc(MIN((size_t)meta.st_size - size, BUFFER_SIZE))))
+		goto err;
+	if (!modified && size > 0) {
+		char disk[256], tail[sizeof disk];
+		size_t n = MIN(size, sizeof tail);
+		if (txt->size != size || pread(fd, disk, n, size - n) != (ssize_t)n ||
+		    text_bytes_get(txt, size - n, n, tail) != n || memcmp(disk, tail, n) != 0)
+			goto err;
+	}
+	text_snapshot(txt);
+	/* for a modified text the appended data is journaled like any insertion */
+	txt->swap.replay = !modified;
+	for (ssize_t r; (r = pread(fd, buf, MIN((size_t)meta.st_size - size - len, BUFFER_SIZE), size + len)) > 0; len += r) {
+		if (!text_insert(txt, txt->size, buf, r))
+			break;
+	}
+	txt->swap.replay = false;
+	text_snapshot(txt);
+	if (len == 0)
+		goto err;
+	if (fstat(fd, &meta) == 0)
+		meta.st_size = size + len;
+	*info = meta;
+	if (!modified) {
+		txt->saved_action = txt->history;
+		swap_discard(txt);
+	}
+	free(buf);
+	close(fd);
+	return len;
+err:
+	free(buf);
+	close(fd);
+	return EPOS;
+}
+
 struct stat text_stat(Text *txt) {
 	return txt->info;
 }
@@ -1182,6 +4048,7 @@ struct stat text_stat(Text *txt) {
 bool text_delete(Text *txt, size_t pos, size_t len) {
 	if (len == 0)
 		return true;
+	history_restore(txt);
 	if (pos + len > txt->size)
 		return false;
 	if (pos < txt->lines.pos)
@@ -1192,8 +4059,10 @@ bool text_delete(Text *txt, size_t pos, size_t len) {
 	if (!p)
 		return false;
 	size_t off = loc.off;
-	if (cache_delete(txt, p, off, len))
+	if (cache_delete(txt, p, off, len)) {
+		swap_record(txt, pos, len, 0);
 		return true;
+	}
 	Change *c = change_alloc(txt, pos);
 	if (!c)
 		return false;
@@ -1235,12 +4104,14 @@ bool text_delete(Text *txt, size_t pos, size_t len) {
 		after = piece_alloc(txt);
 		if (!after)
 			return false;
-		piece_init(after, before, p->next, p->data + p->len - (cur - len), cur - len);
+		piece_init(after, before, p->next, p->buf, p->data + p->len - (cur - len), cur - len);
+		after->lines = piece_lines_split(p, p->len - (cur - len), cur - len);
 	}
 
 	if (midway_start) {
 		/* we finally know which piece follows our newly allocated before piece */
-		piece_init(before, start->prev, after, start->data, off);
+		piece_init(before, start->prev, after, start->buf, start->data, off);
+		before->lines = piece_lines_split(start, 0, off);
 	}
 
 	Piece *new_start = NULL, *new_end = NULL;
@@ -1255,9 +4126,12 @@ bool text_delete(Text *txt, size_t pos, size_t len) {
 		new_end = after;
 	}
 
+	if (!change_ref(txt, c, new_start, new_end) || !change_ref(txt, c, start, end))
+		return false;
 	span_init(&c->new, new_start, new_end);
 	span_init(&c->old, start, end);
 	span_swap(txt, &c->old, &c->new);
+	swap_record(txt, pos, len, 0);
 	return true;
 }
 
@@ -1267,6 +4141,138 @@ bool text_delete_range(Text *txt, Filerange *r) {
 	return text_delete(txt, r->start, text_range_size(r));
 }
 
+/* replace `del' bytes at `pos' by `ins' bytes of `data' using a single change.
+ * the pieces covering the affected range are swapped out for at most three
+ * new ones: the unmodified content before it, the inserted text and the
+ * unmodified content after it. */
+static bool edit_apply(Text *txt, size_t pos, size_t del, const char *data, size_t ins) {
+	Location loc = piece_get_intern(txt, pos);
+	Piece *p = loc.piece;
+	if (!p)
+		return false;
+	size_t off = loc.off;
+	Change *c = change_alloc(txt, pos);
+	if (!c)
+		return false;
+	if (ins > 0 && !(data = buffer_store(txt, data, ins)))
+		return false;
+
+	bool midway = off < p->len;        /* whether the first piece is split */
+	Piece *start = NULL, *end = NULL;  /* span which is removed */
+	Piece *prev = p, *next = p->next;  /* unmodified neighbours of the new span */
+	size_t cur = 0;                    /* how much of the removed span precedes pos + del */
+
+	if (midway) {
+		start = p;
+		prev = p->prev;
+		cur = p->len - off;
+	} else if (del > 0) {
+		start = p = p->next;
+		cur = p->len;
+	}
+	while (cur < del) {
+		p = p->next;
+		cur += p->len;
+	}
+	if (start) {
+		end = p;
+		next = p->next;
+	}
+
+	Piece *pieces[3], *new = NULL;
+	size_t count = 0;
+	if (midway) {
+		Piece *before = pieces[count++] = piece_alloc(txt);
+		if (!before)
+			return false;
+		piece_init(before, NULL, NULL, start->buf, start->data, off);
+		before->lines = piece_lines_split(start, 0, off);
+	}
+	if (ins > 0) {
+		new = pieces[count++] = piece_alloc(txt);
+		if (!new)
+			return false;
+		piece_init(new, NULL, NULL, txt->buffers, data, ins);
+		new->lines = lines_count(data, ins);
+	}
+	if (cur > del) {
+		size_t len = cur - del;
+		Piece *after = pieces[count++] = piece_alloc(txt);
+		if (!after)
+			return false;
+		piece_init(after, NULL, NULL, end->buf, end->data + end->len - len, len);
+		after->lines = piece_lines_split(end, end->len - len, len);
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		pieces[i]->prev = i > 0 ? pieces[i-1] : prev;
+		pieces[i]->next = i+1 < count ? pieces[i+1] : next;
+	}
+
+	Piece *new_start = count ? pieces[0] : NULL;
+	Piece *new_end = count ? pieces[count-1] : NULL;
+	if (!change_ref(txt, c, new_start, new_end) || !change_ref(txt, c, start, end))
+		return false;
+	span_init(&c->new, new_start, new_end);
+	span_init(&c->old, start, end);
+	if (new)
+		cache_piece(txt, new);
+	span_swap(txt, &c->old, &c->new);
+	return true;
+}
+
+/* undo and drop the action being recorded as if it was never started,
+ * `redo' is the child of its parent which was the most recent one before */
+static void action_discard(Text *txt, Action *redo) {
+	Action *a = txt->current_action;
+	if (!a)
+		return;
+	action_undo(txt, a);
+	txt->current_action = NULL;
+	txt->cache = NULL;
+	txt->history = a->prev;
+	if (a->prev)
+		a->prev->next = redo;
+	if (a->earlier)
+		a->earlier->later = NULL;
+	action_free(txt, a);
+	history_index(txt);
+	lineno_cache_invalidate(&txt->lines);
+}
+
+bool text_edits(Text *txt, const TextEdit *edits, size_t count) {
+	history_restore(txt);
+	size_t size = txt->size;
+	for (size_t i = 0; i < count; i++) {
+		const Filerange *r = &edits[i].range;
+		if (!text_range_valid(r) || r->end > size || (edits[i].len && !edits[i].data))
+			return false;
+		if (i > 0 && r->start < edits[i-1].range.end)
+			return false;
+	}
+	if (count > 0 && edits[0].range.start < txt->lines.pos)
+		lineno_cache_invalidate(&txt->lines);
+
+	/* the edits form an action of their own, which is undone and dropped
+	 * again if one of them can not be applied */
+	text_snapshot(txt);
+	Action *redo = txt->history ? txt->history->next : NULL;
+	for (size_t i = 0; i < count; i++) {
+		const TextEdit *e = &edits[i];
+		size_t del = text_range_size(&e->range);
+		if (del == 0 && e->len == 0)
+			continue;
+		/* shift by the size difference introduced by the preceding edits */
+		size_t pos = e->range.start + txt->size - size;
+		if (!edit_apply(txt, pos, del, e->data, e->len)) {
+			action_discard(txt, redo);
+			return false;
+		}
+		swap_record(txt, pos, del, e->len);
+	}
+	return true;
+}
+
 /* preserve the current text content such that it can be restored by
  * means of undo/redo operations */
 void text_snapshot(Text *txt) {
@@ -1281,29 +4287,53 @@ void text_free(Text *txt) {
 	if (!txt)
 		return;
 
-	// free history
-	Action *hist = txt->history;
-	while (hist && hist->prev)
-		hist = hist->prev;
-	while (hist) {
-		Action *later = hist->later;
-		action_free(hist);
-		hist = later;
-	}
-
-	for (Piece *next, *p = txt->pieces; p; p = next) {
-		next = p->global_next;
-		piece_free(p);
-	}
+	pool_release(&txt->actions);
+	pool_release(&txt->changes);
+	pool_release(&txt->refs);
+	pool_release(&txt->pieces);
 
 	for (Buffer *next, *buf = txt->buffers; buf; buf = next) {
 		next = buf->next;
 		buffer_free(buf);
 	}
+	for (Buffer *next, *buf = txt->retired; buf; buf = next) {
+		next = buf->next;
+		buffer_free(buf);
+	}
 
+	if (txt->fd != -1)
+		close(txt->fd);
+	free(txt->history_path);
+	array_release(&txt->changed);
+	swap_discard(txt);
+	free(txt->swap.path);
+	free(txt->swap.data);
+	array_release(&txt->swap.refs);
+	array_release(&txt->relocations);
+	array_release(&txt->timeline);
+	array_release(&txt->changelist.pos);
+	array_release(&txt->diff.hunks);
+	array_release(&txt->diff.journal);
 	free(txt);
 }
 
+TextStats text_stats(Text *txt) {
+	TextStats stats = {
+		.pieces = txt->pieces.objects,
+		.changes = txt->changes.objects,
+		.actions = txt->actions.objects,
+		.pool_blocks = txt->pieces.nblocks + txt->refs.nblocks + txt->changes.nblocks + txt->actions.nblocks,
+	};
+	stats.pool_size = stats.pool_blocks * POOL_BLOCK_SIZE;
+	stats.history_size = history_size(txt);
+	stats.save_copied = txt->save_copied;
+	stats.save_written = txt->save_written;
+	stats.bytes_copied = txt->bytes_copied;
+	stats.bytes_chunked = txt->bytes_chunked;
+	stats.active = txt->active;
+	return stats;
+}
+
 bool text_modified(Text *txt) {
 	return txt->saved_action != txt->history;
 }
@@ -1322,6 +4352,8 @@ enum TextNewLine text_newline_type(Text *txt){
 		txt->newlines = TEXT_NEWLINE_NL; /* default to UNIX style \n new lines */
 		const char *start = txt->buf ? txt->buf->data : NULL;
 		if (start) {
+			buffer_access(txt, txt->buf);
+			buffer_load(txt, PIECE_LOAD_SIZE);
 			const char *nl = memchr(start, '\n', txt->buf->len);
 			if (nl > start && nl[-1] == '\r')
 				txt->newlines = TEXT_NEWLINE_CRNL;
@@ -1345,6 +4377,8 @@ const char *text_newline_char(Text *txt) {
 }
 
 static bool text_iterator_init(Iterator *it, size_t pos, Piece *p, size_t off) {
+	if (p)
+		piece_access(p);
 	*it = (Iterator){
 		.pos = pos,
 		.piece = p,
@@ -1518,9 +4552,128 @@ size_t text_bytes_get(Text *txt, size_t pos, size_t len, char *buf) {
 		cur += piece_len;
 		rem -= piece_len;
 	}
+	txt->bytes_copied += len - rem;
+	return len - rem;
+}
+
+bool text_chunks(Text *txt, const Filerange *r, bool (*chunk)(const char *data, size_t len, void *arg), void *arg) {
+	size_t rem = text_range_size(r);
+	text_iterate(txt, it, r->start) {
+		if (rem == 0)
+			break;
+		size_t len = it.end - it.text;
+		if (len > rem)
+			len = rem;
+		if (len == 0)
+			continue;
+		txt->bytes_chunked += len;
+		if (!chunk(it.text, len, arg))
+			return false;
+		rem -= len;
+	}
+	return true;
+}
+
+/* Versions only reference the data of the active pieces, whose windows are
+ * mapped beforehand as readers can not do so themselves. Buffers never
+ * move existing data except for the in place modifications of the cache
+ * layer, which is therefore disabled for the pieces captured. Only newly
+ * created pieces are cached afterwards, their data is appended past the
+ * one referenced here. Buffers are not freed while versions are alive.
+ * Until the text is modified further versions share the captured chunks
+ * by reference count. */
+TextVersion *text_version_get(Text *txt) {
+	TextVersion *v = txt->version;
+	if (v && v->revision == txt->revision) {
+		v->refs++;
+		txt->versions++;
+		return v;
+	}
+	buffer_load(txt, txt->load_size);
+	if (!(v = malloc(sizeof *v + txt->active * sizeof v->chunks[0])))
+		return NULL;
+	v->txt = txt;
+	v->revision = txt->revision;
+	v->refs = 1;
+	v->size = 0;
+	v->count = 0;
+	for (Piece *p = txt->begin.next; p && p != &txt->end; p = p->next) {
+		if (p->len == 0)
+			continue;
+		if (p->buf)
+			buffer_access(txt, p->buf);
+		v->chunks[v->count++] = (VersionChunk){ .pos = v->size, .len = p->len, .data = p->data };
+		v->size += p->len;
+	}
+	txt->cache = NULL;
+	txt->versions++;
+	txt->version = v;
+	return v;
+}
+
+void text_version_release(TextVersion *v) {
+	if (!v)
+		return;
+	Text *txt = v->txt;
+	txt->versions--;
+	if (--v->refs)
+		return;
+	if (txt->version == v)
+		txt->version = NULL;
+	free(v);
+}
+
+size_t text_version_size(const TextVersion *v) {
+	return v->size;
+}
+
+/* index of the chunk containing pos, v->count if there is none */
+static size_t version_chunk(const TextVersion *v, size_t pos) {
+	if (pos >= v->size)
+		return v->count;
+	size_t lo = 0, hi = v->count - 1;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo + 1) / 2;
+		if (v->chunks[mid].pos <= pos)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+size_t text_version_bytes_get(const TextVersion *v, size_t pos, size_t len, char *buf) {
+	if (!buf)
+		return 0;
+	size_t rem = len;
+	for (size_t i = version_chunk(v, pos); i < v->count && rem > 0; i++) {
+		const VersionChunk *c = &v->chunks[i];
+		size_t off = pos - c->pos, n = c->len - off;
+		if (n > rem)
+			n = rem;
+		memcpy(buf, c->data + off, n);
+		buf += n;
+		pos += n;
+		rem -= n;
+	}
 	return len - rem;
 }
 
+bool text_version_chunks(const TextVersion *v, const Filerange *r, bool (*chunk)(const char *data, size_t len, void *arg), void *arg) {
+	size_t pos = r->start, rem = text_range_size(r);
+	for (size_t i = version_chunk(v, pos); i < v->count && rem > 0; i++) {
+		const VersionChunk *c = &v->chunks[i];
+		size_t off = pos - c->pos, n = c->len - off;
+		if (n > rem)
+			n = rem;
+		if (!chunk(c->data + off, n, arg))
+			return false;
+		pos += n;
+		rem -= n;
+	}
+	return true;
+}
+
 char *text_bytes_alloc0(Text *txt, size_t pos, size_t len) {
 	if (len == SIZE_MAX)
 		return NULL;
@@ -1536,48 +4689,205 @@ size_t text_size(Text *txt) {
 	return txt->size;
 }
 
-/* count the number of new lines '\n' in range [pos, pos+len) */
-static size_t lines_count(Text *txt, size_t pos, size_t len) {
+static void text_changed(Text *txt) {
+	static size_t revisions;
+	txt->revision = ++revisions;
+}
+
+size_t text_revision(Text *txt) {
+	return txt->revision;
+}
+
+/* New line scanning kernels. The scalar ones process a machine word at a
+ * time, on x86 SSE2 and AVX2 variants are selected at runtime. */
+#define LINES_ONES ((uint64_t)-1 / 0xff)
+/* lines_find skips blocks of this size based on their new line count */
+#define LINES_BLOCK 1024
+
+/* set the most significant bit of every byte of w which is a new line */
+static uint64_t lines_mask(uint64_t w) {
+	uint64_t x = w ^ (LINES_ONES * '\n');
+	return ~(((x & LINES_ONES * 0x7f) + LINES_ONES * 0x7f) | x | LINES_ONES * 0x7f);
+}
+
+static size_t lines_count_scalar(const char *data, size_t len) {
 	size_t lines = 0;
-	text_iterate(txt, it, pos) {
-		const char *start = it.text;
-		while (len > 0 && start < it.end) {
-			size_t n = MIN(len, (size_t)(it.end - start));
-			const char *end = memchr(start, '\n', n);
-			if (!end) {
-				len -= n;
-				break;
-			}
-			lines++;
-			len -= end - start + 1;
-			start = end + 1;
+	const char *end = data + len;
+	while (end - data >= 8) {
+		/* per byte counters, summed up before they can overflow */
+		uint64_t acc = 0, w;
+		size_t words = MIN((size_t)(end - data) / 8, 255);
+		for (size_t i = 0; i < words; i++, data += 8) {
+			memcpy(&w, data, sizeof w);
+			acc += lines_mask(w) >> 7;
+		}
+		acc = (acc & UINT64_C(0x00ff00ff00ff00ff)) + ((acc >> 8) & UINT64_C(0x00ff00ff00ff00ff));
+		lines += (acc * UINT64_C(0x0001000100010001)) >> 48;
+	}
+	for (; data < end; data++)
+		lines += *data == '\n';
+	return lines;
+}
+
+static const char *lines_find_scalar(const char *data, size_t len, size_t *n) {
+	for (size_t count; len > LINES_BLOCK; data += LINES_BLOCK, len -= LINES_BLOCK) {
+		if ((count = lines_count_scalar(data, LINES_BLOCK)) >= *n)
+			break;
+		*n -= count;
+	}
+	const char *end = data + len;
+	for (uint64_t w; end - data >= 8; data += 8) {
+		memcpy(&w, data, sizeof w);
+		size_t count = ((lines_mask(w) >> 7) * LINES_ONES) >> 56;
+		if (count < *n)
+			*n -= count;
+		else
+			break;
+	}
+	for (; data < end; data++) {
+		if (*data == '\n' && --*n == 0)
+			return data;
+	}
+	return NULL;
+}
+
+#if LINES_SIMD
+__attribute__((target("sse2")))
+static size_t lines_count_sse2(const char *data, size_t len) {
+	const __m128i nl = _mm_set1_epi8('\n'), zero = _mm_setzero_si128();
+	size_t lines = 0;
+	const char *end = data + len;
+	while (end - data >= 16) {
+		/* per byte counters, summed up before they can overflow */
+		__m128i acc = zero;
+		size_t blocks = MIN((size_t)(end - data) / 16, 255);
+		for (size_t i = 0; i < blocks; i++, data += 16)
+			acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)data), nl));
+		__m128i sum = _mm_sad_epu8(acc, zero);
+		lines += _mm_cvtsi128_si32(sum) + _mm_extract_epi16(sum, 4);
+	}
+	return lines + lines_count_scalar(data, end - data);
+}
+
+__attribute__((target("sse2")))
+static const char *lines_find_sse2(const char *data, size_t len, size_t *n) {
+	for (size_t count; len > LINES_BLOCK; data += LINES_BLOCK, len -= LINES_BLOCK) {
+		if ((count = lines_count_sse2(data, LINES_BLOCK)) >= *n)
+			break;
+		*n -= count;
+	}
+	const __m128i nl = _mm_set1_epi8('\n');
+	const char *end = data + len;
+	for (; end - data >= 16; data += 16) {
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)data), nl));
+		size_t count = __builtin_popcount(mask);
+		if (count < *n) {
+			*n -= count;
+			continue;
 		}
+		while (--*n > 0)
+			mask &= mask - 1;
+		return data + __builtin_ctz(mask);
+	}
+	return lines_find_scalar(data, end - data, n);
+}
 
-		if (len == 0)
+__attribute__((target("avx2")))
+static size_t lines_count_avx2(const char *data, size_t len) {
+	const __m256i nl = _mm256_set1_epi8('\n'), zero = _mm256_setzero_si256();
+	size_t lines = 0;
+	const char *end = data + len;
+	while (end - data >= 32) {
+		__m256i acc = zero;
+		size_t blocks = MIN((size_t)(end - data) / 32, 255);
+		for (size_t i = 0; i < blocks; i++, data += 32)
+			acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)data), nl));
+		uint64_t sum[4];
+		_mm256_storeu_si256((__m256i*)sum, _mm256_sad_epu8(acc, zero));
+		lines += sum[0] + sum[1] + sum[2] + sum[3];
+	}
+	return lines + lines_count_scalar(data, end - data);
+}
+
+__attribute__((target("avx2")))
+static const char *lines_find_avx2(const char *data, size_t len, size_t *n) {
+	for (size_t count; len > LINES_BLOCK; data += LINES_BLOCK, len -= LINES_BLOCK) {
+		if ((count = lines_count_avx2(data, LINES_BLOCK)) >= *n)
 			break;
+		*n -= count;
 	}
-	return lines;
+	const __m256i nl = _mm256_set1_epi8('\n');
+	const char *end = data + len;
+	for (; end - data >= 32; data += 32) {
+		unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)data), nl));
+		size_t count = __builtin_popcount(mask);
+		if (count < *n) {
+			*n -= count;
+			continue;
+		}
+		while (--*n > 0)
+			mask &= mask - 1;
+		return data + __builtin_ctz(mask);
+	}
+	return lines_find_scalar(data, end - data, n);
+}
+#endif
+
+static size_t (*lines_count_kernel)(const char *data, size_t len);
+static const char *(*lines_find_kernel)(const char *data, size_t len, size_t *n);
+
+static void lines_kernel_init(void) {
+	lines_count_kernel = lines_count_scalar;
+	lines_find_kernel = lines_find_scalar;
+#if LINES_SIMD
+	if (__builtin_cpu_supports("avx2")) {
+		lines_count_kernel = lines_count_avx2;
+		lines_find_kernel = lines_find_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		lines_count_kernel = lines_count_sse2;
+		lines_find_kernel = lines_find_sse2;
+	}
+#endif
+}
+
+#if CONFIG_THREADS
+static pthread_once_t lines_kernel_once = PTHREAD_ONCE_INIT;
+#endif
+
+/* select the kernels upon loading a text, i.e. before any thread could
+ * read one and thus call them */
+static void lines_kernel_setup(void) {
+#if CONFIG_THREADS
+	pthread_once(&lines_kernel_once, lines_kernel_init);
+#else
+	if (!lines_count_kernel)
+		lines_kernel_init();
+#endif
+}
+
+/* count the number of new lines '\n' in data[0, len) */
+static size_t lines_count(const char *data, size_t len) {
+	return lines_count_kernel(data, len);
+}
+
+/* return a pointer to the n-th (starting from 1) new line in data[0, len) or
+ * NULL, in which case n is decremented by the number of new lines found */
+static const char *lines_find(const char *data, size_t len, size_t *n) {
+	return lines_find_kernel(data, len, n);
 }
 
 /* skip n lines forward and return position afterwards */
 static size_t lines_skip_forward(Text *txt, size_t pos, size_t lines, size_t *lines_skipped) {
 	size_t lines_old = lines;
 	text_iterate(txt, it, pos) {
-		const char *start = it.text;
-		while (lines > 0 && start < it.end) {
-			size_t n = it.end - start;
-			const char *end = memchr(start, '\n', n);
-			if (!end) {
-				pos += n;
-				break;
-			}
-			pos += end - start + 1;
-			start = end + 1;
-			lines--;
-		}
-
 		if (lines == 0)
 			break;
+		const char *end = lines_find(it.text, it.end - it.text, &lines);
+		if (end) {
+			pos += end - it.text + 1;
+			break;
+		}
+		pos += it.end - it.text;
 	}
 	if (lines_skipped)
 		*lines_skipped = lines_old - lines;
@@ -1589,41 +4899,58 @@ static void lineno_cache_invalidate(LineCache *cache) {
 	cache->lineno = 1;
 }
 
+/* The line cache remembers the result of the most recent query. The actual
+ * mapping between line numbers and positions is done by walking the piece
+ * tree, where each node knows the number of new lines in its subtree. */
 size_t text_pos_by_lineno(Text *txt, size_t lineno) {
-	size_t lines_skipped;
 	LineCache *cache = &txt->lines;
 	if (lineno <= 1)
 		return 0;
-	if (lineno > cache->lineno) {
-		cache->pos = lines_skip_forward(txt, cache->pos, lineno - cache->lineno, &lines_skipped);
-		cache->lineno += lines_skipped;
-	} else if (lineno < cache->lineno) {
-	#if 0
-		// TODO does it make sense to scan memory backwards here?
-		size_t diff = cache->lineno - lineno;
-		if (diff < lineno) {
-			lines_skip_backward(txt, cache->pos, diff);
-		} else
-	#endif
-		cache->pos = lines_skip_forward(txt, 0, lineno - 1, &lines_skipped);
-		cache->lineno = lines_skipped + 1;
-	}
-	return cache->lineno == lineno ? cache->pos : EPOS;
+	size_t pos = 0, lines = lineno - 1;
+	for (Piece *p = txt->root; p; ) {
+		size_t left = tree_lines(p->left);
+		if (lines <= left) {
+			p = p->left;
+			continue;
+		}
+		lines -= left;
+		pos += tree_len(p->left);
+		if (lines <= piece_lines(p)) {
+			pos += lines_find(p->data, p->len, &lines) - p->data + 1;
+			lines = 0;
+			break;
+		}
+		lines -= p->lines;
+		pos += p->len;
+		p = p->right;
+	}
+	cache->pos = pos;
+	cache->lineno = lineno - lines;
+	return lines == 0 ? pos : EPOS;
 }
 
 size_t text_lineno_by_pos(Text *txt, size_t pos) {
 	LineCache *cache = &txt->lines;
 	if (pos > txt->size)
 		pos = txt->size;
-	if (pos < cache->pos) {
-		size_t diff = cache->pos - pos;
-		if (diff < pos)
-			cache->lineno -= lines_count(txt, pos, diff);
-		else
-			cache->lineno = lines_count(txt, 0, pos) + 1;
-	} else if (pos > cache->pos) {
-		cache->lineno += lines_count(txt, cache->pos, pos - cache->pos);
+	size_t lines = 0, rem = pos;
+	for (Piece *p = txt->root; p; ) {
+		size_t left = tree_len(p->left);
+		if (rem < left) {
+			p = p->left;
+			continue;
+		}
+		lines += tree_lines(p->left);
+		rem -= left;
+		if (rem < p->len) {
+			lines += piece_lines_range(p, 0, rem);
+			break;
+		}
+		lines += piece_lines(p);
+		rem -= p->len;
+		p = p->right;
 	}
+	cache->lineno = lines + 1;
 	cache->pos = text_line_begin(txt, pos);
 	return cache->lineno;
 }
@@ -1640,8 +4967,6 @@ Mark text_mark_set(Text *txt, size_t pos) {
 }
 
 size_t text_mark_get(Text *txt, Mark mark) {
-	size_t cur = 0;
-
 	if (!mark)
 		return EPOS;
 	if (mark == (Mark)&txt->begin)
@@ -1649,23 +4974,41 @@ size_t text_mark_get(Text *txt, Mark mark) {
 	if (mark == (Mark)&txt->end)
 		return txt->size;
 
-	for (Piece *p = txt->begin.next; p->next; p = p->next) {
-		if (p->data <= mark && mark < p->data + p->len)
-			return cur + (mark - p->data);
-		cur += p->len;
+	Piece *p = data_tree_find(txt, mark);
+	/* the data might have been copied by text_defragment, possibly repeatedly */
+	for (size_t i = array_length(&txt->relocations); !p && i > 0; i--) {
+		Relocation *r = relocation_find(txt, mark);
+		if (!r)
+			return EPOS;
+		mark = r->to + (mark - r->from);
+		p = data_tree_find(txt, mark);
 	}
-
-	return EPOS;
+	if (!p)
+		return EPOS;
+	return tree_pos(p) + (mark - p->data);
 }
 
 size_t text_history_get(Text *txt, size_t index) {
-	for (Action *a = txt->current_action ? txt->current_action : txt->history; a; a = a->prev) {
-		if (index-- == 0) {
-			Change *c = a->change;
-			while (c && c->next)
-				c = c->next;
-			return c ? c->pos : EPOS;
-		}
+	history_restore(txt);
+	/* the list of the current state is extended as far as requested,
+	 * successive calls for increasing indices hence take constant time */
+	Action *start = txt->current_action ? txt->current_action : txt->history;
+	ChangeList *list = &txt->changelist;
+	if (list->seq != start->seq) {
+		array_clear(&list->pos);
+		list->seq = start->seq;
+		list->next = start;
 	}
-	return EPOS;
+	while (array_length(&list->pos) <= index && list->next) {
+		Action *a = list->next;
+		Change *c = a->change;
+		while (c && c->next)
+			c = c->next;
+		size_t pos = c ? c->pos : EPOS;
+		if (!array_add(&list->pos, &pos))
+			return EPOS;
+		list->next = a->prev;
+	}
+	size_t *pos = array_get(&list->pos, index);
+	return pos ? *pos : EPOS;
 }
@@ -19,6 +19,7 @@ typedef struct {
 typedef struct Text Text;
 typedef struct Piece Piece;
 typedef struct TextSave TextSave;
+typedef struct TextVersion TextVersion;
 
 typedef struct {
 	const char *start;  /* begin of piece's data */
@@ -28,6 +29,17 @@ typedef struct {
 	size_t pos;         /* global position in bytes from start of file */
 } Iterator;
 
+typedef struct {
+	Filerange range;    /* bytes to remove, relative to the text before any edit */
+	const char *data;   /* replacement to insert at range.start */
+	size_t len;         /* its length in bytes */
+} TextEdit;
+
+typedef struct {
+	Filerange from;     /* modified range of the first state */
+	Filerange to;       /* the one replacing it in the second state */
+} TextDiff;
+
 #define text_iterate(txt, it, pos) \
 	for (Iterator it = text_iterator_get((txt), (pos)); \
 	     text_iterator_valid(&it); \
@@ -36,6 +48,21 @@ typedef struct {
 /* create a text instance populated with the given file content, if `filename'
  * is NULL the text starts out empty */
 Text *text_load(const char *filename);
+/* like text_load but returns without reading the file or indexing its new
+ * lines, whatever its size. Data accessed in the meantime is read or mapped on
+ * demand, the rest of the work is performed in steps by text_load_poll, `done'
+ * is called once complete */
+Text *text_load_async(const char *filename, void (*done)(Text*, void *data), void *data);
+/* perform the next step of an asynchronous load, returns whether work remains */
+bool text_load_poll(Text*);
+/* whether an asynchronous load still has work left */
+bool text_loading(Text*);
+/* progress of an asynchronous load in percent, 100 once complete */
+int text_load_progress(Text*);
+/* insert the data appended to the file since it was loaded or saved at the
+ * end of the text. Returns the number of bytes added, EPOS if the file was
+ * replaced or otherwise modified and needs to be reloaded. */
+size_t text_load_append(Text*, const char *filename);
 /* file information at time of load or last save */
 struct stat text_stat(Text*);
 bool text_appendf(Text*, const char *format, ...);
@@ -49,6 +76,10 @@ bool text_insert(Text*, size_t pos, const char *data, size_t len);
 /* delete `len' bytes starting from `pos' */
 bool text_delete(Text*, size_t pos, size_t len);
 bool text_delete_range(Text*, Filerange*);
+/* apply `count' edits sorted by position, whose ranges must not overlap,
+ * as a new action. Positions refer to the text before any of them is
+ * applied. Nothing is modified if an edit is invalid or fails to apply. */
+bool text_edits(Text*, const TextEdit*, size_t count);
 /* mark the current text state, such that it can be {un,re}done */
 void text_snapshot(Text*);
 /* undo/redo to the last snapshotted state. returns the position where
@@ -62,6 +93,53 @@ size_t text_later(Text*, int count);
 size_t text_restore(Text*, time_t);
 /* get creation time of current state */
 time_t text_state(Text*);
+/* identifier of the current state, of the one at the time of the last save
+ * and of the one text_restore would pick for the given time. EPOS if there
+ * is none, identifiers become invalid once the state is discarded. */
+size_t text_state_id(Text*);
+size_t text_state_saved(Text*);
+size_t text_state_at(Text*, time_t);
+/* report the ranges which differ between the states `from' and `to' in
+ * document order. They are derived from the recorded changes without
+ * comparing any data, the cost is proportional to the modifications in
+ * between. Stops once `hunk' returns false, false if a state is unknown. */
+bool text_diff(Text*, size_t from, size_t to, bool (*hunk)(const TextDiff*, void *data), void *data);
+/* like the above but only report the ranges overlapping or touching `r' of
+ * the `to' state. The result is kept, repeated calls with the same `from'
+ * only pay for the modifications performed since the previous one. */
+bool text_diff_range(Text*, size_t from, size_t to, const Filerange *r, bool (*hunk)(const TextDiff*, void *data), void *data);
+/* limit the undo history to at most `actions' states and `size' bytes of
+ * bookkeeping memory, zero disables the corresponding limit. Once exceeded
+ * the oldest states are discarded upon the next snapshot. */
+void text_history_limit(Text*, size_t actions, size_t size);
+/* discard all but the `count' states preceding the current one (and all
+ * branches not leading to it), returns the number of bytes reclaimed. */
+size_t text_history_compact(Text*, size_t count);
+/* merge runs of short adjacent pieces which are not referenced by the undo
+ * history, copying at most about `max' bytes. Marks remain valid. Returns
+ * the number of bytes copied, text_stats reports the resulting piece count. */
+size_t text_defragment(Text*, size_t max);
+/* persist the undo history of the text loaded from `filename' in a hidden
+ * file `.filename.undo' next to it, NULL disables persistence. A history
+ * matching the file as loaded (according to its size, modification time
+ * and inode) is only read once needed, i.e. upon the first modification or
+ * history operation. Every successful save of the whole text updates it. */
+bool text_history_file(Text*, const char *filename);
+/* journal all modifications of the text in a hidden file `.filename.swap'
+ * next to `filename', NULL disables it. Records are kept in memory until
+ * text_swap_sync, the file is removed once the whole text is saved to
+ * `filename' or the text is freed. An existing swap file is replaced upon
+ * the first write. */
+bool text_swap_file(Text*, const char *filename);
+/* write all pending records to the swap file and flush it to disk, meant
+ * to be called once the user is idle */
+bool text_swap_sync(Text*);
+/* replay the modifications recorded in an existing swap file on top of the
+ * unmodified text, provided it was recorded for the file as loaded or one
+ * which was appended to since. The appended data is discarded, it is part
+ * of the journal as far as it was loaded. The modifications form a single
+ * new undo state, journaling continues in the same file. */
+bool text_swap_recover(Text*);
 
 size_t text_pos_by_lineno(Text*, size_t lineno);
 size_t text_lineno_by_pos(Text*, size_t pos);
@@ -76,6 +154,26 @@ size_t text_bytes_get(Text*, size_t pos, size_t len, char *buf);
 /* allocate a NUL terminated buffer and fill at most `len' bytes
  * starting at `pos'. Freeing is the caller's responsibility! */
 char *text_bytes_alloc0(Text*, size_t pos, size_t len);
+/* pass the content of the range as a sequence of contiguous read only
+ * chunks to `chunk', without copying it. The data is only valid until
+ * the text is modified. Returns false if `chunk' stopped the iteration
+ * by returning false. */
+bool text_chunks(Text*, const Filerange*, bool (*chunk)(const char *data, size_t len, void *arg), void *arg);
+
+/* capture the current content as an immutable version without copying it.
+ * Versions of unchanged content share their state, only the first one after
+ * a modification takes O(#pieces) time to capture. Later modifications, undo/redo, history pruning and
+ * saves do not affect it, they are free to proceed while other threads read
+ * the version concurrently without any locking. Getting and releasing
+ * versions is not thread safe, it has to happen on the thread owning the
+ * text, and all of them have to be released before text_free. */
+TextVersion *text_version_get(Text*);
+void text_version_release(TextVersion*);
+size_t text_version_size(const TextVersion*);
+/* like text_bytes_get and text_chunks but reading the captured content,
+ * the data passed to `chunk' remains valid until the version is released */
+size_t text_version_bytes_get(const TextVersion*, size_t pos, size_t len, char *buf);
+bool text_version_chunks(const TextVersion*, const Filerange*, bool (*chunk)(const char *data, size_t len, void *arg), void *arg);
 
 Iterator text_iterator_get(Text*, size_t pos);
 bool text_iterator_valid(const Iterator*);
@@ -113,8 +211,28 @@ size_t text_mark_get(Text*, Mark);
 size_t text_history_get(Text*, size_t index);
 /* return the size in bytes of the whole text */
 size_t text_size(Text*);
+/* an identifier of the current content, it changes with every modification
+ * and is never shared by two texts */
+size_t text_revision(Text*);
 /* query whether the text contains any unsaved modifications */
 bool text_modified(Text*);
+
+/* internal bookkeeping information, mostly useful for debugging and benchmarking */
+typedef struct {
+	size_t pieces;      /* number of pieces currently allocated */
+	size_t active;      /* number of pieces forming the document */
+	size_t changes;     /* number of changes currently allocated */
+	size_t actions;     /* number of actions currently allocated */
+	size_t pool_blocks; /* number of memory blocks backing the above objects */
+	size_t pool_size;   /* total size of all blocks in bytes */
+	size_t history_size; /* memory used by the undo history, as limited by text_history_limit */
+	size_t save_copied;  /* bytes of the last save copied by the kernel from the loaded file */
+	size_t save_written; /* bytes of the last save written from memory */
+	size_t bytes_copied; /* bytes copied out of the text by text_bytes_get */
+	size_t bytes_chunked; /* bytes read in place by text_chunks */
+} TextStats;
+
+TextStats text_stats(Text*);
 /* query whether `addr` is part of a memory mapped region associated with
  * this text instance */
 bool text_sigbus(Text*, const char *addr);
@@ -133,6 +251,12 @@ const char *text_newline_char(Text*);
  * new inode to file. */
 bool text_save(Text*, const char *filename);
 bool text_save_range(Text*, Filerange*, const char *file);
+/* whether saving the file the text was mmap-ed from may overwrite only its
+ * modified part in place, guarded by a journal `.filename.save' which is
+ * replayed if the save is interrupted. Other readers can observe the file
+ * partially written meanwhile, hence saves create a new file and atomically
+ * rename(2) it over the old one by default. */
+void text_save_delta(Text*, bool enable);
 
 /* this set of functions can be used to write multiple non-consecutive
  * file ranges. For every call to `text_save_begin` there must be exactly
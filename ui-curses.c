@@ -604,11 +604,36 @@ static void ui_window_move(UiCursesWin *win, int x, int y) {
 		mvwin(win->winstatus, y + win->height - 1, x);
 }
 
+typedef struct {
+	WINDOW *win;              /* sidebar in which to mark modified lines */
+	int column, row;          /* where to place the marker of the current line */
+	const Line *line;         /* current screen line */
+	size_t pos;               /* its starting position */
+} SidebarDiff;
+
+static bool ui_window_draw_sidebar_hunk(const TextDiff *diff, void *data) {
+	SidebarDiff *side = data;
+	size_t start = diff->to.start, end = diff->to.end;
+	int mark = diff->from.start == diff->from.end ? '+' : start == end ? '-' : '~';
+	for (const Line *l; (l = side->line) && l->len; side->line = l->next, side->pos += l->len, side->row++) {
+		if (side->pos + l->len <= start)
+			continue;
+		if (side->pos > start && side->pos >= end)
+			return true;
+		if (l->lineno)
+			mvwaddch(side->win, side->row, side->column, mark);
+		if (side->pos + l->len >= end)
+			return true;
+	}
+	return false;
+}
+
 static bool ui_window_draw_sidebar(UiCursesWin *win) {
 	if (!win->winside)
 		return true;
 	const Line *line = view_lines_get(win->view);
-	int sidebar_width = snprintf(NULL, 0, "%zd", line->lineno + win->height - 2) + 1;
+	/* line numbers followed by a column for markers of modified lines and the separator */
+	int sidebar_width = snprintf(NULL, 0, "%zd", line->lineno + win->height - 2) + 2;
 	if (win->sidebar_width != sidebar_width) {
 		win->sidebar_width = sidebar_width;
 		ui_window_resize(win, win->width, win->height);
@@ -625,19 +650,31 @@ static bool ui_window_draw_sidebar(UiCursesWin *win) {
 		for (const Line *l = line; l; l = l->next, i++) {
 			if (l->lineno && l->lineno != prev_lineno) {
 				if (win->options & UI_OPTION_LINE_NUMBERS_ABSOLUTE) {
-					mvwprintw(win->winside, i, 0, "%*u", sidebar_width-1, l->lineno);
+					mvwprintw(win->winside, i, 0, "%*u", sidebar_width-2, l->lineno);
 				} else if (win->options & UI_OPTION_LINE_NUMBERS_RELATIVE) {
 					size_t rel = (win->options & UI_OPTION_LARGE_FILE) ? 0 : l->lineno;
 					if (l->lineno > cursor_lineno)
 						rel = l->lineno - cursor_lineno;
 					else if (l->lineno < cursor_lineno)
 						rel = cursor_lineno - l->lineno;
-					mvwprintw(win->winside, i, 0, "%*u", sidebar_width-1, rel);
+					mvwprintw(win->winside, i, 0, "%*u", sidebar_width-2, rel);
 				}
 			}
 			prev_lineno = l->lineno;
 		}
 		mvwvline(win->winside, 0, sidebar_width-1, ACS_VLINE, win->height-1);
+		Text *txt = win->file->text;
+		size_t saved = text_state_saved(txt);
+		if (saved != EPOS && text_modified(txt)) {
+			Filerange viewport = view_viewport_get(win->view);
+			SidebarDiff side = {
+				.win = win->winside,
+				.column = sidebar_width-2,
+				.line = line,
+				.pos = viewport.start,
+			};
+			text_diff_range(txt, saved, text_state_id(txt), &viewport, ui_window_draw_sidebar_hunk, &side);
+		}
 		return true;
 	}
 }
@@ -89,7 +89,6 @@ struct View {
 	Selection *selections; /* all selected regions */
 	int cursor_generation; /* used to filter out newly created cursors during iteration */
 	bool need_update;   /* whether view has been redrawn */
-	bool large_file;    /* optimize for displaying large files */
 	int colorcolumn;
 	ViewEvent *events;
 };
@@ -138,7 +137,7 @@ static void view_clear(View *view) {
 
 	view->start_last = view->start;
 	view->topline = view->lines;
-	view->topline->lineno = view->large_file ? 1 : text_lineno_by_pos(view->text, view->start);
+	view->topline->lineno = text_lineno_by_pos(view->text, view->start);
 	view->lastline = view->topline;
 
 	size_t line_size = sizeof(Line) + view->width*sizeof(Cell);
@@ -327,44 +326,54 @@ void view_cursor_to(View *view, size_t pos) {
  * stop once the screen is full, update view->end, view->lastline */
 void view_draw(View *view) {
 	view_clear(view);
-	/* read a screenful of text considering each character as 4-byte UTF character*/
-	const size_t text_size = view->width * view->height * 4;
-	/* current buffer to work with */
-	char text[text_size+1];
-	/* remaining bytes to process in buffer */
-	size_t rem = text_bytes_get(view->text, view->start, text_size, text);
-	/* NUL terminate text section */
-	text[rem] = '\0';
+	/* the text is read in place from the pieces, only a few bytes around
+	 * piece boundaries are copied such that a multibyte character or \r\n
+	 * spanning two pieces is interpreted as a whole */
+	char stitch[8];
 	/* absolute position of character currently being added to display */
 	size_t pos = view->start;
+	/* absolute position of the next byte to interpret */
+	size_t next = view->start;
 	/* current position into buffer from which to interpret a character */
-	char *cur = text;
+	const char *cur = NULL;
+	/* remaining bytes to process in buffer */
+	size_t rem = 0;
 	/* start from known multibyte state */
 	mbstate_t mbstate = { 0 };
 
 	Cell cell = { 0 }, prev_cell = { 0 };
 
-	while (rem > 0) {
+	for (;;) {
+
+		if (rem < sizeof(stitch) / 2) {
+			/* near the end of the current buffer, continue in place if
+			 * the piece at the next position holds enough data */
+			Iterator it = text_iterator_get(view->text, next);
+			if (text_iterator_valid(&it) && it.end - it.text >= (ptrdiff_t)sizeof(stitch) / 2) {
+				cur = it.text;
+				rem = it.end - it.text;
+			} else {
+				cur = stitch;
+				rem = text_bytes_get(view->text, next, sizeof(stitch), stitch);
+			}
+			if (rem == 0)
+				break;
+		}
 
 		/* current 'parsed' character' */
 		wchar_t wchar;
 
 		size_t len = mbrtowc(&wchar, cur, rem, &mbstate);
-		if (len == (size_t)-1 && errno == EILSEQ) {
-			/* ok, we encountered an invalid multibyte sequence,
-			 * replace it with the Unicode Replacement Character
-			 * (FFFD) and skip until the start of the next utf8 char */
+		if (len == (size_t)-1 || len == (size_t)-2) {
+			/* ok, we encountered an invalid or truncated multibyte
+			 * sequence, replace it with the Unicode Replacement
+			 * Character (FFFD) and skip until the start of the next
+			 * utf8 char */
 			for (len = 1; rem > len && !ISUTF8(cur[len]); len++);
+			/* the sequence might continue beyond the current buffer */
+			for (char c; len >= rem && text_byte_get(view->text, next + len, &c) && !ISUTF8(c); len++);
 			cell = (Cell){ .data = "\xEF\xBF\xBD", .len = len, .width = 1 };
-		} else if (len == (size_t)-2) {
-			/* not enough bytes available to convert to a
-			 * wide character. advance file position and read
-			 * another junk into buffer.
-			 */
-			rem = text_bytes_get(view->text, pos, text_size, text);
-			text[rem] = '\0';
-			cur = text;
-			continue;
+			mbstate = (mbstate_t){ 0 };
 		} else if (len == 0) {
 			/* NUL byte encountered, store it and continue */
 			cell = (Cell){ .data = "\x00", .len = 1, .width = 2 };
@@ -393,8 +402,13 @@ void view_draw(View *view) {
 			prev_cell = cell;
 		}
 
- 		rem -= cell.len;
-		cur += cell.len;
+		if (cell.len < rem) {
+			rem -= cell.len;
+			cur += cell.len;
+		} else {
+			rem = 0;
+		}
+		next += cell.len;
 
 		memset(&cell, 0, sizeof cell);
 	}
@@ -847,8 +861,6 @@ void view_options_set(View *view, enum UiOption options) {
 	if (options & UI_OPTION_LINE_NUMBERS_ABSOLUTE)
 		options &= ~UI_OPTION_LARGE_FILE;
 
-	view->large_file = (options & UI_OPTION_LARGE_FILE);
-
 	if (view->ui)
 		view->ui->options_set(view->ui, options);
 }
@@ -1,5 +1,6 @@
 /* this file is included from sam.c */
 
+#include <fcntl.h>
 #include <termkey.h>
 #include "vis-lua.h"
 
@@ -106,6 +107,12 @@ static bool cmd_set(Vis *vis, Win *win, Command *cmd, const char *argv[], Cursor
 		OPTION_CURSOR_LINE,
 		OPTION_COLOR_COLUMN,
 		OPTION_HORIZON,
+		OPTION_HISTORY_LEVELS,
+		OPTION_HISTORY_MEMORY,
+		OPTION_HISTORY_FILE,
+		OPTION_SWAP_FILE,
+		OPTION_SAVE_DELTA,
+		OPTION_FOLLOW,
 	};
 
 	/* definitions have to be in the same order as the enum above */
@@ -121,6 +128,12 @@ static bool cmd_set(Vis *vis, Win *win, Command *cmd, const char *argv[], Cursor
 		[OPTION_CURSOR_LINE]     = { { "cursorline", "cul"      }, OPTION_TYPE_BOOL,     OPTION_FLAG_WINDOW                      },
 		[OPTION_COLOR_COLUMN]    = { { "colorcolumn", "cc"      }, OPTION_TYPE_NUMBER,   OPTION_FLAG_WINDOW                      },
 		[OPTION_HORIZON]         = { { "horizon"                }, OPTION_TYPE_UNSIGNED, OPTION_FLAG_WINDOW                      },
+		[OPTION_HISTORY_LEVELS]  = { { "historylevels"          }, OPTION_TYPE_UNSIGNED,                                         },
+		[OPTION_HISTORY_MEMORY]  = { { "historymemory"          }, OPTION_TYPE_UNSIGNED,                                         },
+		[OPTION_HISTORY_FILE]    = { { "historyfile"            }, OPTION_TYPE_BOOL,                                             },
+		[OPTION_SWAP_FILE]       = { { "swapfile"               }, OPTION_TYPE_BOOL,                                             },
+		[OPTION_SAVE_DELTA]      = { { "savedelta"              }, OPTION_TYPE_BOOL,                                             },
+		[OPTION_FOLLOW]          = { { "follow"                 }, OPTION_TYPE_BOOL,     OPTION_FLAG_WINDOW                      },
 	};
 
 	if (!vis->options) {
@@ -293,6 +306,39 @@ static bool cmd_set(Vis *vis, Win *win, Command *cmd, const char *argv[], Cursor
 	case OPTION_HORIZON:
 		win->horizon = arg.u;
 		break;
+	case OPTION_HISTORY_LEVELS:
+	case OPTION_HISTORY_MEMORY:
+		if (opt->index == OPTION_HISTORY_LEVELS)
+			vis->history_levels = arg.u;
+		else
+			vis->history_memory = arg.u;
+		for (File *file = vis->files; file; file = file->next)
+			text_history_limit(file->text, vis->history_levels, vis->history_memory);
+		break;
+	case OPTION_HISTORY_FILE:
+		vis->history_file = arg.b;
+		for (File *file = vis->files; file; file = file->next) {
+			if (file->name)
+				text_history_file(file->text, arg.b ? file->name : NULL);
+		}
+		break;
+	case OPTION_SWAP_FILE:
+		vis->swap_file = arg.b;
+		for (File *file = vis->files; file; file = file->next) {
+			if (file->name)
+				text_swap_file(file->text, arg.b ? file->name : NULL);
+		}
+		break;
+	case OPTION_SAVE_DELTA:
+		vis->save_delta = arg.b;
+		for (File *file = vis->files; file; file = file->next)
+			text_save_delta(file->text, arg.b);
+		break;
+	case OPTION_FOLLOW:
+		win->follow = arg.b;
+		if (win->follow)
+			view_cursor_to(win->view, text_size(win->file->text));
+		break;
 	}
 
 	return true;
@@ -539,6 +585,157 @@ static bool cmd_earlier_later(Vis *vis, Win *win, Command *cmd, const char *argv
 	return pos != EPOS;
 }
 
+static bool cmd_history_compact(Vis *vis, Win *win, Command *cmd, const char *argv[], Cursor *cur, Filerange *range) {
+	if (!win)
+		return false;
+	char *end;
+	long count = 0;
+	if (argv[1]) {
+		errno = 0;
+		count = strtol(argv[1], &end, 10);
+		if (errno || end == argv[1] || *end || count < 0) {
+			vis_info_show(vis, "Invalid number");
+			return false;
+		}
+	}
+	size_t size = text_history_compact(win->file->text, count);
+	vis_info_show(vis, "Reclaimed %zu bytes of undo history", size);
+	return true;
+}
+
+static bool cmd_stats(Vis *vis, Win *win, Command *cmd, const char *argv[], Cursor *cur, Filerange *range) {
+	if (!win)
+		return false;
+	TextStats stats = text_stats(win->file->text);
+	vis_info_show(vis, "%zu pieces (%zu active), %zu changes, %zu actions in %zu blocks "
+	              "(%zu bytes), %zu bytes of undo history", stats.pieces, stats.active,
+	              stats.changes, stats.actions, stats.pool_blocks, stats.pool_size,
+	              stats.history_size);
+	return true;
+}
+
+typedef struct {
+	Text *txt;          /* current text */
+	Text *out;          /* diff output */
+	int fd;             /* saved file, matches the state of the last save */
+	bool pending;       /* whether `hunk' still needs to be written */
+	TextDiff hunk;      /* differences expanded to whole lines */
+	ptrdiff_t delta;    /* lines added before `hunk' */
+	bool error;
+} DiffSaved;
+
+static size_t diff_lines(Text *out, char sign, const char *data, size_t len) {
+	size_t lines = 0;
+	for (const char *cur = data, *end = data + len; cur < end; lines++) {
+		const char *nl = memchr(cur, '\n', end - cur);
+		size_t n = nl ? (size_t)(nl - cur) : (size_t)(end - cur);
+		if (out)
+			text_appendf(out, "%c%.*s\n%s", sign, (int)n, cur, nl ? "" : "\\ No newline at end of file\n");
+		cur += n + 1;
+	}
+	return lines;
+}
+
+static bool diff_saved_flush(DiffSaved *diff) {
+	if (!diff->pending)
+		return true;
+	diff->pending = false;
+	Filerange *from = &diff->hunk.from, *to = &diff->hunk.to;
+	size_t old_len = text_range_size(from), new_len = text_range_size(to);
+	char *old = malloc(old_len+1);
+	char *new = text_bytes_alloc0(diff->txt, to->start, new_len);
+	if (!old || !new || pread(diff->fd, old, old_len, from->start) != (ssize_t)old_len) {
+		free(old);
+		free(new);
+		return !(diff->error = true);
+	}
+	size_t old_lines = diff_lines(NULL, '-', old, old_len);
+	size_t new_lines = diff_lines(NULL, '+', new, new_len);
+	size_t lineno = text_lineno_by_pos(diff->txt, to->start);
+	size_t old_lineno = lineno - diff->delta;
+	text_appendf(diff->out, "@@ -%zu,%zu +%zu,%zu @@\n",
+		old_lines ? old_lineno : old_lineno - 1, old_lines,
+		new_lines ? lineno : lineno - 1, new_lines);
+	diff_lines(diff->out, '-', old, old_len);
+	diff_lines(diff->out, '+', new, new_len);
+	diff->delta += (ptrdiff_t)new_lines - (ptrdiff_t)old_lines;
+	free(old);
+	free(new);
+	return true;
+}
+
+static bool diff_saved_hunk(const TextDiff *d, void *data) {
+	DiffSaved *diff = data;
+	TextDiff hunk = *d;
+	/* the bytes surrounding a hunk on its lines are the same in both states */
+	size_t prefix = hunk.to.start - text_line_begin(diff->txt, hunk.to.start);
+	hunk.from.start -= prefix;
+	hunk.to.start -= prefix;
+	char c = '\n';
+	bool old_eol = hunk.from.end == 0 ||
+		(pread(diff->fd, &c, 1, hunk.from.end-1) == 1 && c == '\n');
+	bool new_eol = hunk.to.end == 0 ||
+		(text_byte_get(diff->txt, hunk.to.end-1, &c) && c == '\n');
+	if (!old_eol || !new_eol) {
+		size_t suffix = text_line_next(diff->txt, hunk.to.end) - hunk.to.end;
+		hunk.from.end += suffix;
+		hunk.to.end += suffix;
+	}
+	if (diff->pending && hunk.to.start <= diff->hunk.to.end) {
+		diff->hunk.from.end = hunk.from.end;
+		diff->hunk.to.end = hunk.to.end;
+		return true;
+	}
+	if (!diff_saved_flush(diff))
+		return false;
+	diff->hunk = hunk;
+	diff->pending = true;
+	return true;
+}
+
+static bool cmd_diff_saved(Vis *vis, Win *win, Command *cmd, const char *argv[], Cursor *cur, Filerange *range) {
+	if (!win)
+		return false;
+	File *file = win->file;
+	Text *txt = file->text;
+	size_t saved = text_state_saved(txt);
+	if (!file->name || saved == EPOS) {
+		vis_info_show(vis, "No saved state to compare against");
+		return false;
+	}
+	if (!text_modified(txt)) {
+		vis_info_show(vis, "No changes since last save");
+		return true;
+	}
+	int fd = open(file->name, O_RDONLY);
+	if (fd == -1) {
+		vis_info_show(vis, "Can not open `%s': %s", file->name, strerror(errno));
+		return false;
+	}
+	struct stat meta, orig = text_stat(txt);
+	if (fstat(fd, &meta) == -1 || meta.st_dev != orig.st_dev || meta.st_ino != orig.st_ino ||
+	    meta.st_size != orig.st_size || meta.st_mtime != orig.st_mtime) {
+		vis_info_show(vis, "File changed on disk");
+		close(fd);
+		return false;
+	}
+	if (!vis_window_new(vis, NULL)) {
+		close(fd);
+		return false;
+	}
+	DiffSaved diff = { .txt = txt, .out = vis->win->file->text, .fd = fd };
+	text_appendf(diff.out, "--- %s (saved)\n+++ %s\n", file->name, file->name);
+	bool ret = text_diff(txt, saved, text_state_id(txt), diff_saved_hunk, &diff);
+	ret = diff_saved_flush(&diff) && ret && !diff.error;
+	close(fd);
+	text_save(diff.out, NULL);
+	view_cursor_to(vis->win->view, 0);
+	vis_window_syntax_set(vis->win, "diff");
+	if (!ret)
+		vis_info_show(vis, "Failed to compute differences");
+	return ret;
+}
+
 static bool print_keylayout(const char *key, void *value, void *data) {
 	return text_appendf(data, "  %-18s\t%s\n", key[0] == ' ' ? "␣" : key, (char*)value);
 }
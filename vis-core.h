@@ -112,6 +112,8 @@ struct File { /* shared state among windows displaying the same file */
 	bool is_stdin;                   /* whether file content was read from stdin */
 	bool internal;                   /* whether it is an internal file (e.g. used for the prompt) */
 	struct stat stat;                /* filesystem information when loaded/saved, used to detect changes outside the editor */
+	int watch;                       /* inotify(7) watch descriptor of the file, -1 if none */
+	bool changed;                    /* whether a modification on disk awaits processing */
 	int refcount;                    /* how many windows are displaying this file? (always >= 1) */
 	Mark marks[VIS_MARK_INVALID];    /* marks which are shared across windows */
 	File *next, *prev;
@@ -136,6 +138,7 @@ struct Win {
 	ViewEvent event;        /* callbacks from view.[ch] */
 	char *lexer_name;       /* corresponds to filename in lexers/ subdirectory */
 	size_t horizon;         /* max bytes to consider for syntax coloring before viewport */
+	bool follow;            /* whether the cursor moves along with data appended to the file (like tail -f) */
 	Win *prev, *next;       /* neighbouring windows */
 };
 
@@ -157,6 +160,13 @@ struct Vis {
 	int tabwidth;                        /* how many spaces should be used to display a tab */
 	bool expandtab;                      /* whether typed tabs should be converted to spaces */
 	bool autoindent;                     /* whether indentation should be copied from previous line on newline */
+	size_t history_levels;               /* maximal number of undo states kept per file, 0 for no limit */
+	size_t history_memory;               /* maximal memory in bytes used by the undo history of a file, 0 for no limit */
+	bool history_file;                   /* whether the undo history is persisted in a file next to the edited one */
+	bool swap_file;                      /* whether unsaved modifications are journaled in a file next to the edited one */
+	bool save_delta;                     /* whether saves may only overwrite the modified part of a file in place */
+	int inotify;                         /* inotify(7) instance notifying about modified files, -1 if unavailable */
+	int stdin_fd;                        /* standard input still being read into the is_stdin file, -1 once done */
 	Map *cmds;                           /* ":"-commands, used for unique prefix queries */
 	Map *usercmds;                       /* user registered ":"-commands */
 	Map *options;                        /* ":set"-options */
@@ -201,5 +211,10 @@ Win *window_new_file(Vis*, File*, enum UiOption);
 
 const char *file_name_get(File*);
 void file_name_set(File*, const char *name);
+/* watch the file for modifications made outside the editor */
+void file_watch(Vis*, File*);
+/* block until the standard input streamed into the is_stdin file reached
+ * its end, false if it could not be read completely */
+bool file_stream_finish(Vis*);
 
 #endif
@@ -28,7 +28,7 @@
 
 static void window_status_update(Vis *vis, Win *win) {
 	char left_parts[4][255] = { "", "", "", "" };
-	char right_parts[4][32] = { "", "", "", "" };
+	char right_parts[5][32] = { "", "", "", "", "" };
 	char left[sizeof(left_parts)+LENGTH(left_parts)*8];
 	char right[sizeof(right_parts)+LENGTH(right_parts)*8];
 	char status[sizeof(left)+sizeof(right)+1];
@@ -53,6 +53,13 @@ static void window_status_update(Vis *vis, Win *win) {
 	         vis_macro_recording(vis) ? " @": "");
 	left_count++;
 
+	int progress = text_load_progress(txt);
+	if (progress < 100) {
+		snprintf(right_parts[right_count], sizeof(right_parts[right_count])-1,
+		         "loading %d%%", progress);
+		right_count++;
+	}
+
 	if (text_newline_type(txt) != TEXT_NEWLINE_NL)
 		strcpy(right_parts[right_count++], "␊");
 
@@ -98,14 +105,16 @@ static void window_status_update(Vis *vis, Win *win) {
 	         left_parts[3][0] ? " » " : "",
 	         left_parts[3]);
 
-	int right_len = snprintf(right, sizeof(right)-1, "%s%s%s%s%s%s%s ",
+	int right_len = snprintf(right, sizeof(right)-1, "%s%s%s%s%s%s%s%s%s ",
 	         right_parts[0],
 	         right_parts[1][0] ? " « " : "",
 	         right_parts[1],
 	         right_parts[2][0] ? " « " : "",
 	         right_parts[2],
 	         right_parts[3][0] ? " « " : "",
-	         right_parts[3]);
+	         right_parts[3],
+	         right_parts[4][0] ? " « " : "",
+	         right_parts[4]);
 
 	if (left_len < 0 || right_len < 0)
 		return;
@@ -1099,6 +1108,11 @@ static int file_index(lua_State *L) {
 			lua_pushboolean(L, text_modified(file->text));
 			return 1;
 		}
+
+		if (strcmp(key, "loaded") == 0) {
+			lua_pushunsigned(L, text_load_progress(file->text));
+			return 1;
+		}
 	}
 
 	return index_common(L);
@@ -1137,6 +1151,39 @@ static int file_delete(lua_State *L) {
 	return 1;
 }
 
+/* apply a list of { start = pos, finish = pos, text = "..." } edits, sorted
+ * by position and relative to the content before any of them, atomically */
+static int file_edits(lua_State *L) {
+	File *file = obj_ref_check(L, 1, "vis.file");
+	if (!file) {
+		lua_pushboolean(L, false);
+		return 1;
+	}
+	luaL_checktype(L, 2, LUA_TTABLE);
+	size_t count = lua_rawlen(L, 2);
+	if (count > SIZE_MAX / sizeof(TextEdit))
+		return luaL_argerror(L, 2, "too many edits");
+	/* a userdata is released by the garbage collector even if we raise an error */
+	TextEdit *edits = lua_newuserdata(L, count * sizeof *edits);
+	for (size_t i = 0; i < count; i++) {
+		lua_rawgeti(L, 2, i+1);
+		int index = lua_gettop(L);
+		luaL_checktype(L, index, LUA_TTABLE);
+		edits[i].range = getrange(L, index);
+		lua_getfield(L, index, "text");
+		/* the string stays referenced by the edits table, unlike a number
+		 * converted in place by lua_tolstring which is popped below */
+		if (!lua_isnil(L, -1) && lua_type(L, -1) != LUA_TSTRING)
+			return luaL_argerror(L, 2, "text of an edit must be a string");
+		edits[i].data = lua_tolstring(L, -1, &edits[i].len);
+		if (!edits[i].data)
+			edits[i].len = 0;
+		lua_pop(L, 2);
+	}
+	lua_pushboolean(L, text_edits(file->text, edits, count));
+	return 1;
+}
+
 static int file_lines_iterator_it(lua_State *L);
 
 static int file_lines_iterator(lua_State *L) {
@@ -1150,19 +1197,26 @@ static int file_lines_iterator(lua_State *L) {
 	return 1;
 }
 
+static bool pushtext_chunk(const char *data, size_t len, void *buf) {
+	luaL_addlstring(buf, data, len);
+	return true;
+}
+
+/* push the content of the range as a string, without an intermediate copy */
+static void pushtext(lua_State *L, Text *txt, Filerange *range) {
+	luaL_Buffer buf;
+	luaL_buffinitsize(L, &buf, text_range_size(range));
+	text_chunks(txt, range, pushtext_chunk, &buf);
+	luaL_pushresult(&buf);
+}
+
 static int file_lines_iterator_it(lua_State *L) {
 	File *file = *(File**)lua_touserdata(L, lua_upvalueindex(1));
 	size_t *start = lua_touserdata(L, lua_upvalueindex(2));
 	if (*start == text_size(file->text))
 		return 0;
 	size_t end = text_line_end(file->text, *start);
-	size_t len = end - *start;
-	char *buf = malloc(len);
-	if (!buf && len)
-		return 0;
-	len = text_bytes_get(file->text, *start, len, buf);
-	lua_pushlstring(L, buf, len);
-	free(buf);
+	pushtext(L, file->text, &(Filerange){ .start = *start, .end = end });
 	*start = text_line_next(file->text, end);
 	return 1;
 }
@@ -1174,13 +1228,7 @@ static int file_content(lua_State *L) {
 	Filerange range = getrange(L, 2);
 	if (!text_range_valid(&range))
 		goto err;
-	size_t len = text_range_size(&range);
-	char *data = malloc(len);
-	if (!data)
-		goto err;
-	len = text_bytes_get(file->text, range.start, len, data);
-	lua_pushlstring(L, data, len);
-	free(data);
+	pushtext(L, file->text, &range);
 	return 1;
 err:
 	lua_pushnil(L);
@@ -1192,6 +1240,7 @@ static const struct luaL_Reg file_funcs[] = {
 	{ "__newindex", file_newindex },
 	{ "insert", file_insert },
 	{ "delete", file_delete },
+	{ "edits", file_edits },
 	{ "lines_iterator", file_lines_iterator },
 	{ "content", file_content },
 	{ NULL, NULL },
@@ -1205,13 +1254,7 @@ static int file_lines_index(lua_State *L) {
 	size_t start = text_pos_by_lineno(txt, line);
 	size_t end = text_line_end(txt, start);
 	if (start != EPOS && end != EPOS) {
-		size_t size = end - start;
-		char *data = malloc(size);
-		if (!data && size)
-			goto err;
-		size = text_bytes_get(txt, start, size, data);
-		lua_pushlstring(L, data, size);
-		free(data);
+		pushtext(L, txt, &(Filerange){ .start = start, .end = end });
 		return 1;
 	}
 err:
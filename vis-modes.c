@@ -130,7 +130,10 @@ static void vis_mode_insert_leave(Vis *vis, Mode *new) {
 }
 
 static void vis_mode_insert_idle(Vis *vis) {
-	text_snapshot(vis->win->file->text);
+	Text *txt = vis->win->file->text;
+	text_snapshot(txt);
+	/* bound the time spent, the remaining pieces are merged the next time */
+	text_defragment(txt, 1 << 20);
 }
 
 static void vis_mode_insert_input(Vis *vis, const char *str, size_t len) {
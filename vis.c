@@ -17,6 +17,9 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 #include <pwd.h>
 #include <libgen.h>
 #include <termkey.h>
@@ -29,9 +32,15 @@
 #include "vis-core.h"
 #include "sam.h"
 
+/* maximal amount of data read from a standard input pipe at once */
+#define STDIN_STEP_SIZE (1 << 22)
+/* milliseconds without input after which modifications are journaled */
+#define SWAP_DELAY 1000
+
 static Macro *macro_get(Vis *vis, enum VisRegister);
 static void macro_replay(Vis *vis, const Macro *macro);
 static void vis_keys_process(Vis *vis);
+static void file_unwatch(Vis *vis, File *file);
 
 /** window / file handling */
 
@@ -44,6 +53,7 @@ static void file_free(Vis *vis, File *file) {
 	}
 	if (!file->internal && vis->event && vis->event->file_close)
 		vis->event->file_close(vis, file);
+	file_unwatch(vis, file);
 	text_free(file->text);
 	free((char*)file->name);
 
@@ -62,6 +72,8 @@ static File *file_new_text(Vis *vis, Text *text) {
 		return NULL;
 	file->text = text;
 	file->stat = text_stat(text);
+	file->watch = -1;
+	text_history_limit(text, vis->history_levels, vis->history_memory);
 	if (vis->files)
 		vis->files->prev = file;
 	file->next = vis->files;
@@ -94,6 +106,182 @@ err:
 	return path_normalized[0] ? strdup(path_normalized) : NULL;
 }
 
+/* refresh the status bar of all windows displaying the loaded text */
+static void file_loaded(Text *text, void *data) {
+	Vis *vis = data;
+	for (Win *win = vis->windows; win; win = win->next) {
+		if (win->file->text == text && vis->event && vis->event->win_status)
+			vis->event->win_status(vis, win);
+	}
+}
+
+/* whether some files are still being loaded in the background */
+static bool files_loading(Vis *vis) {
+	for (File *file = vis->files; file; file = file->next) {
+		if (text_loading(file->text))
+			return true;
+	}
+	return false;
+}
+
+/* perform the next step of all pending background loads */
+static void files_load(Vis *vis) {
+	for (File *file = vis->files; file; file = file->next) {
+		if (text_load_poll(file->text))
+			file_loaded(file->text, vis);
+	}
+}
+
+/* flush the journaled modifications of all files to disk */
+static void files_sync(Vis *vis) {
+	for (File *file = vis->files; file; file = file->next) {
+		if (!text_swap_sync(file->text))
+			vis_info_show(vis, "Can not write swap file of `%s': %s", file->name ? file->name : "[No Name]", strerror(errno));
+	}
+}
+
+/* (re)register the file with inotify(7), the watch follows the inode. Once
+ * it is replaced under the same name, e.g. by an atomic save, the watch
+ * moves to the new one */
+void file_watch(Vis *vis, File *file) {
+#ifdef __linux__
+	if (vis->inotify == -1 || !file->name)
+		return;
+	int watch = inotify_add_watch(vis->inotify, file->name,
+		IN_MODIFY|IN_ATTRIB|IN_CLOSE_WRITE|IN_MOVE_SELF|IN_DELETE_SELF);
+	if (watch != file->watch)
+		file_unwatch(vis, file);
+	file->watch = watch;
+#endif
+}
+
+static void file_unwatch(Vis *vis, File *file) {
+#ifdef __linux__
+	if (file->watch == -1)
+		return;
+	/* hard links or reloaded files share the watch of the same inode */
+	for (File *f = vis->files; f; f = f->next) {
+		if (f != file && f->watch == file->watch) {
+			file->watch = -1;
+			return;
+		}
+	}
+	inotify_rm_watch(vis->inotify, file->watch);
+	file->watch = -1;
+#endif
+}
+
+/* redraw the windows displaying a file which grew, those in follow mode
+ * move their cursor to the new end */
+static void file_appended(Vis *vis, File *file) {
+	Text *txt = file->text;
+	for (Win *win = vis->windows; win; win = win->next) {
+		if (win->file != file)
+			continue;
+		if (win->follow)
+			view_cursor_to(win->view, text_size(txt));
+		view_draw(win->view);
+	}
+	file_loaded(txt, vis);
+}
+
+/* read the data currently available from the original standard input into
+ * the corresponding file, a bounded amount at a time to remain responsive.
+ * Pending modifications of the user are snapshotted first, every call thus
+ * adds its own state to the history which is undone separately */
+static bool file_stream(Vis *vis) {
+	File *file = vis->files;
+	while (file && !file->is_stdin)
+		file = file->next;
+	if (!file) {
+		close(vis->stdin_fd);
+		vis->stdin_fd = -1;
+		return true;
+	}
+	Text *txt = file->text;
+	char buf[PIPE_BUF];
+	ssize_t len = 0;
+	size_t total = 0;
+	text_snapshot(txt);
+	while (total < STDIN_STEP_SIZE && (len = read(vis->stdin_fd, buf, sizeof buf)) > 0) {
+		text_insert(txt, text_size(txt), buf, len);
+		total += len;
+	}
+	if (total > 0) {
+		text_snapshot(txt);
+		file_appended(vis, file);
+	}
+	if (len == 0 || (len == -1 && errno != EAGAIN && errno != EINTR)) {
+		if (len == -1)
+			vis_info_show(vis, "Can not read from stdin: %s", strerror(errno));
+		close(vis->stdin_fd);
+		vis->stdin_fd = -1;
+		return len == 0;
+	}
+	return true;
+}
+
+bool file_stream_finish(Vis *vis) {
+	if (vis->stdin_fd == -1)
+		return true;
+	int flags = fcntl(vis->stdin_fd, F_GETFL);
+	if (flags == -1 || fcntl(vis->stdin_fd, F_SETFL, flags & ~O_NONBLOCK) == -1)
+		return false;
+	while (vis->stdin_fd != -1) {
+		if (!file_stream(vis))
+			return false;
+	}
+	return true;
+}
+
+#ifdef __linux__
+/* data appended to the file is loaded right away and followed by windows in
+ * follow mode, any other modification has to be reloaded explicitly */
+static void file_changed(Vis *vis, File *file) {
+	file_watch(vis, file);
+	struct stat meta;
+	if (stat(file->name, &meta) == 0 && meta.st_dev == file->stat.st_dev &&
+	    meta.st_ino == file->stat.st_ino && meta.st_size == file->stat.st_size &&
+	    meta.st_mtime == file->stat.st_mtime)
+		return; /* nothing new, e.g. saved by ourself */
+	Text *txt = file->text;
+	size_t len = text_load_append(txt, file->name);
+	if (len == EPOS) {
+		vis_info_show(vis, "WARNING: file `%s' changed on disk, use :e! to reload", file_name_get(file));
+	} else if (len > 0) {
+		file->stat = text_stat(txt);
+		file_appended(vis, file);
+	}
+}
+#endif
+
+/* process the pending inotify(7) events, each affected file is only looked
+ * at once no matter how many writes were reported */
+static void files_watch(Vis *vis) {
+#ifdef __linux__
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+	while ((len = read(vis->inotify, buf, sizeof buf)) > 0) {
+		const struct inotify_event *event;
+		for (char *ptr = buf; ptr < buf + len; ptr += sizeof(*event) + event->len) {
+			event = (const struct inotify_event*)ptr;
+			if (event->mask & IN_IGNORED)
+				continue;
+			for (File *file = vis->files; file; file = file->next) {
+				if (file->watch == event->wd)
+					file->changed = true;
+			}
+		}
+	}
+	for (File *file = vis->files; file; file = file->next) {
+		if (file->changed) {
+			file->changed = false;
+			file_changed(vis, file);
+		}
+	}
+#endif
+}
+
 static File *file_new(Vis *vis, const char *name) {
 	char *name_absolute = NULL;
 	if (name) {
@@ -115,7 +303,7 @@ static File *file_new(Vis *vis, const char *name) {
 	}
 
 	File *file = NULL;
-	Text *text = text_load(name);
+	Text *text = text_load_async(name, file_loaded, vis);
 	if (!text && name && errno == ENOENT)
 		text = text_load(NULL);
 	if (!text)
@@ -123,6 +311,13 @@ static File *file_new(Vis *vis, const char *name) {
 	if (!(file = file_new_text(vis, text)))
 		goto err;
 	file->name = name_absolute;
+	if (vis->history_file && name_absolute)
+		text_history_file(text, name_absolute);
+	if (vis->swap_file && name_absolute)
+		text_swap_file(text, name_absolute);
+	text_save_delta(text, vis->save_delta);
+	if (name_absolute)
+		file_watch(vis, file);
 	if (!file->internal && vis->event && vis->event->file_open)
 		vis->event->file_open(vis, file);
 	return file;
@@ -431,6 +626,12 @@ Vis *vis_new(Ui *ui, VisEvent *event) {
 	vis->ui->init(vis->ui, vis);
 	vis->tabwidth = 8;
 	vis->expandtab = false;
+	vis->stdin_fd = -1;
+#ifdef __linux__
+	vis->inotify = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+#else
+	vis->inotify = -1;
+#endif
 	vis->registers[VIS_REG_BLACKHOLE].type = REGISTER_BLACKHOLE;
 	vis->registers[VIS_REG_CLIPBOARD].type = REGISTER_CLIPBOARD;
 	array_init(&vis->motions);
@@ -472,6 +673,10 @@ void vis_free(Vis *vis) {
 	file_free(vis, vis->command_file);
 	file_free(vis, vis->search_file);
 	file_free(vis, vis->error_file);
+	if (vis->inotify != -1)
+		close(vis->inotify);
+	if (vis->stdin_fd != -1)
+		close(vis->stdin_fd);
 	for (int i = 0; i < LENGTH(vis->registers); i++)
 		register_release(&vis->registers[i]);
 	vis->ui->free(vis->ui);
@@ -883,6 +1088,8 @@ bool vis_signal_handler(Vis *vis, int signum, const siginfo_t *siginfo, const vo
 				file->truncated = true;
 		}
 		vis->sigbus = true;
+		/* possibly raised by a search thread, which has to unwind by itself */
+		text_regex_sigbus();
 		if (vis->running)
 			siglongjmp(vis->sigbus_jmpbuf, 1);
 		return true;
@@ -895,7 +1102,7 @@ bool vis_signal_handler(Vis *vis, int signum, const siginfo_t *siginfo, const vo
 
 static void vis_args(Vis *vis, int argc, char *argv[]) {
 	char *cmd = NULL;
-	bool end_of_options = false;
+	bool end_of_options = false, recover = false;
 	for (int i = 1; i < argc; i++) {
 		if (argv[i][0] == '-' && !end_of_options) {
 			switch (argv[i][1]) {
@@ -905,6 +1112,9 @@ static void vis_args(Vis *vis, int argc, char *argv[]) {
 			case 'v':
 				vis_die(vis, "vis %s\n", VERSION);
 				break;
+			case 'r':
+				recover = true;
+				break;
 			case '\0':
 				break;
 			default:
@@ -915,9 +1125,14 @@ static void vis_args(Vis *vis, int argc, char *argv[]) {
 			cmd = argv[i] + (argv[i][1] == '/' || argv[i][1] == '?');
 		} else if (!vis_window_new(vis, argv[i])) {
 			vis_die(vis, "Can not load `%s': %s\n", argv[i], strerror(errno));
-		} else if (cmd) {
-			vis_prompt_cmd(vis, cmd);
-			cmd = NULL;
+		} else {
+			File *file = vis->win->file;
+			if (recover && !(text_swap_file(file->text, file->name) && text_swap_recover(file->text)))
+				vis_info_show(vis, "Can not recover `%s': %s", argv[i], strerror(errno));
+			if (cmd) {
+				vis_prompt_cmd(vis, cmd);
+				cmd = NULL;
+			}
 		}
 	}
 
@@ -925,16 +1140,24 @@ static void vis_args(Vis *vis, int argc, char *argv[]) {
 		if (!strcmp(argv[argc-1], "-")) {
 			if (!vis_window_new(vis, NULL))
 				vis_die(vis, "Can not create empty buffer\n");
-			ssize_t len = 0;
-			char buf[PIPE_BUF];
 			File *file = vis->win->file;
-			Text *txt = file->text;
 			file->is_stdin = true;
-			while ((len = read(STDIN_FILENO, buf, sizeof buf)) > 0)
-				text_insert(txt, text_size(txt), buf, len);
-			if (len == -1)
-				vis_die(vis, "Can not read from stdin\n");
-			text_snapshot(txt);
+			if (isatty(STDIN_FILENO)) {
+				ssize_t len = 0;
+				char buf[PIPE_BUF];
+				Text *txt = file->text;
+				while ((len = read(STDIN_FILENO, buf, sizeof buf)) > 0)
+					text_insert(txt, text_size(txt), buf, len);
+				if (len == -1)
+					vis_die(vis, "Can not read from stdin\n");
+				text_snapshot(txt);
+			} else {
+				/* keep reading from the main loop while the content is displayed */
+				if ((vis->stdin_fd = dup(STDIN_FILENO)) == -1)
+					vis_die(vis, "Can not read from stdin\n");
+				fcntl(vis->stdin_fd, F_SETFD, FD_CLOEXEC);
+				fcntl(vis->stdin_fd, F_SETFL, fcntl(vis->stdin_fd, F_GETFL) | O_NONBLOCK);
+			}
 			int fd = open("/dev/tty", O_RDONLY);
 			if (fd == -1)
 				vis_die(vis, "Can not reopen stdin\n");
@@ -948,13 +1171,22 @@ static void vis_args(Vis *vis, int argc, char *argv[]) {
 	}
 }
 
+/* milliseconds of a monotonic clock */
+static long long clock_ms(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
 int vis_run(Vis *vis, int argc, char *argv[]) {
 	vis->running = true;
 	vis_args(vis, argc, argv);
 
 	if (vis->event && vis->event->vis_start)
 		vis->event->vis_start(vis);
-	struct timespec idle = { .tv_nsec = 0 }, *timeout = NULL;
+	/* deadlines of the idle handler and of syncing unsaved modifications to
+	 * the swap files once typing pauses, independent of other wakeups */
+	long long idle = -1, swap = -1;
 
 	sigset_t emptyset;
 	sigemptyset(&emptyset);
@@ -967,6 +1199,10 @@ int vis_run(Vis *vis, int argc, char *argv[]) {
 		fd_set fds;
 		FD_ZERO(&fds);
 		FD_SET(STDIN_FILENO, &fds);
+		if (vis->inotify != -1)
+			FD_SET(vis->inotify, &fds);
+		if (vis->stdin_fd != -1)
+			FD_SET(vis->stdin_fd, &fds);
 
 		if (vis->sigbus) {
 			char *name = NULL;
@@ -987,20 +1223,46 @@ int vis_run(Vis *vis, int argc, char *argv[]) {
 		}
 
 		vis_update(vis);
-		idle.tv_sec = vis->mode->idle_timeout;
-		int r = pselect(1, &fds, NULL, NULL, timeout, &emptyset);
+		/* only poll without blocking while a load actually makes progress */
+		bool loading = files_loading(vis);
+		struct timespec timeout, *wait = NULL;
+		long long deadline = loading ? 0 : swap == -1 ? idle : idle == -1 ? swap : MIN(idle, swap);
+		if (deadline != -1) {
+			long long ms = MAX(deadline - clock_ms(), 0);
+			timeout = (struct timespec){ .tv_sec = ms / 1000, .tv_nsec = ms % 1000 * 1000000 };
+			wait = &timeout;
+		}
+		int nfds = MAX(STDIN_FILENO, MAX(vis->inotify, vis->stdin_fd)) + 1;
+		int r = pselect(nfds, &fds, NULL, NULL, wait, &emptyset);
 		if (r == -1 && errno == EINTR)
 			continue;
 
 		if (r < 0) {
-			/* TODO save all pending changes to a ~suffixed file */
+			/* keep all pending changes recoverable by means of `vis -r' */
+			files_sync(vis);
 			vis_die(vis, "Error in mainloop: %s\n", strerror(errno));
 		}
 
+		if (r > 0 && vis->inotify != -1 && FD_ISSET(vis->inotify, &fds))
+			files_watch(vis);
+		if (r > 0 && vis->stdin_fd != -1 && FD_ISSET(vis->stdin_fd, &fds))
+			file_stream(vis);
+
 		if (!FD_ISSET(STDIN_FILENO, &fds)) {
-			if (vis->mode->idle)
-				vis->mode->idle(vis);
-			timeout = NULL;
+			if (loading) {
+				files_load(vis);
+				continue;
+			}
+			long long now = clock_ms();
+			if (swap != -1 && now >= swap) {
+				files_sync(vis);
+				swap = -1;
+			}
+			if (idle != -1 && now >= idle) {
+				if (vis->mode->idle)
+					vis->mode->idle(vis);
+				idle = -1;
+			}
 			continue;
 		}
 
@@ -1011,8 +1273,9 @@ int vis_run(Vis *vis, int argc, char *argv[]) {
 		while ((key = getkey(vis)))
 			vis_keys_feed(vis, key);
 
-		if (vis->mode->idle)
-			timeout = &idle;
+		long long now = clock_ms();
+		swap = now + SWAP_DELAY;
+		idle = vis->mode->idle ? now + vis->mode->idle_timeout * 1000LL : -1;
 	}
 	return vis->exit_status;
 }
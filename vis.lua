@@ -310,6 +310,10 @@ vis.events.win_status = function(win)
 	table.insert(left_parts, (file.name or '[No Name]') ..
 		(file.modified and ' [+]' or '') .. (vis.recording and ' @' or ''))
 
+	if file.loaded < 100 then
+		table.insert(right_parts, "loading "..file.loaded.."%")
+	end
+
 	if file.newlines ~= "nl" then
 		table.insert(right_parts, "␊")
 	end